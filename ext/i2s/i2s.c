@@ -24,6 +24,18 @@
 
 #include "i2s.h"
 
+/**
+ * Q15 gain of each volume step: +6 dB down to -48 dB in 1.5 dB steps,
+ * then mute.
+ */
+static const int32_t i2s_volume_gain[I2S_VOLUME_MAX + 1] = {
+    65381, 55011, 46286, 38945, 32768, 27571, 23198, 19519,
+    16423, 13818, 11627, 9783, 8231, 6925, 5827, 4903,
+    4125, 3471, 2920, 2457, 2068, 1740, 1464, 1232,
+    1036, 872, 734, 617, 519, 437, 368, 309,
+    260, 219, 184, 155, 130, 0
+};
+
 /**
  * return the default i2s context used to store information about the setup
  */
@@ -36,8 +48,16 @@ i2s_config_t i2s_get_default_config(void) {
         .pio = pio0,
         .sm = 0,
         .dma_channel = 0,
-        .dma_buf = NULL,
+        .dma_ctrl_channel = 0,
+        .dma_buf = {NULL},
         .dma_trans_count = 0,
+        .dma_buf_count = 2,
+        .dma_next = 0,
+        .dma_slot = 0,
+        .dma_queue = {NULL},
+        .dma_started = false,
+        .underruns = 0,
+        .waits = 0,
         .volume = 0,
     };
 
@@ -61,34 +81,76 @@ void i2s_init(i2s_config_t *i2s_config) {
     audio_i2s_program_init(i2s_config->pio, i2s_config->sm , offset, i2s_config->data_pin , i2s_config->clock_pin_base);
     
     /* Set PIO clock */
-    uint32_t system_clock_frequency = clock_get_hz(clk_sys);
-    uint32_t divider = system_clock_frequency * 4 / i2s_config->sample_freq; // avoid arithmetic overflow
-    pio_sm_set_clkdiv_int_frac(i2s_config->pio, i2s_config->sm , divider >> 8u, divider & 0xffu);
+    i2s_set_sample_freq(i2s_config, i2s_config->sample_freq);
 
     pio_sm_set_enabled(i2s_config->pio, i2s_config->sm, false);
 
-    /* Allocate memory for the DMA buffer */
-    i2s_config->dma_buf=malloc(i2s_config->dma_trans_count*sizeof(uint32_t));
-
-    /* Direct Memory Access setup */
+    /* Two DMA channels, whatever the number of buffers. dma_channel plays
+     * a buffer, then chains to dma_ctrl_channel, which writes the next
+     * entry of dma_queue to its read address trigger. A NULL entry is a
+     * null trigger: the output stops there until i2s_dma_submit() restarts
+     * it. */
+    if(i2s_config->dma_buf_count<2) i2s_config->dma_buf_count=2;
+    if(i2s_config->dma_buf_count>I2S_DMA_BUFFERS) i2s_config->dma_buf_count=I2S_DMA_BUFFERS;
+    for(uint8_t i=0;i<i2s_config->dma_buf_count;i++) {
+        /* Allocate memory for the DMA buffer */
+        i2s_config->dma_buf[i]=calloc(i2s_config->dma_trans_count,sizeof(uint32_t));
+    }
+    for(uint8_t i=0;i<I2S_DMA_BUFFERS;i++) {
+        i2s_config->dma_queue[i] = NULL;
+    }
     i2s_config->dma_channel = dma_claim_unused_channel(true);
-    
+    i2s_config->dma_ctrl_channel = dma_claim_unused_channel(true);
+    i2s_config->dma_next = 0;
+    i2s_config->dma_slot = 0;
+    i2s_config->dma_started = false;
+    i2s_config->underruns = 0;
+    i2s_config->waits = 0;
+
     dma_channel_config dma_config = dma_channel_get_default_config(i2s_config->dma_channel);
     channel_config_set_read_increment(&dma_config, true);
     channel_config_set_write_increment(&dma_config, false);
     channel_config_set_dreq(&dma_config, pio_get_dreq(i2s_config->pio, i2s_config->sm, true));
     channel_config_set_transfer_data_size(&dma_config, DMA_SIZE_32);
+    channel_config_set_chain_to(&dma_config, i2s_config->dma_ctrl_channel);
     dma_channel_configure(i2s_config->dma_channel,
                           &dma_config,
                           &(i2s_config->pio->txf[i2s_config->sm]),    // Destination pointer
-                          i2s_config->dma_buf,                        // Source pointer
+                          i2s_config->dma_buf[0],                     // Source pointer
                           i2s_config->dma_trans_count,                // Number of 32 bits words to transfer
                           false                                       // Start immediately
     );
 
+    /* One address per trigger, wrapping around dma_queue. */
+    dma_channel_config ctrl_config = dma_channel_get_default_config(i2s_config->dma_ctrl_channel);
+    channel_config_set_read_increment(&ctrl_config, true);
+    channel_config_set_write_increment(&ctrl_config, false);
+    channel_config_set_transfer_data_size(&ctrl_config, DMA_SIZE_32);
+    channel_config_set_ring(&ctrl_config, false, __builtin_ctz(sizeof(i2s_config->dma_queue)));
+    dma_channel_configure(i2s_config->dma_ctrl_channel,
+                          &ctrl_config,
+                          &dma_channel_hw_addr(i2s_config->dma_channel)->al3_read_addr_trig,
+                          &i2s_config->dma_queue[0],
+                          1,
+                          false
+    );
+
     pio_sm_set_enabled(i2s_config->pio, i2s_config->sm , true);
 }
 
+/**
+ * Set the output sample rate by recomputing the PIO clock divider
+ * i2s_config: I2S context obtained by i2s_get_default_config()
+ * sample_freq: sample rate in Hz (e.g. 32768, 44100 or 48000)
+ */
+void i2s_set_sample_freq(i2s_config_t *i2s_config, uint32_t sample_freq) {
+    /* 64 PIO cycles per stereo sample, divider in 8.8 fixed point */
+    uint32_t system_clock_frequency = clock_get_hz(clk_sys);
+    uint32_t divider = (system_clock_frequency * 4 + sample_freq / 2) / sample_freq; // avoid arithmetic overflow
+    i2s_config->sample_freq = sample_freq;
+    pio_sm_set_clkdiv_int_frac(i2s_config->pio, i2s_config->sm , divider >> 8u, divider & 0xffu);
+}
+
 /**
  * Write samples to I2S directly and wait for completion (blocking)
  * i2s_config: I2S context obtained by i2s_get_default_config()
@@ -104,35 +166,157 @@ void i2s_write(const i2s_config_t *i2s_config,const int16_t *samples,const size_
 }
 
 /**
- * Write samples to DMA buffer and initiate DMA transfer (non blocking)
+ * Return true while the DMA still has to read from buf
+ */
+static bool i2s_dma_playing(const i2s_config_t *i2s_config, const int16_t *buf) {
+    uint channel = i2s_config->dma_channel;
+    uint32_t offset = dma_channel_hw_addr(channel)->read_addr - (uint32_t)buf;
+    return dma_channel_is_busy(channel) &&
+           offset < i2s_config->dma_trans_count * sizeof(uint32_t);
+}
+
+/**
+ * Return the next DMA buffer to be filled with dma_trans_count x 32 bits
+ * samples, waiting only while it is still being played. The samples are
+ * played once the buffer is passed back with i2s_dma_submit().
+ * i2s_config: I2S context obtained by i2s_get_default_config()
+ */
+int16_t *i2s_dma_acquire(i2s_config_t *i2s_config) {
+    int16_t *buf = i2s_config->dma_buf[i2s_config->dma_next];
+    if(i2s_dma_playing(i2s_config, buf)) {
+        i2s_config->waits++;
+        /* Not dma_channel_wait_for_finish_blocking(), the channel goes
+         * straight on with the buffers queued behind this one. */
+        while(i2s_dma_playing(i2s_config, buf)) {
+            tight_loop_contents();
+        }
+    }
+    return buf;
+}
+
+/**
+ * Queue the buffer returned by i2s_dma_acquire() behind the one being
+ * played (non blocking). If the output already ran dry, count an underrun
+ * and restart it from this buffer.
+ * i2s_config: I2S context obtained by i2s_get_default_config()
+ */
+void i2s_dma_submit(i2s_config_t *i2s_config) {
+    uint8_t slot = i2s_config->dma_slot;
+    uint8_t after = (slot + 1) % I2S_DMA_BUFFERS;
+    uint channel = i2s_config->dma_channel;
+    uint ctrl_channel = i2s_config->dma_ctrl_channel;
+    int16_t *buf = i2s_config->dma_buf[i2s_config->dma_next];
+
+    /* Terminate the queue behind this buffer before appending it. At most
+     * dma_buf_count - 2 entries are waiting in front of this one, so the
+     * entry after is not one the control channel has still to read. */
+    i2s_config->dma_queue[after] = NULL;
+    i2s_config->dma_queue[slot] = buf;
+
+    /* The control channel runs for a few cycles at most. Once it has read
+     * past this entry, the buffer is playing unless it read the NULL that
+     * was there before, which stopped the output. */
+    while(dma_channel_is_busy(ctrl_channel)) {
+        tight_loop_contents();
+    }
+    bool stopped = dma_channel_hw_addr(ctrl_channel)->read_addr ==
+                   (uint32_t)&i2s_config->dma_queue[after] &&
+                   !dma_channel_is_busy(channel);
+    if(!i2s_config->dma_started || stopped) {
+        if(i2s_config->dma_started) {
+            i2s_config->underruns++;
+        }
+        i2s_config->dma_started = true;
+        dma_channel_set_read_addr(ctrl_channel, &i2s_config->dma_queue[after], false);
+        dma_channel_set_read_addr(channel, buf, true);
+    }
+
+    i2s_config->dma_slot = after;
+    i2s_config->dma_next = (i2s_config->dma_next + 1) % i2s_config->dma_buf_count;
+}
+
+/**
+ * Return the number of 32 bits samples queued for output: what is left of
+ * the buffer being played and the full buffers queued behind it.
+ * Only reads DMA registers and dma_queue, so it may be called from either
+ * core.
+ * i2s_config: I2S context obtained by i2s_get_default_config()
+ */
+uint32_t i2s_dma_fill(const i2s_config_t *i2s_config) {
+    uint channel = i2s_config->dma_channel;
+    uint32_t fill = 0;
+    if(dma_channel_is_busy(channel)) {
+        fill = dma_channel_hw_addr(channel)->transfer_count;
+    }
+
+    /* Follow the queue from the entry the control channel reads next up
+     * to the NULL that ends it. */
+    uint32_t next = dma_channel_hw_addr(i2s_config->dma_ctrl_channel)->read_addr;
+    uint8_t slot = (next - (uint32_t)&i2s_config->dma_queue[0]) / sizeof(int16_t *);
+    for(uint8_t i=0;i<I2S_DMA_BUFFERS;i++) {
+        if(i2s_config->dma_queue[(slot + i) % I2S_DMA_BUFFERS] == NULL) {
+            break;
+        }
+        fill += i2s_config->dma_trans_count;
+    }
+
+    return fill;
+}
+
+/**
+ * Write samples to the next DMA buffer and queue it (non blocking unless
+ * both buffers are still queued)
  * i2s_config: I2S context obtained by i2s_get_default_config()
  *     sample: pointer to an array of dma_trans_count x 32 bits samples
  */
 void i2s_dma_write(i2s_config_t *i2s_config,const int16_t *samples) {
-    /* Wait the completion of the previous DMA transfer */
-    dma_channel_wait_for_finish_blocking(i2s_config->dma_channel);
-    /* Copy samples into the DMA buffer */
-    if(i2s_config->volume==0) {
-        memcpy(i2s_config->dma_buf,samples,i2s_config->dma_trans_count*sizeof(int32_t));
-    } else {
-        for(uint16_t i=0;i<i2s_config->dma_trans_count*2;i++) {
-            i2s_config->dma_buf[i] = samples[i]>>i2s_config->volume;
+    int16_t *buf = i2s_dma_acquire(i2s_config);
+    i2s_apply_gain((uint32_t *)buf, (const uint32_t *)samples,
+                   i2s_config->dma_trans_count, i2s_gain(i2s_config));
+    i2s_dma_submit(i2s_config);
+}
+
+/**
+ * Copy stereo samples applying a Q15 gain with saturation (dst may be src)
+ *  dst, src: arrays of count x 32 bits samples, left channel in the low half
+ *      gain: Q15 gain, I2S_GAIN_UNITY leaves the samples as they are
+ */
+void i2s_apply_gain(uint32_t *dst, const uint32_t *src, uint32_t count, int32_t gain) {
+    if(gain==I2S_GAIN_UNITY) {
+        if(dst!=src) {
+            memcpy(dst,src,count*sizeof(uint32_t));
         }
+        return;
     }
-    
-    /* Initiate the DMA transfer */
-    dma_channel_transfer_from_buffer_now(i2s_config->dma_channel,
-                                         i2s_config->dma_buf,
-                                         i2s_config->dma_trans_count);
+
+    for(uint32_t i=0;i<count;i++) {
+        uint32_t pair = src[i];
+        int32_t left = ((int16_t)pair * gain) >> 15;
+        int32_t right = ((int16_t)(pair >> 16) * gain) >> 15;
+        if(left > INT16_MAX) left = INT16_MAX;
+        if(left < INT16_MIN) left = INT16_MIN;
+        if(right > INT16_MAX) right = INT16_MAX;
+        if(right < INT16_MIN) right = INT16_MIN;
+        dst[i] = (uint16_t)left | ((uint32_t)(uint16_t)right << 16);
+    }
+}
+
+/**
+ * Return the Q15 gain of the current volume step
+ * i2s_config: I2S context obtained by i2s_get_default_config()
+ */
+int32_t i2s_gain(const i2s_config_t *i2s_config) {
+    return i2s_volume_gain[i2s_config->volume];
 }
 
 /**
  * Adjust the output volume
  * i2s_config: I2S context obtained by i2s_get_default_config()
- *     volume: desired volume between 0 (highest. volume) and 16 (lowest volume)
+ *     volume: desired volume between 0 (highest volume, +6 dB) and
+ *             I2S_VOLUME_MAX (muted), in 1.5 dB steps; 4 is unity gain
  */
 void i2s_volume(i2s_config_t *i2s_config,uint8_t volume) {
-    if(volume>16) volume=16;
+    if(volume>I2S_VOLUME_MAX) volume=I2S_VOLUME_MAX;
     i2s_config->volume=volume;
 }
 
@@ -149,7 +333,7 @@ void i2s_increase_volume(i2s_config_t *i2s_config) {
  * Decreases the output volume
  */
 void i2s_decrease_volume(i2s_config_t *i2s_config) {
-    if(i2s_config->volume<16) {
+    if(i2s_config->volume<I2S_VOLUME_MAX) {
         i2s_config->volume++;
     }
 }
@@ -24,6 +24,7 @@
 
 #pragma once
 
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include <hardware/pio.h>
@@ -31,6 +32,17 @@
 #include <hardware/dma.h>
 #include "audio_i2s.pio.h"
 
+/* Volume steps (see i2s_volume()) and the Q15 gain of 1.0. */
+#define I2S_VOLUME_MAX  37
+#define I2S_GAIN_UNITY  32768
+
+/* Most DMA buffers played in turn, see dma_buf_count. A power of two, the
+ * queue of buffer addresses is walked by a DMA read ring of this size. */
+#define I2S_DMA_BUFFERS 8
+
+/* DMA channels claimed by i2s_init(), however many buffers there are. */
+#define I2S_DMA_CHANNELS 2
+
 typedef struct i2s_config 
 {
     uint32_t sample_freq;        
@@ -39,17 +51,33 @@ typedef struct i2s_config
     uint8_t  clock_pin_base;
     PIO      pio;
     uint8_t  sm; 
-    uint8_t  dma_channel;
+    uint8_t  dma_channel;               // Plays the buffers into the PIO
+    uint8_t  dma_ctrl_channel;          // Loads dma_channel with the next queued buffer
     uint16_t dma_trans_count;
-    uint16_t *dma_buf;
+    int16_t  *dma_buf[I2S_DMA_BUFFERS];
+    uint8_t  dma_buf_count;             // Buffers in the ring, 2 to I2S_DMA_BUFFERS
+    uint8_t  dma_next;                  // Buffer returned by i2s_dma_acquire
+    uint8_t  dma_slot;                  // dma_queue entry of the next submitted buffer
+    /* Queued buffers in play order, the entry after the last one is NULL. */
+    int16_t  *volatile dma_queue[I2S_DMA_BUFFERS]
+        __attribute__((aligned(I2S_DMA_BUFFERS * sizeof(int16_t *))));
+    bool     dma_started;
+    volatile uint32_t underruns;        // Output stopped before the next buffer was queued
+    volatile uint32_t waits;            // i2s_dma_acquire() calls that had to block
     uint8_t volume;
 } i2s_config_t;
 
 
 i2s_config_t i2s_get_default_config(void);
 void i2s_init(i2s_config_t *i2s_config);
+void i2s_set_sample_freq(i2s_config_t *i2s_config, uint32_t sample_freq);
 void i2s_write(const i2s_config_t *i2s_config,const int16_t *samples,const size_t len);
 void i2s_dma_write(i2s_config_t *i2s_config,const int16_t *samples);
+int16_t *i2s_dma_acquire(i2s_config_t *i2s_config);
+void i2s_dma_submit(i2s_config_t *i2s_config);
+uint32_t i2s_dma_fill(const i2s_config_t *i2s_config);
+void i2s_apply_gain(uint32_t *dst, const uint32_t *src, uint32_t count, int32_t gain);
+int32_t i2s_gain(const i2s_config_t *i2s_config);
 void i2s_volume(i2s_config_t *i2s_config,uint8_t volume);
 void i2s_increase_volume(i2s_config_t *i2s_config);
 void i2s_decrease_volume(i2s_config_t *i2s_config);
@@ -7,14 +7,7 @@
 
 void ili9225_blit(uint16_t *fbuf, uint8_t x, uint8_t y, uint8_t w, uint8_t h) {
     ili9225_set_window(x, w, y, h);
-    ili9225_write_cmd(ILI9225_REG_GRAM_RW);
-    ili9225_set_rc_cs(1, 0);
-
-    for(uint8_t i = 0; i < (w * h); i++) {
-        ili9225_write_pixel(fbuf[i]);
-    }
-
-    ili9225_set_rc_cs(1, 1);
+    ili9225_write_pixels(fbuf, w * h);
 }
 
 void ili9225_get_letter(uint16_t *fbuf, char l,uint16_t color,uint16_t bgcolor) {
@@ -2,12 +2,16 @@
 #include "hardware/dma.h"
 #include "hardware/pio.h"
 #include "hardware/gpio.h"
+#include "hardware/irq.h"
+#include "hardware/sync.h"
 
 #include "ili9225_lcd.h"
+#include "ili9225_line.h"
 #include "ili9225_lcd.pio.h"
 
 /**
  * TODO: Make these definitions part of configuration.
+ * CLK must follow CS, both are driven by PIO side-set.
  */
 #define ILI9225_PIN_CS 17
 #define ILI9225_PIN_CLK 18
@@ -32,41 +36,162 @@ static PIO pio = pio1;
 static uint sm = 0;
 static int dma_chan;
 
+/* Register lists are sent by cmd_chan, see ili9225_write_registers(). */
+static int cmd_chan;
+static struct reg_dat_pair window_cmds[6];
 
-struct reg_dat_pair {
-    uint16_t reg;
-    uint16_t dat;
-};
+/* Solid fills repeat fill_color without incrementing the read address. */
+static int fill_chan;
+static uint16_t fill_color;
 
+/**
+ * Indexed pixel expander.
+ * feed_chan pushes packed 4-bit indexes into the ili9225_palette program,
+ * addr_chan takes each palette entry address it produces and triggers
+ * pixel_chan, which copies that RGB565 entry into the LCD FIFO and chains
+ * back to addr_chan.
+ */
+static uint sm_expand = 1;
+static int feed_chan;
+static int addr_chan;
+static int pixel_chan;
+static uint16_t __attribute__((aligned(32))) palette_table[16];
+static ili9225_pixel_format_e pixel_format = ILI9225_PIXEL_RGB565;
 
-void ili9225_set_rc_cs(bool rc, bool cs) {
-    sleep_us(1);
-    gpio_put_masked(
-        (1u << ILI9225_PIN_RS) | (1u << ILI9225_PIN_CS),
-        !!rc << ILI9225_PIN_RS | !!cs << ILI9225_PIN_CS
-    );
-    sleep_us(1);
+/**
+ * Ring of scanline buffers streamed to the LCD by DMA.
+ * The producer (emulator) fills the buffer at ring.head while the DMA
+ * completion IRQ walks from ring.tail, starting the next queued buffer as
+ * soon as the previous one is done. The producer only has to wait when all
+ * buffers are queued. Buffers are word aligned so they can be filled with
+ * 32-bit stores.
+ */
+static uint16_t __attribute__((aligned(4))) line_ring[ILI9225_LINE_RING_DEPTH][LINE_HEADER_LENGTH + ILI9225_SCREEN_WIDTH];
+static uint16_t line_length[ILI9225_LINE_RING_DEPTH];
+static uint8_t line_y[ILI9225_LINE_RING_DEPTH];
+static ili9225_line_ring_t ring = { 0 };
+static uint32_t line_stalls = 0;
+static uint32_t line_stall_us = 0;
+/* Channel draining the ring: dma_chan or feed_chan, see pixel_format. */
+static int line_chan;
+
+
+static void ili9225_line_start(uint_fast8_t i) {
+    uint16_t *buf = line_ring[i];
+
+    if(pixel_format == ILI9225_PIXEL_INDEXED4) {
+        /* The previous line had at least ILI9225_INDEXED4_MIN_LENGTH
+         * pixels behind its header, so the header has been expanded and
+         * its entries can be reused for this one. */
+        ili9225_palette_header(palette_table, line_y[i], line_length[i]);
+        dma_channel_transfer_from_buffer_now(feed_chan,
+            ili9225_line_feed(buf), ili9225_line_feed_words(line_length[i]));
+    } else {
+        dma_channel_transfer_from_buffer_now(dma_chan,
+            buf, LINE_HEADER_LENGTH + line_length[i]);
+    }
 }
 
-void ili9225_write_cmd(const uint16_t cmd) {
-    ili9225_lcd_wait_idle(pio, sm);
-    ili9225_set_rc_cs(0, 0);
-    ili9225_lcd_put(pio, sm, cmd);
-    ili9225_lcd_wait_idle(pio, sm);
-    ili9225_set_rc_cs(1, 1);
+static void ili9225_line_dma_isr(void) {
+    if(!dma_channel_get_irq1_status(line_chan))
+        return;
+    dma_channel_acknowledge_irq1(line_chan);
+
+    if(ili9225_line_ring_pop(&ring))
+        ili9225_line_start(ring.tail);
 }
 
-void ili9225_write_data(const uint16_t data) {
-    ili9225_lcd_wait_idle(pio, sm);
-    ili9225_set_rc_cs(1, 0);
-    ili9225_lcd_put(pio, sm, data);
+static void ili9225_expander_init(void) {
+    uint offset = pio_add_program(pio, &ili9225_palette_program);
+    pio_sm_claim(pio, sm_expand);
+    ili9225_palette_program_init(pio, sm_expand, offset, palette_table);
+
+    ili9225_palette_header(palette_table, 0, 0);
+
+    feed_chan = dma_claim_unused_channel(true);
+    addr_chan = dma_claim_unused_channel(true);
+    pixel_chan = dma_claim_unused_channel(true);
+
+    dma_channel_config c = dma_channel_get_default_config(feed_chan);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+    channel_config_set_read_increment(&c, true);
+    channel_config_set_write_increment(&c, false);
+    channel_config_set_dreq(&c, pio_get_dreq(pio, sm_expand, true));
+    dma_channel_configure(feed_chan, &c, &pio->txf[sm_expand], NULL, 0, false);
+
+    c = dma_channel_get_default_config(pixel_chan);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_16);
+    channel_config_set_read_increment(&c, false);
+    channel_config_set_write_increment(&c, false);
+    channel_config_set_dreq(&c, pio_get_dreq(pio, sm, true));
+    channel_config_set_chain_to(&c, addr_chan);
+    dma_channel_configure(pixel_chan, &c, &pio->txf[sm], palette_table, 1, false);
+
+    /* One address per trigger; the transfer count reloads on every chain
+     * from pixel_chan, so addr_chan stays armed waiting for the next index. */
+    c = dma_channel_get_default_config(addr_chan);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+    channel_config_set_read_increment(&c, false);
+    channel_config_set_write_increment(&c, false);
+    channel_config_set_dreq(&c, pio_get_dreq(pio, sm_expand, false));
+    dma_channel_configure(addr_chan, &c,
+        &dma_channel_hw_addr(pixel_chan)->al3_read_addr_trig,
+        &pio->rxf[sm_expand], 1, true);
+
+    dma_channel_set_irq1_enabled(feed_chan, true);
+}
+
+static void ili9225_expander_wait_idle(void) {
+    /* All indexes turned into addresses... */
+    ili9225_palette_wait_idle(pio, sm_expand);
+    /* ...and all addresses turned into pixels. */
+    while(!pio_sm_is_rx_fifo_empty(pio, sm_expand)
+            || dma_channel_hw_addr(addr_chan)->transfer_count != 1
+            || dma_channel_is_busy(pixel_chan))
+        tight_loop_contents();
+}
+
+/**
+ * Waits until every DMA source has handed its data to the LCD FIFO, so
+ * that anything pushed next is sent after it.
+ */
+static void ili9225_wait_dma_idle(void) {
+    ili9225_line_flush();
+    dma_channel_wait_for_finish_blocking(cmd_chan);
+    dma_channel_wait_for_finish_blocking(fill_chan);
+}
+
+void ili9225_wait_idle(void) {
+    ili9225_wait_dma_idle();
     ili9225_lcd_wait_idle(pio, sm);
-    ili9225_set_rc_cs(1, 1);
 }
 
 void ili9225_set_register(uint16_t reg, uint16_t data) {
-    ili9225_write_cmd(reg);
-    ili9225_write_data(data);
+    ili9225_wait_dma_idle();
+    ili9225_lcd_put(pio, sm, reg);
+    ili9225_lcd_put(pio, sm, data);
+}
+
+void ili9225_write_registers(const struct reg_dat_pair *cmds, uint16_t count) {
+    ili9225_wait_dma_idle();
+    dma_channel_transfer_from_buffer_now(cmd_chan, cmds,
+        count * (sizeof(struct reg_dat_pair) / sizeof(uint16_t)));
+}
+
+static void ili9225_dma_init(int chan, bool read_increment) {
+    dma_channel_config c = dma_channel_get_default_config(chan);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_16);
+    channel_config_set_read_increment(&c, read_increment);
+    channel_config_set_write_increment(&c, false);
+    channel_config_set_dreq(&c, pio_get_dreq(pio, sm, true));
+    dma_channel_configure(
+        chan,
+        &c,
+        &pio->txf[sm],    // Write address.
+        NULL,             // Don't provide a read address yet.
+        0,                // Don't provide a read length yet.
+        false             // Don't start yet.
+    );
 }
 
 void ili9225_init(void) {
@@ -83,34 +208,38 @@ void ili9225_init(void) {
 
     /* Reset the LCD. */
     gpio_put(ILI9225_PIN_RESET, 1);
-    ili9225_set_rc_cs(0, 1);
+    gpio_put(ILI9225_PIN_RS, 0);
+    gpio_put(ILI9225_PIN_CS, 1);
     sleep_ms(1);
     gpio_put(ILI9225_PIN_RESET, 0);
     sleep_ms(10);
     gpio_put(ILI9225_PIN_RESET, 1);
     sleep_ms(50);
 
-    /* Setup PIO with ILI9225 program. */
+    /* Setup PIO with ILI9225 program. It takes over CS and RS from here. */
     uint offset = pio_add_program(pio, &ili9225_lcd_program);
-    ili9225_lcd_program_init(pio, sm, offset, ILI9225_PIN_DIN, ILI9225_PIN_CLK, SERIAL_CLK_DIV);
+    pio_sm_claim(pio, sm);
+    ili9225_lcd_program_init(pio, sm, offset, ILI9225_PIN_DIN, ILI9225_PIN_CS,
+        ILI9225_PIN_RS, ILI9225_REG_GRAM_RW, SERIAL_CLK_DIV);
 
     /* Setup DMA.
      * We will transfer 16bits data from the buffer given by user to
      * the PIO program. */
     dma_chan = dma_claim_unused_channel(true);
-    dma_channel_config c = dma_channel_get_default_config(dma_chan);
-    channel_config_set_transfer_data_size(&c, DMA_SIZE_16);
-    channel_config_set_read_increment(&c, true);
-    channel_config_set_write_increment(&c, false);
-    channel_config_set_dreq(&c, DREQ_PIO1_TX0);
-    dma_channel_configure(
-        dma_chan,
-        &c,
-        &pio1_hw->txf[0], // Write address.
-        NULL,             // Don't provide a read address yet.
-        0,                // Don't provide a read length yet.
-        false             // Don't start yet.
-    );
+    ili9225_dma_init(dma_chan, true);
+    cmd_chan = dma_claim_unused_channel(true);
+    ili9225_dma_init(cmd_chan, true);
+    fill_chan = dma_claim_unused_channel(true);
+    ili9225_dma_init(fill_chan, false);
+
+    ili9225_expander_init();
+
+    /* Completion of each scanline transfer starts the next queued one. */
+    line_chan = dma_chan;
+    dma_channel_set_irq1_enabled(dma_chan, true);
+    irq_add_shared_handler(DMA_IRQ_1, ili9225_line_dma_isr,
+        PICO_SHARED_IRQ_HANDLER_DEFAULT_ORDER_PRIORITY);
+    irq_set_enabled(DMA_IRQ_1, true);
 
     /* Switch on power control. */
     {
@@ -123,28 +252,28 @@ void ili9225_init(void) {
         /* CTRL4: GVDD is set to 4.68V. */
         /* CTRL5: Set VCM to 0.8030V. Set VML to 1.104V. */
         /* CTRL1: Set driving capability to "Medium Fast 1". */
-        const uint8_t regs[] = {
-            ILI9225_REG_PWR_CTRL2, ILI9225_REG_PWR_CTRL3,
-            ILI9225_REG_PWR_CTRL4, ILI9225_REG_PWR_CTRL5,
-            ILI9225_REG_PWR_CTRL1
-        };
-        const uint16_t dat[] = {
-            0x0018, 0x6121, 0x006F, 0x495F, 0x0800
+        static const struct reg_dat_pair cmds[] = {
+            { ILI9225_REG_PWR_CTRL2,    0x0018 },
+            { ILI9225_REG_PWR_CTRL3,    0x6121 },
+            { ILI9225_REG_PWR_CTRL4,    0x006F },
+            { ILI9225_REG_PWR_CTRL5,    0x495F },
+            { ILI9225_REG_PWR_CTRL1,    0x0800 }
         };
 
-        for(uint8_t i = 0; i < sizeof(regs); i++)
-            ili9225_set_register(regs[i], dat[i]);
+        ili9225_write_registers(cmds, ARRAYSIZE(cmds));
     }
+    ili9225_wait_idle();
     sleep_ms(10);
 
     /* Enable automatic booster operation, and amplifiers.
      * Set VCI1 to 2.76V.
      * FIXME: why is VCI1 changed from 2.58 to 2.76V? */
     ili9225_set_register(ILI9225_REG_PWR_CTRL2, 0x103B);
+    ili9225_wait_idle();
     sleep_ms(50);
 
     {
-        const struct reg_dat_pair cmds[] = {
+        static const struct reg_dat_pair cmds[] = {
             /* GRAM address of 0x0000 should be in top-left corner
              * when looking at the display in the "landscape" mode.
              * Set active lines NL to 528 * 220 dots. */
@@ -205,9 +334,9 @@ void ili9225_init(void) {
             { ILI9225_REG_DISPLAY_CTRL,      0x0012 }
         };
 
-        for(uint_fast8_t i = 0; i < (uint_fast8_t)ARRAYSIZE(cmds); i++)
-            ili9225_set_register(cmds[i].reg, cmds[i].dat);
+        ili9225_write_registers(cmds, ARRAYSIZE(cmds));
     }
+    ili9225_wait_idle();
     sleep_ms(50);
 
     /**
@@ -218,20 +347,30 @@ void ili9225_init(void) {
      * D: Switch on display.
      */
     ili9225_set_register(ILI9225_REG_DISPLAY_CTRL, 0x0017);
+    ili9225_wait_idle();
     sleep_ms(50);
 
 
     gpio_put(ILI9225_PIN_BL, 0);
 }
 
+void ili9225_fill_rect(uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint16_t color) {
+    /* x + w - 1 would wrap and open a window over the whole screen. */
+    if(w == 0 || h == 0)
+        return;
+
+    /* Waits for any previous fill before fill_color is reused. */
+    ili9225_set_window(x, w, y, h);
+    dma_channel_wait_for_finish_blocking(cmd_chan);
+    ili9225_lcd_put(pio, sm, ILI9225_REG_GRAM_RW);
+    ili9225_lcd_put(pio, sm, w * h);
+
+    fill_color = color;
+    dma_channel_transfer_from_buffer_now(fill_chan, &fill_color, (uint32_t)w * h);
+}
+
 void ili9225_fill(uint16_t color) {
-    ili9225_set_window(0, ILI9225_SCREEN_WIDTH, 0, ILI9225_SCREEN_HEIGHT);
-    ili9225_write_pixels_start(0, 0);
-    for(uint16_t i = 0; i < (ILI9225_SCREEN_WIDTH * ILI9225_SCREEN_HEIGHT); i++) {
-        ili9225_lcd_put(pio, sm, color);
-        ili9225_lcd_wait_idle(pio, sm);
-    }
-    ili9225_set_rc_cs(1, 1);
+    ili9225_fill_rect(0, 0, ILI9225_SCREEN_WIDTH, ILI9225_SCREEN_HEIGHT, color);
 }
 
 void ili9225_set_xy(uint8_t x, uint8_t y) {
@@ -239,36 +378,87 @@ void ili9225_set_xy(uint8_t x, uint8_t y) {
     ili9225_set_register(ILI9225_REG_RAM_ADDR_SET2, x);
 }
 
-void ili9225_write_pixels_start(uint8_t x, uint8_t y) {
-    ili9225_set_xy(x, y);
-    ili9225_write_cmd(ILI9225_REG_GRAM_RW);
-    ili9225_lcd_wait_idle(pio, sm);
-    ili9225_set_rc_cs(1, 0);
+uint16_t *ili9225_line_acquire(void) {
+    if(ili9225_line_ring_full(&ring)) {
+        uint32_t start = time_us_32();
+        while(ili9225_line_ring_full(&ring))
+            tight_loop_contents();
+        line_stalls++;
+        line_stall_us += time_us_32() - start;
+    }
+
+    return &line_ring[ring.head][LINE_HEADER_LENGTH];
+}
+
+void ili9225_line_submit(uint8_t y, uint16_t length) {
+    uint16_t *buf = line_ring[ring.head];
+
+    /* Register lists and fills are only started with the ring empty; let
+     * them reach the LCD FIFO before this line can. */
+    dma_channel_wait_for_finish_blocking(cmd_chan);
+    dma_channel_wait_for_finish_blocking(fill_chan);
+
+    if(pixel_format == ILI9225_PIXEL_INDEXED4) {
+        assert(length >= ILI9225_INDEXED4_MIN_LENGTH && length % 8 == 0);
+        ili9225_line_header_indexed4(buf);
+    } else {
+        ili9225_line_header_rgb565(buf, y, length);
+    }
+    line_y[ring.head] = y;
+    line_length[ring.head] = length;
+
+    uint32_t irq_state = save_and_disable_interrupts();
+    if(ili9225_line_ring_push(&ring)) {
+        /* DMA was idle; kick it off with this line. */
+        ili9225_line_start(ring.tail);
+    }
+    restore_interrupts(irq_state);
+}
+
+void ili9225_line_flush(void) {
+    while(ring.queued > 0)
+        tight_loop_contents();
+
+    if(pixel_format == ILI9225_PIXEL_INDEXED4)
+        ili9225_expander_wait_idle();
 }
 
-void ili9225_write_pixels_chunk(uint16_t *data, uint16_t length) {
-    dma_channel_wait_for_finish_blocking(dma_chan);
-    dma_channel_transfer_from_buffer_now(dma_chan, data, length);
+void ili9225_set_pixel_format(ili9225_pixel_format_e format) {
+    ili9225_line_flush();
+    pixel_format = format;
+    line_chan = (format == ILI9225_PIXEL_INDEXED4) ? feed_chan : dma_chan;
 }
 
-void ili9225_write_pixels_end(void) {
-    dma_channel_wait_for_finish_blocking(dma_chan);
-    ili9225_set_rc_cs(0, 1);
+void ili9225_set_palette(const uint16_t *colors, uint8_t count) {
+    if(count > PALETTE_HEADER_REG)
+        count = PALETTE_HEADER_REG;
+    for(uint8_t i = 0; i < count; i++)
+        palette_table[i] = colors[i];
 }
 
-void ili9225_write_pixels_wait(void) {
-    dma_channel_wait_for_finish_blocking(dma_chan);
+void ili9225_line_stats(uint32_t *stalls, uint32_t *stall_us) {
+    *stalls = line_stalls;
+    *stall_us = line_stall_us;
+    line_stalls = 0;
+    line_stall_us = 0;
 }
 
-void ili9225_write_pixel(uint16_t color) {
-    ili9225_set_register(ILI9225_REG_GRAM_RW, color);
+void ili9225_write_pixels(const uint16_t *data, uint16_t length) {
+    ili9225_wait_dma_idle();
+    ili9225_lcd_put(pio, sm, ILI9225_REG_GRAM_RW);
+    ili9225_lcd_put(pio, sm, length);
+    for(uint16_t i = 0; i < length; i++)
+        ili9225_lcd_put(pio, sm, data[i]);
 }
 
 void ili9225_set_window(uint16_t x_start, uint16_t x_length, uint16_t y_start, uint16_t y_length) {
-    ili9225_set_register(ILI9225_REG_HORI_WIN_ADDR1, y_start + y_length - 1);
-    ili9225_set_register(ILI9225_REG_HORI_WIN_ADDR2, y_start);
-    ili9225_set_register(ILI9225_REG_VERT_WIN_ADDR1, x_start + x_length - 1);
-    ili9225_set_register(ILI9225_REG_VERT_WIN_ADDR2, x_start);
-    ili9225_set_register(ILI9225_REG_RAM_ADDR_SET1, y_start);
-    ili9225_set_register(ILI9225_REG_RAM_ADDR_SET2, x_start);
+    /* Waits for the previous list before window_cmds is reused. */
+    ili9225_wait_dma_idle();
+    window_cmds[0] = (struct reg_dat_pair){ ILI9225_REG_HORI_WIN_ADDR1, y_start + y_length - 1 };
+    window_cmds[1] = (struct reg_dat_pair){ ILI9225_REG_HORI_WIN_ADDR2, y_start };
+    window_cmds[2] = (struct reg_dat_pair){ ILI9225_REG_VERT_WIN_ADDR1, x_start + x_length - 1 };
+    window_cmds[3] = (struct reg_dat_pair){ ILI9225_REG_VERT_WIN_ADDR2, x_start };
+    window_cmds[4] = (struct reg_dat_pair){ ILI9225_REG_RAM_ADDR_SET1, y_start };
+    window_cmds[5] = (struct reg_dat_pair){ ILI9225_REG_RAM_ADDR_SET2, x_start };
+    ili9225_write_registers(window_cmds, 6);
 }
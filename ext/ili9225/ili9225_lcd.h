@@ -4,6 +4,18 @@
 #define ILI9225_SCREEN_WIDTH 220
 #define ILI9225_SCREEN_HEIGHT 176
 
+/**
+ * Number of scanline buffers in the LCD DMA ring.
+ * One buffer is being converted by the caller while the others are queued
+ * or streaming out, so the caller only blocks when all of them are in use.
+ */
+#ifndef ILI9225_LINE_RING_DEPTH
+#define ILI9225_LINE_RING_DEPTH 4
+#endif
+
+/* DMA channels claimed by ili9225_init(). */
+#define ILI9225_DMA_CHANNELS 6
+
 
 /* ILI9225 Registers. */
 /**
@@ -225,28 +237,101 @@
 
 #define ARRAYSIZE(array)    (sizeof(array)/sizeof(array[0]))
 
-void ili9225_set_rc_cs(bool rc, bool cs);
+/**
+ * Format of the scanlines queued with ili9225_line_submit().
+ * RGB565: one uint16_t colour per pixel.
+ * INDEXED4: two pixels per byte, first pixel in the low nibble, each nibble
+ *      an index into the table given to ili9225_set_palette(). Expanded to
+ *      RGB565 by PIO and DMA on the way to the LCD.
+ */
+typedef enum {
+    ILI9225_PIXEL_RGB565 = 0,
+    ILI9225_PIXEL_INDEXED4
+} ili9225_pixel_format_e;
 
-void ili9225_write_cmd(const uint16_t cmd);
+/**
+ * Shortest INDEXED4 scanline. The header of a line is built from palette
+ * entries 12-15, which are rewritten for the next line as soon as this
+ * line has been fed to the expander. Up to 46 entries are still on their
+ * way to a palette lookup at that point: 32 indexes in the expander's TX
+ * FIFO, 8 in its OSR, 4 addresses in its RX FIFO, and one each in the
+ * address and pixel DMA channels. A line therefore needs at least that
+ * many pixels behind its header for the header to be expanded first.
+ */
+#define ILI9225_INDEXED4_MIN_LENGTH 48
 
-void ili9225_write_data(const uint16_t data);
+struct reg_dat_pair {
+    uint16_t reg;
+    uint16_t dat;
+};
 
 void ili9225_set_register(uint16_t reg, uint16_t data);
 
+/**
+ * Sends a list of register writes by DMA and returns immediately.
+ * The list must stay valid until the next LCD call, which waits for it.
+ */
+void ili9225_write_registers(const struct reg_dat_pair *cmds, uint16_t count);
+
+/**
+ * Waits until everything queued so far has been clocked out to the LCD.
+ */
+void ili9225_wait_idle(void);
+
 void ili9225_init(void);
 
 void ili9225_set_xy(uint8_t x, uint8_t y);
 
+/**
+ * Fills a rectangle with a single colour by DMA and returns immediately.
+ * The window is left set to the rectangle. The next LCD command waits for
+ * the fill to complete. An empty rectangle is ignored.
+ */
+void ili9225_fill_rect(uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint16_t color);
+
 void ili9225_fill(uint16_t color);
 
-void ili9225_write_pixels_start(uint8_t x, uint8_t y);
+/**
+ * Writes pixels at the current GRAM address.
+ */
+void ili9225_write_pixels(const uint16_t *data, uint16_t length);
+
+/**
+ * Returns the next free, word aligned scanline buffer
+ * (ILI9225_SCREEN_WIDTH pixels).
+ * Blocks only if every buffer in the ring is still queued for DMA.
+ */
+uint16_t *ili9225_line_acquire(void);
+
+/**
+ * Queues the buffer returned by ili9225_line_acquire() for transfer to
+ * GRAM row y, starting at the left edge of the current window. Each line
+ * carries its own address, so lines may be skipped or sent out of order.
+ * In ILI9225_PIXEL_INDEXED4 format, length must be a multiple of 8 and at
+ * least ILI9225_INDEXED4_MIN_LENGTH.
+ */
+void ili9225_line_submit(uint8_t y, uint16_t length);
 
-void ili9225_write_pixels_chunk(uint16_t *data, uint16_t length);
+/**
+ * Waits until all queued scanlines have been handed to the PIO.
+ */
+void ili9225_line_flush(void);
 
-void ili9225_write_pixels_end(void);
+/**
+ * Selects the format of subsequently queued scanlines.
+ */
+void ili9225_set_pixel_format(ili9225_pixel_format_e format);
 
-void ili9225_write_pixels_wait(void);
+/**
+ * Sets up to 12 RGB565 colours used by ILI9225_PIXEL_INDEXED4 scanlines.
+ * Indexes 12-15 are reserved for the line header.
+ */
+void ili9225_set_palette(const uint16_t *colors, uint8_t count);
 
-void ili9225_write_pixel(uint16_t color);
+/**
+ * Reads and clears the number of times ili9225_line_acquire() had to wait
+ * for a free buffer and the total time spent waiting.
+ */
+void ili9225_line_stats(uint32_t *stalls, uint32_t *stall_us);
 
 void ili9225_set_window(uint16_t x_start, uint16_t x_length, uint16_t y_start, uint16_t y_length);
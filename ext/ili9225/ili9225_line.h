@@ -0,0 +1,97 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "ili9225_lcd.h"
+
+/**
+ * Bookkeeping of the scanline ring, without the buffers or the DMA, so it
+ * can be run on a host against a simulated transfer.
+ * The producer fills the buffer at head, the DMA completion IRQ retires the
+ * buffer at tail. queued counts the buffers between them, so a full and an
+ * empty ring can be told apart. Both push and pop return whether the DMA has
+ * to be started on the buffer at tail; push must be called with the IRQ
+ * masked.
+ */
+typedef struct {
+    uint_fast8_t head;
+    volatile uint_fast8_t tail;
+    volatile uint_fast8_t queued;
+} ili9225_line_ring_t;
+
+static inline bool ili9225_line_ring_full(const ili9225_line_ring_t *r) {
+    return r->queued == ILI9225_LINE_RING_DEPTH;
+}
+
+/**
+ * Queues the buffer at head. Returns true if the DMA was idle.
+ */
+static inline bool ili9225_line_ring_push(ili9225_line_ring_t *r) {
+    r->head = (r->head + 1) % ILI9225_LINE_RING_DEPTH;
+    r->queued++;
+    return r->queued == 1;
+}
+
+/**
+ * Retires the buffer at tail. Returns true if another one is queued.
+ */
+static inline bool ili9225_line_ring_pop(ili9225_line_ring_t *r) {
+    r->tail = (r->tail + 1) % ILI9225_LINE_RING_DEPTH;
+    r->queued--;
+    return r->queued > 0;
+}
+
+/**
+ * Every scanline starts with a header that sets the GRAM row and opens a
+ * GRAM write of the line's pixel count:
+ * { RAM_ADDR_SET1, y, GRAM_RW, length }.
+ * The column is left where the previous full line wrapped it to, i.e. the
+ * start of the window.
+ */
+#define LINE_HEADER_LENGTH 4
+
+/**
+ * Palette entries used to build the same header out of 4-bit indexes:
+ * { RAM_ADDR_SET1, y } three times, then { GRAM_RW, length }. Repeating the
+ * address write pads the header to a whole 32-bit word of indexes.
+ */
+#define PALETTE_HEADER_REG   12
+#define PALETTE_HEADER_Y     13
+#define PALETTE_HEADER_GRAM  14
+#define PALETTE_HEADER_LEN   15
+#define PALETTE_HEADER_WORD  0xFEDCDCDCu
+
+static inline void ili9225_line_header_rgb565(uint16_t *buf, uint8_t y, uint16_t length) {
+    buf[0] = ILI9225_REG_RAM_ADDR_SET1;
+    buf[1] = y;
+    buf[2] = ILI9225_REG_GRAM_RW;
+    buf[3] = length;
+}
+
+/**
+ * The index word sits right in front of the packed pixels. y and length
+ * are taken from the palette when the line is started.
+ */
+static inline void ili9225_line_header_indexed4(uint16_t *buf) {
+    *(uint32_t *)&buf[LINE_HEADER_LENGTH - 2] = PALETTE_HEADER_WORD;
+}
+
+static inline void ili9225_palette_header(uint16_t *table, uint8_t y, uint16_t length) {
+    table[PALETTE_HEADER_REG] = ILI9225_REG_RAM_ADDR_SET1;
+    table[PALETTE_HEADER_Y] = y;
+    table[PALETTE_HEADER_GRAM] = ILI9225_REG_GRAM_RW;
+    table[PALETTE_HEADER_LEN] = length;
+}
+
+/**
+ * Words fed to the palette expander for an INDEXED4 line: the header word
+ * and eight pixels per word.
+ */
+static inline const uint32_t *ili9225_line_feed(const uint16_t *buf) {
+    return (const uint32_t *)&buf[LINE_HEADER_LENGTH - 2];
+}
+
+static inline uint32_t ili9225_line_feed_words(uint16_t length) {
+    return 1 + length / 8;
+}
@@ -0,0 +1,287 @@
+/**
+ * Copyright (C) 2024 by Vlastimil Slintak <slintak@uart.cz>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+ * THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * Sample-free model of the APU channel state.
+ *
+ * Only the parts clocked by the frame sequencer are modelled: length
+ * counters, volume envelopes and the channel 1 frequency sweep. They only
+ * depend on register writes and time, so they can be advanced by whole
+ * sequencer steps for a few operations per frame while no audio is rendered.
+ * When rendering resumes, apu_catchup_sync() restarts the synthesiser
+ * channels in the state the model reached.
+ *
+ * Registers are indexed from NR10 (0xFF10). Channel n uses NRn0 to NRn4 at
+ * 5 * n to 5 * n + 4, NR52 is at 0x16 and wave RAM at 0x20.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define APU_CATCHUP_REGS            0x30u
+/* DMG clocks per frame sequencer step (512 Hz) and per frame. */
+#define APU_CATCHUP_STEP_CYCLES     8192u
+#define APU_CATCHUP_FRAME_CYCLES    70224u
+
+typedef struct {
+    uint16_t length;        /* Length clocks left */
+    uint8_t volume;         /* Envelope volume, 0 to 15 */
+    uint8_t env_timer;      /* Envelope clocks to the next volume step */
+    bool enabled;
+} apu_catchup_chan_t;
+
+typedef struct {
+    uint8_t regs[APU_CATCHUP_REGS];     /* Last written NR10 to wave RAM */
+    apu_catchup_chan_t chan[4];
+    uint16_t sweep_freq;    /* Channel 1 shadow frequency */
+    uint8_t sweep_timer;
+    bool sweep_enabled;
+    uint8_t step;           /* Next frame sequencer step, 0 to 7 */
+    uint32_t cycles;        /* DMG clocks since the last step */
+} apu_catchup_t;
+
+/**
+ * Starts from the given register values with all channels silent.
+ */
+static inline void apu_catchup_init(apu_catchup_t *m, const uint8_t *regs)
+{
+    *m = (apu_catchup_t) {0};
+    for(unsigned int i = 0; i < APU_CATCHUP_REGS; i++)
+        m->regs[i] = regs[i];
+}
+
+static inline uint16_t apu_catchup_length_max(unsigned int ch)
+{
+    return ch == 2 ? 256 : 64;
+}
+
+static inline bool apu_catchup_dac(const apu_catchup_t *m, unsigned int ch)
+{
+    if(ch == 2)
+        return m->regs[0x0A] & 0x80;
+    return m->regs[5 * ch + 2] & 0xF8;
+}
+
+/**
+ * Returns the next channel 1 sweep frequency, above 2047 on overflow.
+ */
+static inline uint16_t apu_catchup_sweep_calc(const apu_catchup_t *m)
+{
+    uint16_t delta = m->sweep_freq >> (m->regs[0x00] & 0x07);
+
+    if(m->regs[0x00] & 0x08)
+        return m->sweep_freq - delta;
+    return m->sweep_freq + delta;
+}
+
+static inline void apu_catchup_sweep(apu_catchup_t *m)
+{
+    uint8_t period = (m->regs[0x00] >> 4) & 0x07;
+
+    if(--m->sweep_timer != 0)
+        return;
+    m->sweep_timer = period ? period : 8;
+    if(!m->sweep_enabled || period == 0)
+        return;
+
+    uint16_t freq = apu_catchup_sweep_calc(m);
+    if(freq > 2047)
+    {
+        m->chan[0].enabled = false;
+        return;
+    }
+    if(m->regs[0x00] & 0x07)
+    {
+        m->sweep_freq = freq;
+        m->regs[0x03] = freq & 0xFF;
+        m->regs[0x04] = (m->regs[0x04] & ~0x07) | (freq >> 8);
+        if(apu_catchup_sweep_calc(m) > 2047)
+            m->chan[0].enabled = false;
+    }
+}
+
+static inline void apu_catchup_envelope(apu_catchup_t *m)
+{
+    static const uint8_t ch_env[3] = { 0, 1, 3 };
+
+    for(unsigned int i = 0; i < 3; i++)
+    {
+        apu_catchup_chan_t *c = &m->chan[ch_env[i]];
+        uint8_t nrx2 = m->regs[5 * ch_env[i] + 2];
+        uint8_t period = nrx2 & 0x07;
+
+        if(period == 0 || --c->env_timer != 0)
+            continue;
+        c->env_timer = period;
+        if((nrx2 & 0x08) && c->volume < 15)
+            c->volume++;
+        else if(!(nrx2 & 0x08) && c->volume > 0)
+            c->volume--;
+    }
+}
+
+/**
+ * Runs one frame sequencer step: length on even steps, sweep on 2 and 6,
+ * envelopes on 7.
+ */
+static inline void apu_catchup_step(apu_catchup_t *m)
+{
+    uint8_t step = m->step;
+    m->step = (step + 1) & 7;
+
+    if((step & 1) == 0)
+    {
+        for(unsigned int ch = 0; ch < 4; ch++)
+        {
+            apu_catchup_chan_t *c = &m->chan[ch];
+            if(!(m->regs[5 * ch + 4] & 0x40) || c->length == 0)
+                continue;
+            if(--c->length == 0)
+                c->enabled = false;
+        }
+    }
+    if(step == 2 || step == 6)
+        apu_catchup_sweep(m);
+    if(step == 7)
+        apu_catchup_envelope(m);
+}
+
+/**
+ * Advances the model by the given number of DMG clocks.
+ */
+static inline void apu_catchup_advance(apu_catchup_t *m, uint32_t cycles)
+{
+    m->cycles += cycles;
+    while(m->cycles >= APU_CATCHUP_STEP_CYCLES)
+    {
+        m->cycles -= APU_CATCHUP_STEP_CYCLES;
+        apu_catchup_step(m);
+    }
+}
+
+/**
+ * Applies a register write, addr in 0xFF10 to 0xFF3F.
+ */
+static inline void apu_catchup_write(apu_catchup_t *m, uint16_t addr, uint8_t val)
+{
+    unsigned int reg = addr - 0xFF10u;
+
+    if(reg >= APU_CATCHUP_REGS)
+        return;
+
+    m->regs[reg] = val;
+    if(reg == 0x16)
+    {
+        if(!(val & 0x80))
+        {
+            for(unsigned int i = 0; i < 0x16; i++)
+                m->regs[i] = 0;
+            for(unsigned int ch = 0; ch < 4; ch++)
+                m->chan[ch] = (apu_catchup_chan_t) {0};
+        }
+        return;
+    }
+    if(reg >= 0x14)
+        return;
+
+    unsigned int ch = reg / 5;
+    apu_catchup_chan_t *c = &m->chan[ch];
+
+    switch(reg % 5)
+    {
+    case 1:
+        c->length = apu_catchup_length_max(ch) - (ch == 2 ? val : (val & 0x3F));
+        break;
+
+    case 0:
+    case 2:
+        if(!apu_catchup_dac(m, ch))
+            c->enabled = false;
+        break;
+
+    case 4:
+        if(!(val & 0x80))
+            break;
+        c->enabled = apu_catchup_dac(m, ch);
+        if(c->length == 0)
+            c->length = apu_catchup_length_max(ch);
+        c->volume = m->regs[5 * ch + 2] >> 4;
+        c->env_timer = (m->regs[5 * ch + 2] & 0x07) ? (m->regs[5 * ch + 2] & 0x07) : 8;
+        if(ch == 0)
+        {
+            uint8_t period = (m->regs[0x00] >> 4) & 0x07;
+            m->sweep_freq = m->regs[0x03] | ((uint16_t) (val & 0x07) << 8);
+            m->sweep_timer = period ? period : 8;
+            m->sweep_enabled = period || (m->regs[0x00] & 0x07);
+            if((m->regs[0x00] & 0x07) && apu_catchup_sweep_calc(m) > 2047)
+                c->enabled = false;
+        }
+        break;
+    }
+}
+
+/**
+ * Returns the channel bits of NR52.
+ */
+static inline uint8_t apu_catchup_status(const apu_catchup_t *m)
+{
+    uint8_t status = 0;
+
+    for(unsigned int ch = 0; ch < 4; ch++)
+        status |= m->chan[ch].enabled << ch;
+    return status;
+}
+
+/**
+ * Brings a synthesiser that missed some time up to the model, through the
+ * given register write function. Silent channels get their DAC switched
+ * off and back to the written value, which stops them until the next
+ * trigger. Playing channels are triggered again from the remaining length,
+ * envelope volume and sweep frequency; their envelope then starts from the
+ * current volume until the game writes NRx2 again.
+ */
+static inline void apu_catchup_sync(const apu_catchup_t *m,
+        void (*write)(uint16_t addr, uint8_t val))
+{
+    if(!(m->regs[0x16] & 0x80))
+        return;
+
+    for(unsigned int ch = 0; ch < 4; ch++)
+    {
+        const apu_catchup_chan_t *c = &m->chan[ch];
+        uint16_t base = 0xFF10u + 5 * ch;
+        uint8_t dac_reg = ch == 2 ? 0 : 2;
+
+        if(!c->enabled)
+        {
+            write(base + dac_reg, 0x00);
+            write(base + dac_reg, m->regs[5 * ch + dac_reg]);
+            continue;
+        }
+
+        if(ch == 2)
+            write(base + 1, 256 - c->length);
+        else
+        {
+            write(base + 1, (m->regs[5 * ch + 1] & 0xC0) | ((64 - c->length) & 0x3F));
+            write(base + 2, (c->volume << 4) | (m->regs[5 * ch + 2] & 0x0F));
+        }
+        if(ch == 0)
+            write(base + 3, m->sweep_freq & 0xFF);
+        write(base + 4, 0x80 | (m->regs[5 * ch + 4] & 0x47));
+    }
+}
@@ -0,0 +1,183 @@
+/**
+ * Copyright (C) 2024 by Vlastimil Slintak <slintak@uart.cz>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+ * THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * Cheap APU synthesiser driven by the catch-up model.
+ *
+ * Every channel is point sampled once per output sample from a 16.16 phase
+ * accumulator, without any band limiting, so high notes alias. Channel
+ * parameters only change on register writes and frame sequencer steps, so
+ * they are worked out once per run of samples between two steps. At 32768
+ * Hz one sample is exactly 128 DMG clocks and a sequencer step 64 samples.
+ * Output is interleaved signed 16-bit left and right, like minigb_apu.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "apu_catchup.h"
+
+#define APU_NAIVE_SAMPLE_CYCLES     128u
+#define APU_NAIVE_PHASE_ONE         (1u << 16)
+/* Samples per noise update when the noise channel runs at reduced rate. */
+#define APU_NAIVE_NOISE_STRIDE      4u
+
+typedef struct {
+    uint32_t phase[4];      /* Position in the waveform, 16.16 steps */
+    uint16_t lfsr;          /* Noise shift register */
+    bool noise_reduced;     /* Update noise every APU_NAIVE_NOISE_STRIDE samples */
+} apu_naive_t;
+
+static inline void apu_naive_init(apu_naive_t *s, bool noise_reduced)
+{
+    *s = (apu_naive_t) {0};
+    s->lfsr = 0x7FFF;
+    s->noise_reduced = noise_reduced;
+}
+
+static inline uint16_t apu_naive_freq(const apu_catchup_t *m, unsigned int ch)
+{
+    return m->regs[5 * ch + 3] | ((uint16_t) (m->regs[5 * ch + 4] & 0x07) << 8);
+}
+
+static inline void apu_naive_clock_lfsr(apu_naive_t *s, bool narrow)
+{
+    uint16_t bit = (s->lfsr ^ (s->lfsr >> 1)) & 1;
+
+    s->lfsr = (s->lfsr >> 1) | (bit << 14);
+    if(narrow)
+        s->lfsr = (s->lfsr & ~0x40) | (bit << 6);
+}
+
+/**
+ * Renders count samples with the parameters the model has now, without
+ * advancing it.
+ */
+static inline void apu_naive_run(apu_naive_t *s, const apu_catchup_t *m,
+        int16_t *out, unsigned int count)
+{
+    static const uint8_t duty[4] = { 0x01, 0x81, 0x87, 0x7E };
+    uint32_t inc[4] = { 0 };
+    int32_t amp[4] = { 0 };
+    uint8_t pan = m->regs[0x15];
+    int32_t gain_left = (((m->regs[0x14] >> 4) & 0x07) + 1) * 64;
+    int32_t gain_right = ((m->regs[0x14] & 0x07) + 1) * 64;
+
+    for(unsigned int ch = 0; ch < 4; ch++)
+    {
+        if(!m->chan[ch].enabled || !apu_catchup_dac(m, ch))
+            continue;
+        /* The wave channel level comes from NR32 below. */
+        amp[ch] = ch == 2 ? 1 : m->chan[ch].volume;
+    }
+    /* Duty steps (squares, 8 per period) and wave samples (32 per period)
+     * per output sample, from the 11-bit period value. */
+    inc[0] = (32u << 16) / (2048 - apu_naive_freq(m, 0));
+    inc[1] = (32u << 16) / (2048 - apu_naive_freq(m, 1));
+    inc[2] = (64u << 16) / (2048 - apu_naive_freq(m, 2));
+    {
+        uint8_t nr43 = m->regs[0x12];
+        uint32_t divider = (nr43 & 0x07) ? 2u * (nr43 & 0x07) : 1u;
+        inc[3] = (32u << 16) / (divider << ((nr43 >> 4) + 1));
+    }
+    uint8_t wave_shift = (m->regs[0x0C] >> 5) & 0x03;
+    bool narrow = m->regs[0x12] & 0x08;
+    uint8_t duty1 = duty[m->regs[0x01] >> 6];
+    uint8_t duty2 = duty[m->regs[0x06] >> 6];
+
+    for(unsigned int i = 0; i < count; i++)
+    {
+        int32_t v[4];
+
+        s->phase[0] += inc[0];
+        s->phase[1] += inc[1];
+        s->phase[2] += inc[2];
+        v[0] = (duty1 >> ((s->phase[0] >> 16) & 7)) & 1 ? amp[0] : -amp[0];
+        v[1] = (duty2 >> ((s->phase[1] >> 16) & 7)) & 1 ? amp[1] : -amp[1];
+
+        if(wave_shift == 0 || amp[2] == 0)
+            v[2] = 0;
+        else
+        {
+            unsigned int pos = (s->phase[2] >> 16) & 31;
+            uint8_t nibble = m->regs[0x20 + pos / 2];
+            nibble = (pos & 1) ? nibble & 0x0F : nibble >> 4;
+            v[2] = (int32_t) (nibble >> (wave_shift - 1)) * 2 - (15 >> (wave_shift - 1));
+        }
+
+        if(!s->noise_reduced)
+        {
+            s->phase[3] += inc[3];
+            while(s->phase[3] >= APU_NAIVE_PHASE_ONE)
+            {
+                s->phase[3] -= APU_NAIVE_PHASE_ONE;
+                apu_naive_clock_lfsr(s, narrow);
+            }
+        }
+        else if((i % APU_NAIVE_NOISE_STRIDE) == 0)
+        {
+            /* At most one shift per update, which keeps the noise white
+             * and the cost flat at high noise frequencies. */
+            s->phase[3] += inc[3] * APU_NAIVE_NOISE_STRIDE;
+            if(s->phase[3] >= APU_NAIVE_PHASE_ONE)
+            {
+                s->phase[3] &= APU_NAIVE_PHASE_ONE - 1;
+                apu_naive_clock_lfsr(s, narrow);
+            }
+        }
+        v[3] = (s->lfsr & 1) ? -amp[3] : amp[3];
+
+        int32_t left = 0;
+        int32_t right = 0;
+        for(unsigned int ch = 0; ch < 4; ch++)
+        {
+            if(pan & (0x10 << ch))
+                left += v[ch];
+            if(pan & (0x01 << ch))
+                right += v[ch];
+        }
+        *out++ = left * gain_left;
+        *out++ = right * gain_right;
+    }
+}
+
+/**
+ * Renders count samples and advances the model by the same time, stopping
+ * at every frame sequencer step to pick up the new channel state.
+ */
+static inline void apu_naive_render(apu_naive_t *s, apu_catchup_t *m,
+        int16_t *out, unsigned int count)
+{
+    while(count > 0)
+    {
+        unsigned int n = (APU_CATCHUP_STEP_CYCLES - m->cycles + APU_NAIVE_SAMPLE_CYCLES - 1)
+            / APU_NAIVE_SAMPLE_CYCLES;
+        if(n > count)
+            n = count;
+
+        if(m->regs[0x16] & 0x80)
+            apu_naive_run(s, m, out, n);
+        else
+        {
+            for(unsigned int i = 0; i < 2 * n; i++)
+                out[i] = 0;
+        }
+        apu_catchup_advance(m, n * APU_NAIVE_SAMPLE_CYCLES);
+        out += 2 * n;
+        count -= n;
+    }
+}
@@ -0,0 +1,143 @@
+/**
+ * Copyright (C) 2024 by Vlastimil Slintak <slintak@uart.cz>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+ * THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * Single producer, single consumer queue of APU register writes.
+ *
+ * The emulation core pushes one 32-bit record per write and an end of frame
+ * record after every frame, the audio core replays them into its own APU
+ * state. Records are single words, so the queue only needs the two indexes
+ * to be published with release/acquire ordering and works the same between
+ * the RP2040 cores and between host threads.
+ *
+ * Record layout:
+ * | 31 : 14 | 13 : 8   | 7 : 0 |
+ * | cycle   | register | value |
+ * cycle counts DMG clocks since the start of the frame, see
+ * APU_QUEUE_FRAME_CYCLE(), register is the offset from 0xFF10.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Number of records, must be a power of two. */
+#ifndef APU_QUEUE_LENGTH
+#define APU_QUEUE_LENGTH 4096u
+#endif
+
+#define APU_QUEUE_REG_BASE      0xFF10u
+#define APU_QUEUE_REG_END_FRAME 0x3Fu
+
+#define APU_QUEUE_RECORD(cycle, addr, value) \
+    (((uint32_t) (cycle) << 14) | \
+     ((uint32_t) (((addr) - APU_QUEUE_REG_BASE) & 0x3Fu) << 8) | \
+     (uint8_t) (value))
+#define APU_QUEUE_END_FRAME \
+    APU_QUEUE_RECORD(0, APU_QUEUE_REG_BASE + APU_QUEUE_REG_END_FRAME, 0)
+
+/**
+ * Cycle in the frame of a write at line ly, lcd_count cycles into the
+ * line. gb_run_frame() returns when VBlank starts at line 144, so a frame
+ * runs lines 144-153 and then 0-143.
+ */
+#define APU_QUEUE_LINE_CYCLES   456u
+#define APU_QUEUE_FRAME_LINES   154u
+#define APU_QUEUE_FIRST_LINE    144u
+#define APU_QUEUE_FRAME_CYCLE(ly, lcd_count) \
+    ((((uint32_t) (ly) + APU_QUEUE_FRAME_LINES - APU_QUEUE_FIRST_LINE) % \
+      APU_QUEUE_FRAME_LINES) * APU_QUEUE_LINE_CYCLES + (uint32_t) (lcd_count))
+
+#define APU_QUEUE_CYCLE(record) ((record) >> 14)
+#define APU_QUEUE_ADDR(record)  (APU_QUEUE_REG_BASE + (((record) >> 8) & 0x3Fu))
+#define APU_QUEUE_VALUE(record) ((uint8_t) (record))
+#define APU_QUEUE_IS_END_FRAME(record) \
+    ((((record) >> 8) & 0x3Fu) == APU_QUEUE_REG_END_FRAME)
+
+typedef struct {
+    uint32_t records[APU_QUEUE_LENGTH];
+    uint32_t head;          /* Next record to write, producer only */
+    uint32_t tail;          /* Next record to read, consumer only */
+    uint32_t overflows;     /* Writes dropped on a full queue, producer only */
+    uint32_t end_waits;     /* End of frame records that waited for space */
+} apu_queue_t;
+
+/**
+ * Appends a record unless fewer than reserve + 1 slots are free. Register
+ * writes keep one slot in reserve, so the writes of a frame never take the
+ * last slot away from its end of frame record. Producer side only.
+ */
+static inline bool apu_queue_push(apu_queue_t *queue, uint32_t record,
+        uint32_t reserve)
+{
+    uint32_t head = queue->head;
+    uint32_t tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+
+    if(APU_QUEUE_LENGTH - (head - tail) <= reserve)
+    {
+        queue->overflows++;
+        return false;
+    }
+
+    queue->records[head & (APU_QUEUE_LENGTH - 1)] = record;
+    __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/**
+ * Takes the oldest record, returns false if the queue is empty.
+ * Consumer side only.
+ */
+static inline bool apu_queue_pop(apu_queue_t *queue, uint32_t *record)
+{
+    uint32_t tail = queue->tail;
+    uint32_t head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+
+    if(head == tail)
+        return false;
+
+    *record = queue->records[tail & (APU_QUEUE_LENGTH - 1)];
+    __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/**
+ * Returns the number of queued records. Either side.
+ */
+static inline uint32_t apu_queue_level(const apu_queue_t *queue)
+{
+    return __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) -
+        __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Appends the end of frame record, which is never dropped: the consumer
+ * counts frames by it. The slot kept free by the register writes can
+ * already hold the previous frame's end record if the consumer has fallen
+ * a whole queue behind. The queue then holds at least one complete frame,
+ * so waiting for the consumer to replay it always frees a slot. Producer
+ * side only.
+ */
+static inline void apu_queue_end_frame(apu_queue_t *queue)
+{
+    if(apu_queue_level(queue) == APU_QUEUE_LENGTH)
+    {
+        queue->end_waits++;
+        while(apu_queue_level(queue) == APU_QUEUE_LENGTH)
+            ;
+    }
+    apu_queue_push(queue, APU_QUEUE_END_FRAME, 0);
+}
@@ -0,0 +1,115 @@
+/**
+ * Copyright (C) 2024 by Vlastimil Slintak <slintak@uart.cz>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+ * THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * Output filter of the Game Boy: the coupling capacitor in front of the
+ * headphone amplifier, followed by a gentle low-pass.
+ *
+ * The capacitor is a one-pole high-pass. Each sample it keeps a fixed
+ * fraction of its charge, which is what the DMG does every clock:
+ * out = in - cap, cap = in - out * charge, or out = in - in' + out' * charge
+ * from the previous input and output. It removes the DC offset of the
+ * channel DACs, which otherwise pops whenever channels or the volume change.
+ * The bits of out * charge that do not fit the output are carried to the
+ * next sample, otherwise a constant input would settle some 200 away from 0.
+ * The low-pass is y += (x - y) * alpha. Both run in integer arithmetic
+ * in the same pass over the samples as the output gain: audio_filter_run()
+ * applies the gain itself, the resampler filters each input sample as it
+ * takes it in and carries the gain in its taps.
+ * Samples are 32-bit words with the left channel in the low half.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/* Capacitor charge kept per sample at 32768 Hz, 0.999958^128, in 1/4096. */
+#define AUDIO_FILTER_HP_DMG     4074
+#define AUDIO_FILTER_HP_BITS    12
+/* Low-pass weight of a new sample in 1/256, 192 is a corner near 7 kHz. */
+#define AUDIO_FILTER_LP_DEFAULT 192
+#define AUDIO_FILTER_LP_BITS    8
+
+typedef struct {
+    int32_t in[2];          /* Previous input */
+    int32_t hp[2];          /* High-pass output */
+    int32_t hp_rest[2];     /* Remainder of hp, 1/4096 */
+    int32_t lp[2];          /* Low-pass output */
+    int32_t hp_charge;      /* Charge kept per sample, 1/4096 */
+    int32_t lp_alpha;       /* 1/256, 256 disables the low-pass */
+} audio_filter_t;
+
+static inline void audio_filter_init(audio_filter_t *f, int32_t hp_charge,
+        int32_t lp_alpha)
+{
+    *f = (audio_filter_t) {0};
+    f->hp_charge = hp_charge;
+    f->lp_alpha = lp_alpha;
+}
+
+static inline int32_t audio_filter_channel(audio_filter_t *f, unsigned int c,
+        int32_t x)
+{
+    int32_t acc = ((x - f->in[c]) << AUDIO_FILTER_HP_BITS) +
+        f->hp[c] * f->hp_charge + f->hp_rest[c];
+    int32_t out = acc >> AUDIO_FILTER_HP_BITS;
+
+    f->in[c] = x;
+    f->hp[c] = out;
+    f->hp_rest[c] = acc & ((1 << AUDIO_FILTER_HP_BITS) - 1);
+
+    f->lp[c] += ((out - f->lp[c]) * f->lp_alpha) >> AUDIO_FILTER_LP_BITS;
+    return f->lp[c];
+}
+
+static inline int16_t audio_filter_clamp(int32_t v)
+{
+    if(v > INT16_MAX)
+        return INT16_MAX;
+    if(v < INT16_MIN)
+        return INT16_MIN;
+    return v;
+}
+
+/**
+ * Filters one stereo sample, saturated to 16 bits.
+ */
+static inline uint32_t audio_filter_sample(audio_filter_t *f, uint32_t s)
+{
+    int16_t left = audio_filter_clamp(audio_filter_channel(f, 0, (int16_t) s));
+    int16_t right = audio_filter_clamp(audio_filter_channel(f, 1, (int16_t) (s >> 16)));
+
+    return (uint16_t) left | ((uint32_t) (uint16_t) right << 16);
+}
+
+/**
+ * Filters count stereo samples and applies a Q15 gain with saturation.
+ * dst may be src.
+ */
+static inline void audio_filter_run(audio_filter_t *f, uint32_t *dst,
+        const uint32_t *src, unsigned int count, int32_t gain)
+{
+    for(unsigned int i = 0; i < count; i++)
+    {
+        uint32_t s = src[i];
+        int32_t left = audio_filter_channel(f, 0, (int16_t) s);
+        int32_t right = audio_filter_channel(f, 1, (int16_t) (s >> 16));
+
+        /* Clamped first, so gains up to 2.0 stay within 32 bits. */
+        left = audio_filter_clamp((audio_filter_clamp(left) * gain) >> 15);
+        right = audio_filter_clamp((audio_filter_clamp(right) * gain) >> 15);
+        dst[i] = (uint16_t) left | ((uint32_t) (uint16_t) right << 16);
+    }
+}
@@ -0,0 +1,86 @@
+/**
+ * Copyright (C) 2024 by Vlastimil Slintak <slintak@uart.cz>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+ * THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * Frame deadlines locked to the emulated clock.
+ *
+ * Deadlines are counted in ticks of a (reduced) emulated clock from a fixed
+ * origin and only converted to microseconds when needed, so rounding never
+ * accumulates into drift. The pacer does not read the time itself: the
+ * caller passes the current time in, which lets it run against a simulated
+ * clock as well.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/* Frame speed multipliers, FRAME_SPEED_UNCAPPED runs as fast as possible. */
+#define FRAME_SPEED_UNCAPPED    0u
+#define FRAME_SPEED_MAX         4u
+
+typedef struct {
+    uint64_t origin_us;     /* Time of tick 0 */
+    uint64_t ticks;         /* Next deadline, in ticks * FRAME_SPEED_MAX */
+    uint32_t tick_hz;       /* Frequency of the emulated clock */
+    uint32_t frame_ticks;   /* Emulated clock ticks per frame */
+    uint32_t resyncs;       /* Deadlines given up after running late */
+} frame_pacer_t;
+
+/**
+ * Starts counting deadlines from now_us.
+ */
+static inline void frame_pacer_init(frame_pacer_t *pacer, uint32_t tick_hz,
+        uint32_t frame_ticks, uint64_t now_us)
+{
+    pacer->origin_us = now_us;
+    pacer->ticks = 0;
+    pacer->tick_hz = tick_hz;
+    pacer->frame_ticks = frame_ticks;
+    pacer->resyncs = 0;
+}
+
+/**
+ * Returns the time at which the next frame should start. speed is one of
+ * 1, 2, 4 or FRAME_SPEED_UNCAPPED. A frame that is already more than one
+ * period late is started immediately and the following deadlines are
+ * counted from it, instead of rushing through the missed ones.
+ */
+static inline uint64_t frame_pacer_next(frame_pacer_t *pacer, uint64_t now_us,
+        unsigned int speed)
+{
+    if(speed == FRAME_SPEED_UNCAPPED)
+    {
+        pacer->origin_us = now_us;
+        pacer->ticks = 0;
+        return now_us;
+    }
+
+    pacer->ticks += (uint64_t) pacer->frame_ticks * FRAME_SPEED_MAX / speed;
+    uint64_t deadline = pacer->origin_us + pacer->ticks * 1000000u /
+        ((uint64_t) pacer->tick_hz * FRAME_SPEED_MAX);
+    uint64_t period = (uint64_t) pacer->frame_ticks * 1000000u /
+        ((uint64_t) pacer->tick_hz * speed);
+
+    if(deadline + period < now_us)
+    {
+        pacer->origin_us = now_us;
+        pacer->ticks = 0;
+        pacer->resyncs++;
+        return now_us;
+    }
+
+    return deadline;
+}
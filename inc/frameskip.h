@@ -0,0 +1,86 @@
+/**
+ * Copyright (C) 2024 by Vlastimil Slintak <slintak@uart.cz>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+ * THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * Adaptive frame skip controller.
+ *
+ * The controller only sees measured frame times and has no side effects, so
+ * it can be fed recorded traces on a host. Frames that were drawn and frames
+ * that were skipped are averaged separately: the drawn average is what a
+ * frame would cost without skipping, and it keeps being measured on every
+ * other frame while skipping.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Skipping starts above budget + ENTER and stops below budget - LEAVE. */
+#define FRAME_SKIP_ENTER_MARGIN_US  500u
+#define FRAME_SKIP_LEAVE_MARGIN_US  1500u
+/* Consecutive drawn frames needed to start or stop skipping. */
+#define FRAME_SKIP_ENTER_FRAMES     4u
+#define FRAME_SKIP_LEAVE_FRAMES     60u
+/* Exponential average weight, 1/2^FRAME_SKIP_AVG_SHIFT. */
+#define FRAME_SKIP_AVG_SHIFT        3u
+
+typedef struct {
+    uint32_t drawn_avg;     /* Average drawn frame time, us << AVG_SHIFT */
+    uint32_t skipped_avg;   /* Average skipped frame time, us << AVG_SHIFT */
+    uint16_t streak;        /* Drawn frames in a row asking for a change */
+    bool skipping;          /* Drawing only every other frame */
+} frame_skip_state_t;
+
+/**
+ * Returns the controller state after a frame took frame_us microseconds.
+ * drawn tells whether the frame was sent to the LCD, budget_us is the
+ * frame period to fit in.
+ */
+static inline frame_skip_state_t frame_skip_update(frame_skip_state_t state,
+        uint32_t frame_us, bool drawn, uint32_t budget_us)
+{
+    uint32_t *avg = drawn ? &state.drawn_avg : &state.skipped_avg;
+
+    if(*avg == 0)
+        *avg = frame_us << FRAME_SKIP_AVG_SHIFT;
+    else
+        *avg = *avg - (*avg >> FRAME_SKIP_AVG_SHIFT) + frame_us;
+
+    if(!drawn)
+        return state;
+
+    uint32_t cost = state.drawn_avg >> FRAME_SKIP_AVG_SHIFT;
+    bool change;
+    if(state.skipping)
+        change = cost + FRAME_SKIP_LEAVE_MARGIN_US < budget_us;
+    else
+        change = cost > budget_us + FRAME_SKIP_ENTER_MARGIN_US;
+
+    if(!change)
+    {
+        state.streak = 0;
+        return state;
+    }
+
+    state.streak++;
+    if(state.streak >= (state.skipping ? FRAME_SKIP_LEAVE_FRAMES : FRAME_SKIP_ENTER_FRAMES))
+    {
+        state.skipping = !state.skipping;
+        state.streak = 0;
+    }
+
+    return state;
+}
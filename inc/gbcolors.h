@@ -35,6 +35,7 @@
 #define PALETTE_SIZE_IN_BYTES (3 * 4 * sizeof(uint16_t))
 
 typedef uint16_t palette_t[3][4];
+typedef uint16_t palette_lut_t[256];
 
 /*
  * Get an RGB565 colour palette by entry ID & shuffling flags
@@ -1353,4 +1354,21 @@ void manual_assign_palette(palette_t palette, uint8_t selection)
             break;
         }
     }
-}
\ No newline at end of file
+}
+
+/*
+ * Flatten a palette into a lookup table indexed directly by the pixel byte
+ * given to lcd_draw_line(): bits 4-5 select OBJ0, OBJ1 or BG and bits 0-1
+ * select the shade. The unused fourth selector maps to the BG palette.
+ * Must be called again whenever the palette changes.
+ */
+void build_palette_lut(const palette_t palette, palette_lut_t lut)
+{
+    for(unsigned int i = 0; i < 256; i++)
+    {
+        unsigned int selector = (i & 0x30) >> 4;
+        if(selector > 2)
+            selector = 2;
+        lut[i] = palette[selector][i & 3];
+    }
+}
@@ -0,0 +1,107 @@
+/**
+ * Copyright (C) 2024 by Vlastimil Slintak <slintak@uart.cz>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+ * THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/**
+ * Scanline conversion kernels used by lcd_draw_line().
+ *
+ * They only read the Peanut-GB pixel bytes and write the LCD line buffer,
+ * so they can be checked and timed on a host against the plain loops they
+ * replace.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * 4-bit colour index of a pixel byte: palette select (bits 4-5) in bits
+ * 2-3, shade in bits 0-1. Indexes 12-15 are never produced.
+ */
+#define LCD_LINE_INDEX(p) ((((p) & 0x30) >> 2) | ((p) & 3))
+
+/**
+ * Converts width pixel bytes to RGB565 through a 256-entry table, two
+ * pixels per 32-bit store and four pixels per iteration. out must be word
+ * aligned and width a multiple of 4.
+ */
+static inline void lcd_line_rgb565(const uint16_t lut[256],
+        const uint8_t *pixels, uint16_t *out, unsigned int width)
+{
+    uint32_t *words = (uint32_t *) out;
+
+    for(unsigned int x = 0; x < width; x += 4)
+    {
+        words[0] = lut[pixels[x]] | ((uint32_t) lut[pixels[x + 1]] << 16);
+        words[1] = lut[pixels[x + 2]] | ((uint32_t) lut[pixels[x + 3]] << 16);
+        words += 2;
+    }
+}
+
+/**
+ * Packs width pixel bytes into colour indexes, eight per 32-bit store with
+ * the first pixel in the low nibble. width must be a multiple of 8.
+ */
+static inline void lcd_line_indexed4(const uint8_t *pixels, uint32_t *out,
+        unsigned int width)
+{
+    for(unsigned int x = 0; x < width; x += 8)
+    {
+        uint32_t word = 0;
+        for(unsigned int i = 0; i < 8; i++)
+            word |= (uint32_t) LCD_LINE_INDEX(pixels[x + i]) << (i * 4);
+        *out++ = word;
+    }
+}
+
+/**
+ * Fills the 12 colours of the indexed palette from the RGB565 LUT, so that
+ * colors[LCD_LINE_INDEX(p)] == lut[p].
+ */
+static inline void lcd_line_index_colors(const uint16_t lut[256],
+        uint16_t colors[12])
+{
+    for(unsigned int i = 0; i < 12; i++)
+        colors[i] = lut[((i & 0x0C) << 2) | (i & 3)];
+}
+
+/**
+ * Hash of a converted line. seed changes whenever the LCD content can no
+ * longer be trusted, so every line hashes differently afterwards.
+ */
+static inline uint32_t lcd_line_hash(uint32_t seed, const uint32_t *words,
+        unsigned int count)
+{
+    uint32_t hash = seed;
+    for(unsigned int i = 0; i < count; i++)
+    {
+        hash = (hash + words[i]) * 0x9E3779B1u;
+        hash ^= hash >> 16;
+    }
+    return hash;
+}
+
+/**
+ * Returns true if a line must be sent, i.e. its hash differs from the one
+ * last sent for that row, and records it as sent.
+ */
+static inline bool lcd_line_changed(uint32_t *sent, uint32_t hash)
+{
+    if(*sent == hash)
+        return false;
+    *sent = hash;
+    return true;
+}
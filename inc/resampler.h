@@ -0,0 +1,213 @@
+/**
+ * Copyright (C) 2024 by Vlastimil Slintak <slintak@uart.cz>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+ * THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * Fractional stereo resampler with dynamic rate control.
+ *
+ * Samples are 32-bit words holding a 16-bit left (low half) and right (high
+ * half) sample, as in the I2S DMA buffers. The resampler steps through the
+ * input in 16.16 fixed point. Every output sample is a 4-tap polyphase FIR
+ * over the last four inputs, with the taps of a Catmull-Rom cubic sampled at
+ * RESAMPLER_PHASES fractional positions. Only integer arithmetic is used,
+ * four multiplications per channel, which suits the Cortex-M0+. The output
+ * gain is folded into the taps, so volume costs nothing per sample, and an
+ * optional output filter runs on each input sample as it is taken in, so
+ * the samples are only gone over once.
+ * The step is re-tuned for every frame from the amount of audio queued for
+ * output, so the emulation keeps its own pace while the output neither runs
+ * dry nor backs up.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "audio_filter.h"
+
+#define RESAMPLER_FRAC_BITS     16u
+#define RESAMPLER_ONE           (1u << RESAMPLER_FRAC_BITS)
+
+/* Fractional positions with their own taps, and tap precision. */
+#define RESAMPLER_PHASE_BITS    6u
+#define RESAMPLER_PHASES        (1u << RESAMPLER_PHASE_BITS)
+#define RESAMPLER_TAP_BITS      14u
+#define RESAMPLER_TAPS          4u
+
+/* Largest step adjustment of the rate control, in parts per million. */
+#define RESAMPLER_DRC_MAX_PPM   5000
+/* Integral time of the rate control in updates, and the largest share of
+ * the adjustment the integral term may hold, in parts per million. */
+#define RESAMPLER_DRC_I_UPDATES 256
+#define RESAMPLER_DRC_I_MAX_PPM 2500
+
+typedef struct {
+    uint32_t step;      /* Input samples per output sample, 16.16 */
+    uint32_t phase;     /* Position past history[1], 16.16 */
+    uint32_t history[RESAMPLER_TAPS];  /* Last inputs consumed, oldest first */
+    audio_filter_t *filter;            /* Applied to the input, or NULL */
+    int32_t drc_sum;    /* Fill error summed by the rate control, samples */
+} resampler_t;
+
+static int32_t resampler_taps[RESAMPLER_PHASES][RESAMPLER_TAPS];
+
+/**
+ * Fills resampler_taps with Catmull-Rom weights scaled by a Q15 gain, in
+ * 1/2^RESAMPLER_TAP_BITS. For t in [0, 1) between the middle two samples:
+ * w0 = (-t^3 + 2t^2 - t) / 2   w1 = (3t^3 - 5t^2 + 2) / 2
+ * w2 = (-3t^3 + 4t^2 + t) / 2  w3 = (t^3 - t^2) / 2
+ * Gains up to 2.0 keep the accumulator of resampler_filter() in 32 bits.
+ */
+static inline void resampler_set_gain(int32_t gain)
+{
+    const int64_t one = 1 << RESAMPLER_TAP_BITS;
+
+    for(unsigned int p = 0; p < RESAMPLER_PHASES; p++)
+    {
+        /* t, t^2 and t^3 scaled by 2^RESAMPLER_TAP_BITS */
+        int64_t t = (int64_t) p * one / RESAMPLER_PHASES;
+        int64_t t2 = t * t / one;
+        int64_t t3 = t2 * t / one;
+
+        resampler_taps[p][0] = ((-t3 + 2 * t2 - t) / 2 * gain) >> 15;
+        resampler_taps[p][1] = ((3 * t3 - 5 * t2 + 2 * one) / 2 * gain) >> 15;
+        resampler_taps[p][2] = ((-3 * t3 + 4 * t2 + t) / 2 * gain) >> 15;
+        resampler_taps[p][3] = ((t3 - t2) / 2 * gain) >> 15;
+    }
+}
+
+/**
+ * Returns a 16.16 step converting from in_rate to out_rate.
+ */
+static inline uint32_t resampler_step(uint32_t in_rate, uint32_t out_rate)
+{
+    return (uint32_t) (((uint64_t) in_rate << RESAMPLER_FRAC_BITS) / out_rate);
+}
+
+static inline void resampler_init(resampler_t *r, uint32_t step, int32_t gain)
+{
+    resampler_set_gain(gain);
+    r->step = step;
+    r->phase = 0;
+    r->filter = NULL;
+    r->drc_sum = 0;
+    for(unsigned int i = 0; i < RESAMPLER_TAPS; i++)
+        r->history[i] = 0;
+}
+
+static inline int16_t resampler_clamp(int32_t v)
+{
+    if(v > INT16_MAX)
+        return INT16_MAX;
+    if(v < INT16_MIN)
+        return INT16_MIN;
+    return v;
+}
+
+/**
+ * Returns the output sample at phase between history[1] and history[2].
+ */
+static inline uint32_t resampler_filter(const uint32_t *h, uint32_t phase)
+{
+    const int32_t *w = resampler_taps[phase >> (RESAMPLER_FRAC_BITS - RESAMPLER_PHASE_BITS)];
+    int32_t left = (int16_t) h[0] * w[0] + (int16_t) h[1] * w[1] +
+        (int16_t) h[2] * w[2] + (int16_t) h[3] * w[3];
+    int32_t right = (int16_t) (h[0] >> 16) * w[0] + (int16_t) (h[1] >> 16) * w[1] +
+        (int16_t) (h[2] >> 16) * w[2] + (int16_t) (h[3] >> 16) * w[3];
+
+    return (uint16_t) resampler_clamp(left >> RESAMPLER_TAP_BITS) |
+        ((uint32_t) (uint16_t) resampler_clamp(right >> RESAMPLER_TAP_BITS) << 16);
+}
+
+/**
+ * Resamples up to in_count input samples into at most out_space output
+ * samples, passing each input through r->filter if set. Returns the number
+ * of output samples written and stores the number of input samples consumed
+ * in in_used. Whatever was not consumed has to be passed in again on the
+ * next call.
+ */
+static inline unsigned int resampler_run(resampler_t *r, const uint32_t *in,
+        unsigned int in_count, uint32_t *out, unsigned int out_space,
+        unsigned int *in_used)
+{
+    unsigned int i = 0;
+    unsigned int n = 0;
+    uint32_t phase = r->phase;
+    uint32_t *h = r->history;
+    audio_filter_t *filter = r->filter;
+
+    while(n < out_space)
+    {
+        while(phase >= RESAMPLER_ONE && i < in_count)
+        {
+            h[0] = h[1];
+            h[1] = h[2];
+            h[2] = h[3];
+            h[3] = filter != NULL ? audio_filter_sample(filter, in[i]) : in[i];
+            i++;
+            phase -= RESAMPLER_ONE;
+        }
+        if(phase >= RESAMPLER_ONE)
+            break;
+
+        out[n++] = resampler_filter(h, phase);
+        phase += r->step;
+    }
+
+    r->phase = phase;
+    *in_used = i;
+    return n;
+}
+
+/**
+ * Rate control: returns the step to use for the next block given the
+ * nominal step and the number of samples queued for output. More audio
+ * than target speeds the input up, less slows it down, by at most
+ * RESAMPLER_DRC_MAX_PPM. The proportional term alone would leave the level
+ * off the target by whatever it takes to make up the difference between
+ * the nominal and the actual input rate. The error is also summed in
+ * r->drc_sum, over RESAMPLER_DRC_I_UPDATES updates, which takes that
+ * offset over. The sum is clamped to RESAMPLER_DRC_I_MAX_PPM so that it
+ * does not wind up while the output is stalled.
+ */
+static inline uint32_t resampler_drc_step(resampler_t *r, uint32_t nominal,
+        uint32_t fill, uint32_t target)
+{
+    const int64_t scale = (int64_t) target * RESAMPLER_DRC_I_UPDATES;
+    const int32_t sum_max = scale * RESAMPLER_DRC_I_MAX_PPM / RESAMPLER_DRC_MAX_PPM;
+    int32_t error = (int32_t) fill - (int32_t) target;
+
+    if(error > (int32_t) target)
+        error = target;
+    else if(error < -(int32_t) target)
+        error = -(int32_t) target;
+
+    r->drc_sum += error;
+    if(r->drc_sum > sum_max)
+        r->drc_sum = sum_max;
+    else if(r->drc_sum < -sum_max)
+        r->drc_sum = -sum_max;
+
+    /* Both terms in units of scale, RESAMPLER_DRC_MAX_PPM at full scale. */
+    int64_t control = (int64_t) error * RESAMPLER_DRC_I_UPDATES + r->drc_sum;
+    if(control > scale)
+        control = scale;
+    else if(control < -scale)
+        control = -scale;
+
+    int64_t adjust = (int64_t) nominal * RESAMPLER_DRC_MAX_PPM * control /
+        (scale * 1000000);
+    return (uint32_t) ((int64_t) nominal + adjust);
+}
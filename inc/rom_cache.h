@@ -0,0 +1,209 @@
+/**
+ * Copyright (C) 2024 by Vlastimil Slintak <slintak@uart.cz>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+ * THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * SRAM copies of the most used switchable ROM banks.
+ *
+ * Reads go through a table with a pointer for every 4 KB page of the image,
+ * so a read is one indexed load with no compare. A page points into the
+ * fixed SRAM copy of the first banks, one of a few 16 KB frames in SRAM, or
+ * the image in flash, and the table only changes when a bank is promoted.
+ *
+ * Reads are not counted, that would cost as much as the read itself.
+ * Instead, the caller samples the bank the MBC maps at 0x4000, on every
+ * drawn line and every frame, which measures how long each bank is in use.
+ * Once per emulated frame the samples are folded into a decaying score per
+ * bank. The bank the MBC has just switched to gets a bonus on top, so a bank
+ * that a game keeps coming back to is promoted before its samples add up.
+ * If the best bank in flash then scores well above the worst bank in SRAM,
+ * it takes over that frame; at most one bank is copied per update, which
+ * bounds the time spent and stops two banks taking turns in one frame. The
+ * samples also give the share of time the mapped bank was in SRAM.
+ * Banks below ROM_CACHE_FIRST_BANK are never promoted, they are always read
+ * from the fixed copy the caller keeps in SRAM.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#define ROM_CACHE_BANK_SIZE     16384u
+#define ROM_CACHE_PAGE_SIZE     4096u
+#define ROM_CACHE_BANK_PAGES    (ROM_CACHE_BANK_SIZE / ROM_CACHE_PAGE_SIZE)
+/* Enough for 4 MB images, larger ones do not fit in flash anyway. */
+#define ROM_CACHE_BANKS         256u
+#define ROM_CACHE_PAGES         (ROM_CACHE_BANKS * ROM_CACHE_BANK_PAGES)
+#ifndef ROM_CACHE_FRAMES
+#define ROM_CACHE_FRAMES        2u
+#endif
+#ifndef ROM_CACHE_FIRST_BANK
+#define ROM_CACHE_FIRST_BANK    1u
+#endif
+/* Score added to the bank switched to since the last update. */
+#ifndef ROM_CACHE_SWITCH_BONUS
+#define ROM_CACHE_SWITCH_BONUS  256u
+#endif
+/* A bank must score this much more than the one it replaces, and twice as much. */
+#ifndef ROM_CACHE_MIN_GAIN
+#define ROM_CACHE_MIN_GAIN      128u
+#endif
+#define ROM_CACHE_NO_BANK       0xFFFFu
+
+typedef struct {
+    const uint8_t *page[ROM_CACHE_PAGES];   /* Where each page is read from */
+    uint16_t samples[ROM_CACHE_BANKS];      /* Samples since the last update */
+    uint32_t score[ROM_CACHE_BANKS];
+    uint16_t frame_bank[ROM_CACHE_FRAMES];  /* Bank held by each frame */
+    uint16_t last_selected;
+    uint16_t banks;
+    const uint8_t *image;
+
+    /* Statistics, cleared by the caller. */
+    uint32_t hits;          /* Samples of a bank in SRAM */
+    uint32_t misses;        /* Samples of a bank in flash */
+    uint32_t promotions;
+
+    uint8_t frame[ROM_CACHE_FRAMES][ROM_CACHE_BANK_SIZE];
+} rom_cache_t;
+
+static inline void rom_cache_map(rom_cache_t *c, unsigned int b,
+        const uint8_t *data)
+{
+    for(unsigned int p = 0; p < ROM_CACHE_BANK_PAGES; p++)
+        c->page[b * ROM_CACHE_BANK_PAGES + p] = data + p * ROM_CACHE_PAGE_SIZE;
+}
+
+/**
+ * Starts with the first ROM_CACHE_FIRST_BANK banks read from fixed and the
+ * rest of an image of the given number of banks from flash. Banks past the
+ * image repeat it, as on a cartridge that ignores the high bank bits.
+ */
+static inline void rom_cache_init(rom_cache_t *c, const uint8_t *image,
+        unsigned int banks, const uint8_t *fixed)
+{
+    if(banks > ROM_CACHE_BANKS)
+        banks = ROM_CACHE_BANKS;
+    if(banks == 0)
+        banks = 1;
+
+    c->image = image;
+    c->banks = banks;
+    for(unsigned int b = 0; b < ROM_CACHE_BANKS; b++)
+    {
+        if(b < ROM_CACHE_FIRST_BANK)
+            rom_cache_map(c, b, fixed + b * ROM_CACHE_BANK_SIZE);
+        else
+            rom_cache_map(c, b, image + b % banks * ROM_CACHE_BANK_SIZE);
+        c->samples[b] = 0;
+        c->score[b] = 0;
+    }
+    for(unsigned int f = 0; f < ROM_CACHE_FRAMES; f++)
+        c->frame_bank[f] = ROM_CACHE_NO_BANK;
+    c->last_selected = ROM_CACHE_NO_BANK;
+    c->hits = 0;
+    c->misses = 0;
+    c->promotions = 0;
+}
+
+/**
+ * Returns the byte at a linear ROM address. Addresses past the table wrap
+ * around it, a header claiming more than 4 MB cannot read past it.
+ */
+static inline uint8_t rom_cache_read(const rom_cache_t *c, uint32_t addr)
+{
+    return c->page[(addr / ROM_CACHE_PAGE_SIZE) & (ROM_CACHE_PAGES - 1)][addr % ROM_CACHE_PAGE_SIZE];
+}
+
+/**
+ * Records that bank is mapped at 0x4000 now.
+ */
+static inline void rom_cache_sample(rom_cache_t *c, unsigned int bank)
+{
+    if(bank < c->banks)
+        c->samples[bank]++;
+}
+
+static inline bool rom_cache_cached(const rom_cache_t *c, unsigned int b)
+{
+    return c->page[b * ROM_CACHE_BANK_PAGES] != c->image + b * ROM_CACHE_BANK_SIZE;
+}
+
+/**
+ * Folds the samples since the last call into the scores, with selected the
+ * bank the MBC maps at 0x4000 now, and promotes at most one bank. Returns
+ * true if a bank was copied to SRAM.
+ */
+static inline bool rom_cache_update(rom_cache_t *c, unsigned int selected)
+{
+    unsigned int best = ROM_CACHE_NO_BANK;
+    unsigned int worst = 0;
+
+    rom_cache_sample(c, selected);
+    for(unsigned int b = ROM_CACHE_FIRST_BANK; b < c->banks; b++)
+    {
+        if(rom_cache_cached(c, b))
+            c->hits += c->samples[b];
+        else
+            c->misses += c->samples[b];
+        /* Decays to half in about five updates. */
+        c->score[b] = c->score[b] - c->score[b] / 8 + c->samples[b];
+        c->samples[b] = 0;
+    }
+    if(selected != c->last_selected && selected < c->banks)
+    {
+        c->score[selected] += ROM_CACHE_SWITCH_BONUS;
+        c->last_selected = selected;
+    }
+
+    for(unsigned int b = ROM_CACHE_FIRST_BANK; b < c->banks; b++)
+    {
+        if(!rom_cache_cached(c, b) &&
+                (best == ROM_CACHE_NO_BANK || c->score[b] > c->score[best]))
+            best = b;
+    }
+    if(best == ROM_CACHE_NO_BANK)
+        return false;
+
+    /* An empty frame, or the one holding the lowest scoring bank. */
+    for(unsigned int f = 0; f < ROM_CACHE_FRAMES; f++)
+    {
+        if(c->frame_bank[f] == ROM_CACHE_NO_BANK)
+        {
+            worst = f;
+            break;
+        }
+        if(c->score[c->frame_bank[f]] < c->score[c->frame_bank[worst]])
+            worst = f;
+    }
+
+    uint32_t floor = 0;
+    if(c->frame_bank[worst] != ROM_CACHE_NO_BANK)
+        floor = c->score[c->frame_bank[worst]];
+    if(c->score[best] < ROM_CACHE_MIN_GAIN + 2 * floor)
+        return false;
+
+    if(c->frame_bank[worst] != ROM_CACHE_NO_BANK)
+    {
+        unsigned int old = c->frame_bank[worst];
+        rom_cache_map(c, old, c->image + old * ROM_CACHE_BANK_SIZE);
+    }
+    memcpy(c->frame[worst], c->image + best * ROM_CACHE_BANK_SIZE, ROM_CACHE_BANK_SIZE);
+    c->frame_bank[worst] = best;
+    rom_cache_map(c, best, c->frame[worst]);
+    c->promotions++;
+    return true;
+}
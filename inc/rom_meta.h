@@ -0,0 +1,108 @@
+/**
+ * Copyright (C) 2024 by Vlastimil Slintak <slintak@uart.cz>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+ * THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * Record describing a ROM image held in flash.
+ *
+ * A record fills one 256-byte flash page, the slot index of rom_slots.h is
+ * a sector of them. A record is made valid only after its image has been
+ * programmed and verified, and is dropped before the space is reused, so a
+ * valid record always describes a complete image. A ROM file is taken to be
+ * a resident image when its name, size and the two header checksums all
+ * match the record. The caller can then also compare the record CRC32 with
+ * the flash contents to rule out a damaged image.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "rom_flash.h"
+
+#define ROM_META_MAGIC          0x504D4552u /* "REMP" */
+#define ROM_META_SIZE           256u
+#define ROM_META_NAME_LENGTH    228u
+/* Bytes of the cartridge header passed in, zero padded for short files. */
+#define ROM_META_HEADER_LENGTH  0x150u
+
+typedef struct {
+    uint32_t magic;
+    uint32_t size;              /* Image size in bytes */
+    uint32_t crc32;             /* CRC32 of the image */
+    uint8_t header_checksum;    /* Cartridge header 0x14D */
+    uint8_t reserved;
+    uint16_t global_checksum;   /* Cartridge header 0x14E-0x14F */
+    uint32_t offset;            /* Flash offset of the image */
+    uint32_t last_used;         /* Higher is more recently played */
+    char filename[ROM_META_NAME_LENGTH];
+    uint32_t record_crc;        /* CRC32 of all the fields above */
+} rom_meta_t;
+
+_Static_assert(sizeof(rom_meta_t) == ROM_META_SIZE, "rom_meta_t must fill a flash page");
+
+/**
+ * Updates record_crc after the record was changed.
+ */
+static inline void rom_meta_seal(rom_meta_t *meta)
+{
+    meta->record_crc = rom_flash_crc32(0, (const uint8_t *) meta,
+        offsetof(rom_meta_t, record_crc));
+}
+
+/**
+ * Fills a record for an image of size bytes starting with header, stored
+ * at the flash offset.
+ */
+static inline void rom_meta_init(rom_meta_t *meta, const char *filename,
+        uint32_t size, const uint8_t *header, uint32_t crc32, uint32_t offset)
+{
+    memset(meta, 0, sizeof(*meta));
+    meta->magic = ROM_META_MAGIC;
+    meta->size = size;
+    meta->crc32 = crc32;
+    meta->header_checksum = header[0x14D];
+    meta->global_checksum = ((uint16_t) header[0x14E] << 8) | header[0x14F];
+    meta->offset = offset;
+    strncpy(meta->filename, filename, ROM_META_NAME_LENGTH - 1);
+    rom_meta_seal(meta);
+}
+
+/**
+ * Returns true if the record was completely written, false for erased or
+ * damaged flash.
+ */
+static inline bool rom_meta_valid(const rom_meta_t *meta)
+{
+    return meta->magic == ROM_META_MAGIC &&
+        meta->record_crc == rom_flash_crc32(0, (const uint8_t *) meta,
+            offsetof(rom_meta_t, record_crc));
+}
+
+/**
+ * Returns true if the file of size bytes starting with header is the image
+ * described by a valid record.
+ */
+static inline bool rom_meta_matches(const rom_meta_t *meta, const char *filename,
+        uint32_t size, const uint8_t *header)
+{
+    return rom_meta_valid(meta) &&
+        meta->size == size &&
+        meta->header_checksum == header[0x14D] &&
+        meta->global_checksum == (((uint16_t) header[0x14E] << 8) | header[0x14F]) &&
+        strncmp(meta->filename, filename, ROM_META_NAME_LENGTH - 1) == 0;
+}
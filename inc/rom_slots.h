@@ -0,0 +1,193 @@
+/**
+ * Copyright (C) 2024 by Vlastimil Slintak <slintak@uart.cz>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+ * THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * Several ROM images in flash at once.
+ *
+ * The flash above the firmware is split into slots of whole 64 KB erase
+ * blocks, one per image, sized to fit it. The index is one flash sector of
+ * rom_meta_t records; a valid record owns the slot at its offset and the
+ * rest of the region is free. A new image goes into the first gap it fits
+ * in. If there is none, the least recently used images are dropped until
+ * one appears. The allocator only works on a copy of the index in RAM, the
+ * caller programs the index sector, and only erases it first when the copy
+ * is not just the sector with records dropped.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "rom_meta.h"
+
+#define ROM_SLOTS_ENTRIES   16u
+#define ROM_SLOTS_ALIGN     ROM_FLASH_BLOCK
+
+typedef struct {
+    rom_meta_t entry[ROM_SLOTS_ENTRIES];
+} rom_slots_t;
+
+_Static_assert(sizeof(rom_slots_t) == ROM_FLASH_SECTOR, "rom_slots_t must fill a flash sector");
+
+static inline uint32_t rom_slots_length(uint32_t size)
+{
+    return (size + ROM_SLOTS_ALIGN - 1) / ROM_SLOTS_ALIGN * ROM_SLOTS_ALIGN;
+}
+
+/**
+ * Returns the index of the image matching the file, or -1.
+ */
+static inline int rom_slots_find(const rom_slots_t *slots, const char *filename,
+        uint32_t size, const uint8_t *header)
+{
+    for(unsigned int i = 0; i < ROM_SLOTS_ENTRIES; i++)
+    {
+        if(rom_meta_matches(&slots->entry[i], filename, size, header))
+            return i;
+    }
+    return -1;
+}
+
+/**
+ * Returns the index of the most recently used image, or -1 if there is none.
+ */
+static inline int rom_slots_latest(const rom_slots_t *slots)
+{
+    int latest = -1;
+
+    for(unsigned int i = 0; i < ROM_SLOTS_ENTRIES; i++)
+    {
+        const rom_meta_t *e = &slots->entry[i];
+        if(rom_meta_valid(e) &&
+                (latest < 0 || e->last_used > slots->entry[latest].last_used))
+            latest = i;
+    }
+    return latest;
+}
+
+/**
+ * Marks an image as the most recently used one. Returns false if it
+ * already was, and the index does not need to be written.
+ */
+static inline bool rom_slots_touch(rom_slots_t *slots, unsigned int index)
+{
+    int latest = rom_slots_latest(slots);
+
+    if((int) index == latest)
+        return false;
+    slots->entry[index].last_used = latest < 0 ? 1 : slots->entry[latest].last_used + 1;
+    rom_meta_seal(&slots->entry[index]);
+    return true;
+}
+
+/**
+ * Returns true if flash can be turned into slots by programming alone,
+ * which can only clear bits, so without erasing the sector first. This is
+ * the case when records were only dropped, or written into erased ones.
+ */
+static inline bool rom_slots_programmable(const rom_slots_t *flash, const rom_slots_t *slots)
+{
+    const uint8_t *from = (const uint8_t *) flash;
+    const uint8_t *to = (const uint8_t *) slots;
+
+    for(unsigned int i = 0; i < sizeof(*slots); i++)
+    {
+        if((from[i] & to[i]) != to[i])
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Finds the first gap of length bytes in [start, end) between the valid
+ * images. Returns false if there is none.
+ */
+static inline bool rom_slots_gap(const rom_slots_t *slots, uint32_t start,
+        uint32_t end, uint32_t length, uint32_t *offset)
+{
+    uint32_t pos = start;
+
+    while(pos + length <= end)
+    {
+        /* The first image overlapping [pos, pos + length), if any. */
+        const rom_meta_t *hit = NULL;
+        for(unsigned int i = 0; i < ROM_SLOTS_ENTRIES; i++)
+        {
+            const rom_meta_t *e = &slots->entry[i];
+            if(!rom_meta_valid(e))
+                continue;
+            if(e->offset < pos + length && e->offset + rom_slots_length(e->size) > pos)
+            {
+                hit = e;
+                break;
+            }
+        }
+        if(hit == NULL)
+        {
+            *offset = pos;
+            return true;
+        }
+        pos = hit->offset + rom_slots_length(hit->size);
+    }
+    return false;
+}
+
+/**
+ * Finds room for an image of size bytes in [start, end), dropping the
+ * least recently used images as needed. Returns the index of the record to
+ * use for it and stores its flash offset, or returns -1 if the image is
+ * larger than the region. The record returned is invalid, so the index can
+ * be written back before the image is programmed. An erased record is left
+ * erased, the new one can then be programmed over it.
+ */
+static inline int rom_slots_alloc(rom_slots_t *slots, uint32_t start,
+        uint32_t end, uint32_t size, uint32_t *offset)
+{
+    uint32_t length = rom_slots_length(size);
+
+    if(length > end - start)
+        return -1;
+
+    while(!rom_slots_gap(slots, start, end, length, offset))
+    {
+        int oldest = -1;
+        for(unsigned int i = 0; i < ROM_SLOTS_ENTRIES; i++)
+        {
+            const rom_meta_t *e = &slots->entry[i];
+            if(rom_meta_valid(e) &&
+                    (oldest < 0 || e->last_used < slots->entry[oldest].last_used))
+                oldest = i;
+        }
+        slots->entry[oldest].magic = 0;
+    }
+
+    /* A free record, or the least recently used one if all are taken. */
+    int index = -1;
+    for(unsigned int i = 0; i < ROM_SLOTS_ENTRIES; i++)
+    {
+        const rom_meta_t *e = &slots->entry[i];
+        if(!rom_meta_valid(e))
+        {
+            index = i;
+            break;
+        }
+        if(index < 0 || e->last_used < slots->entry[index].last_used)
+            index = i;
+    }
+    if(rom_meta_valid(&slots->entry[index]))
+        slots->entry[index].magic = 0;
+    return index;
+}
@@ -0,0 +1,139 @@
+/**
+ * Copyright (C) 2024 by Vlastimil Slintak <slintak@uart.cz>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+ * THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * Scaling of the 160x144 Game Boy screen to the full 220x176 LCD.
+ *
+ * Horizontally every output pixel has a precomputed source index and a
+ * 5-bit weight of its right neighbour. Vertically lines are only repeated:
+ * each source line is sent to one or two consecutive output rows, so no
+ * line has to be kept around for blending.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#define SCALER_SRC_WIDTH    160
+#define SCALER_SRC_HEIGHT   144
+#define SCALER_DST_WIDTH    220
+#define SCALER_DST_HEIGHT   176
+
+/* Fixed-point precision of the horizontal blend weights. */
+#define SCALER_WEIGHT_BITS  5
+#define SCALER_WEIGHT_ONE   (1u << SCALER_WEIGHT_BITS)
+
+typedef enum {
+    SCALER_MODE_NATIVE = 0, /* 1:1, centred on the LCD */
+    SCALER_MODE_NEAREST,    /* Full screen, nearest neighbour */
+    SCALER_MODE_BLEND,      /* Full screen, 2-tap horizontal blend */
+    SCALER_MODE_COUNT
+} scaler_mode_e;
+
+static struct {
+    uint8_t x_index[SCALER_DST_WIDTH];      /* Nearest source pixel */
+    uint8_t x_left[SCALER_DST_WIDTH];       /* Left tap of the blend */
+    uint8_t x_weight[SCALER_DST_WIDTH];     /* Weight of x_left + 1 */
+    uint8_t y_first[SCALER_SRC_HEIGHT];     /* First output row of a line */
+    uint8_t y_count[SCALER_SRC_HEIGHT];     /* Number of output rows */
+} scaler;
+
+/**
+ * Precomputes the index, weight and line repeat tables. Output pixel
+ * centres are mapped onto the source grid, so both edges are treated alike.
+ */
+void scaler_init(void)
+{
+    for(unsigned int x = 0; x < SCALER_DST_WIDTH; x++)
+    {
+        /* Source position of the output pixel centre, scaled by 2*dst. */
+        unsigned int pos = (2 * x + 1) * SCALER_SRC_WIDTH;
+        scaler.x_index[x] = pos / (2 * SCALER_DST_WIDTH);
+
+        /* Same position minus half a source pixel, in 1/SCALER_WEIGHT_ONE. */
+        int fixed = ((int) pos - SCALER_DST_WIDTH) * (int) SCALER_WEIGHT_ONE
+            / (2 * SCALER_DST_WIDTH);
+        if(fixed < 0)
+            fixed = 0;
+        unsigned int left = fixed >> SCALER_WEIGHT_BITS;
+        unsigned int weight = fixed & (SCALER_WEIGHT_ONE - 1);
+        if(left >= SCALER_SRC_WIDTH - 1)
+        {
+            left = SCALER_SRC_WIDTH - 2;
+            weight = SCALER_WEIGHT_ONE;
+        }
+        scaler.x_left[x] = left;
+        scaler.x_weight[x] = weight;
+    }
+
+    for(unsigned int y = 0; y < SCALER_SRC_HEIGHT; y++)
+        scaler.y_count[y] = 0;
+
+    for(unsigned int y = 0; y < SCALER_DST_HEIGHT; y++)
+    {
+        unsigned int src = (2 * y + 1) * SCALER_SRC_HEIGHT / (2 * SCALER_DST_HEIGHT);
+        if(scaler.y_count[src]++ == 0)
+            scaler.y_first[src] = y;
+    }
+}
+
+/**
+ * Scales one line of Peanut-GB pixel bytes to RGB565 by repeating pixels.
+ * Two output pixels are stored per 32-bit write, so out must be word aligned.
+ */
+void scaler_line_nearest(const uint16_t lut[256], const uint8_t *pixels,
+        uint16_t *out)
+{
+    uint32_t *out32 = (uint32_t *) out;
+    const uint8_t *index = scaler.x_index;
+
+    for(unsigned int x = 0; x < SCALER_DST_WIDTH; x += 2)
+    {
+        *out32++ = lut[pixels[index[x]]] |
+            ((uint32_t) lut[pixels[index[x + 1]]] << 16);
+    }
+}
+
+/**
+ * Blends two RGB565 colours. Green is moved into the upper half-word so the
+ * three channels can be weighted with a single multiplication each way.
+ */
+static inline uint16_t scaler_blend565(uint16_t a, uint16_t b, unsigned int weight)
+{
+    uint32_t wa = (a | ((uint32_t) a << 16)) & 0x07E0F81Fu;
+    uint32_t wb = (b | ((uint32_t) b << 16)) & 0x07E0F81Fu;
+    uint32_t mix = ((wa * (SCALER_WEIGHT_ONE - weight) + wb * weight)
+        >> SCALER_WEIGHT_BITS) & 0x07E0F81Fu;
+    return (uint16_t) (mix | (mix >> 16));
+}
+
+/**
+ * Scales one line of Peanut-GB pixel bytes to RGB565, blending the two
+ * nearest source pixels. out must be word aligned.
+ */
+void scaler_line_blend(const uint16_t lut[256], const uint8_t *pixels,
+        uint16_t *out)
+{
+    uint32_t *out32 = (uint32_t *) out;
+
+    for(unsigned int x = 0; x < SCALER_DST_WIDTH; x += 2)
+    {
+        const uint8_t *p0 = &pixels[scaler.x_left[x]];
+        const uint8_t *p1 = &pixels[scaler.x_left[x + 1]];
+        uint16_t c0 = scaler_blend565(lut[p0[0]], lut[p0[1]], scaler.x_weight[x]);
+        uint16_t c1 = scaler_blend565(lut[p1[0]], lut[p1[1]], scaler.x_weight[x + 1]);
+        *out32++ = c0 | ((uint32_t) c1 << 16);
+    }
+}
@@ -23,17 +23,78 @@
 
 #define ENABLE_DEBUG 0
 
+/**
+ * Skip drawing every other frame while drawn frames take longer than
+ * the DMG frame period.
+ */
+#define ENABLE_AUTO_FRAME_SKIP 1
+
+/**
+ * Start every frame on a hardware alarm deadline at 59.73 Hz (or a multiple
+ * of it when fast-forwarding) and sleep in between, instead of running
+ * frames back to back.
+ */
+#define ENABLE_FRAME_PACING 1
+
+/**
+ * Resample each audio frame with a ratio steered by the I2S buffer fill
+ * level, instead of rendering it straight into the DMA buffer.
+ */
+#define ENABLE_AUDIO_DRC 1
+
+/**
+ * Sample rate of the I2S output, e.g. 32768, 44100 or 48000. The APU keeps
+ * rendering at AUDIO_SAMPLE_RATE, any other rate goes through the resampler.
+ */
+#define AUDIO_OUTPUT_RATE 32768
+
+/**
+ * Split every frame of audio into this many DMA periods, 1, 2 or 4.
+ * Rate control keeps half a frame queued ahead of the speaker when a frame
+ * arrives, or one period if that is longer: 16.7 ms with 1 period, 8.4 ms
+ * with 2 or 4. Only this queue gets shorter. The APU still renders whole
+ * frames, so a key press also waits for the frame that reads it to be
+ * emulated, about 25 ms in all to the first sample of that frame.
+ */
+#define AUDIO_PERIODS_PER_FRAME 4
+
+/**
+ * Keep playing sound while fast-forwarding. Only the frames needed to keep
+ * the output fed are rendered, so the sound plays at its normal pitch with
+ * the frames in between dropped. When off, fast-forward is silent.
+ */
+#define ENABLE_AUDIO_FAST_FORWARD 1
+
+/**
+ * Pass the APU output through the DMG coupling capacitor high-pass and a
+ * gentle low-pass, which removes DC pops and softens the harsh edges.
+ */
+#define ENABLE_AUDIO_FILTER 1
+
+/**
+ * Keep copies of the most used switchable ROM banks in SRAM, so their reads
+ * avoid XIP cache misses, and read the ROM through a table of 4 KB pages.
+ * Costs ROM_CACHE_FRAMES 16 KB frames of SRAM plus 5 KB of tables.
+ * Banks 0 to 3 are always read from rom_bank0.
+ */
+#define ENABLE_ROM_CACHE 1
+#define ROM_CACHE_FRAMES 2u
+#define ROM_CACHE_FIRST_BANK 4u
+
 /**
  * Reducing VSYNC calculation to lower multiple.
  * When setting a clock IRQ to DMG_CLOCK_FREQ_REDUCED, count to
  * SCREEN_REFRESH_CYCLES_REDUCED to obtain the time required each VSYNC.
  * DMG_CLOCK_FREQ_REDUCED = 2^18, and SCREEN_REFRESH_CYCLES_REDUCED = 4389.
- * Currently unused.
+ * Used by the frame pacer.
  */
 #define VSYNC_REDUCTION_FACTOR 16u
 #define SCREEN_REFRESH_CYCLES_REDUCED (SCREEN_REFRESH_CYCLES/VSYNC_REDUCTION_FACTOR)
 #define DMG_CLOCK_FREQ_REDUCED (DMG_CLOCK_FREQ/VSYNC_REDUCTION_FACTOR)
 
+/* Duration of one DMG frame (59.73 Hz) in microseconds. */
+#define FRAME_PERIOD_US ((uint32_t) (SCREEN_REFRESH_CYCLES * 1000000.0 / DMG_CLOCK_FREQ))
+
 /* C Headers */
 #include <stdlib.h>
 #include <string.h>
@@ -62,6 +123,18 @@
 #include "sdcard.h"
 #include "i2s.h"
 #include "gbcolors.h"
+#include "lcd_line.h"
+#include "scaler.h"
+#include "frameskip.h"
+#include "apu_queue.h"
+#include "apu_catchup.h"
+#include "apu_naive.h"
+#include "audio_filter.h"
+#include "rom_flash.h"
+#include "rom_slots.h"
+#include "rom_cache.h"
+#include "resampler.h"
+#include "framepacer.h"
 
 /* GPIO Connections. */
 #define GPIO_UP     2
@@ -79,6 +152,14 @@
 #define GPIO_RST    21
 #define GPIO_LED    22
 
+/* Audio synthesis tiers, from the best sounding to the cheapest. */
+typedef enum {
+    AUDIO_QUALITY_FULL = 0, /* minigb_apu, band-limited */
+    AUDIO_QUALITY_NAIVE,    /* apu_naive, point sampled */
+    AUDIO_QUALITY_LOW,      /* apu_naive, noise at a reduced rate */
+    AUDIO_QUALITY_COUNT
+} audio_quality_e;
+
 #if ENABLE_SOUND
 
 typedef enum {
@@ -86,42 +167,484 @@ typedef enum {
     AUDIO_CMD_PLAYBACK,
     AUDIO_CMD_VOLUME_UP,
     AUDIO_CMD_VOLUME_DOWN,
+    AUDIO_CMD_SKIP,
+    AUDIO_CMD_FLASH,
     AUDIO_CMD_INVALID
 } audio_commands_e;
 
 /**
  * Global variables for audio task
- * stream contains N=AUDIO_SAMPLES samples
+ * The APU renders each frame straight into a free I2S DMA buffer of
+ * N=AUDIO_SAMPLES samples
  * each sample is 32 bits
  * 16 bits for the left channel + 16 bits for the right channel in stereo interleaved format)
  * This is intended to be played at AUDIO_SAMPLE_RATE Hz
+ * i2s_config is only changed by core1, core0 reads its counters.
  */
-int16_t *stream;
+static i2s_config_t i2s_config;
 struct minigb_apu_ctx apu_ctx = {0};
 
-#define audio_read(a)      audio_read(&apu_ctx, (a))
-#define audio_write(a, v)  audio_write(&apu_ctx, (a), (v));
+/**
+ * apu_ctx is only touched by core1. APU register writes of the emulation
+ * are queued with their position in the frame, followed by an end of frame
+ * record, and core1 replays one frame of them before rendering it.
+ * Register reads on core0 are answered from a shadow of the written values
+ * and the channel status last published by core1.
+ */
+static apu_queue_t apu_queue;
+static volatile uint8_t apu_status = 0;     // NR52 channel bits, from core1
+static volatile uint8_t audio_quality = AUDIO_QUALITY_FULL; // From core0
+static uint8_t apu_triggered = 0;           // Channels started this frame
+
+/* Register values after the DMG boot ROM, NR10 to NR52 and wave RAM. */
+static uint8_t apu_shadow[0x30] = {
+    0x80, 0xBF, 0xF3, 0xFF, 0x3F, 0xFF, 0x3F, 0x00,
+    0xFF, 0x3F, 0x7F, 0xFF, 0x9F, 0xFF, 0x3F, 0xFF,
+    0xFF, 0x00, 0x00, 0x3F, 0x77, 0xF3, 0xF1, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0xAC, 0xDD, 0xDA, 0x48, 0x36, 0x02, 0xCF, 0x16,
+    0x2C, 0x04, 0xE5, 0x2C, 0xAC, 0xDD, 0xDA, 0x48
+};
+
+static uint8_t apu_read(const uint16_t addr)
+{
+    /* Bits that always read back as 1, NR10 to NR52. */
+    static const uint8_t read_mask[0x17] = {
+        0x80, 0x3F, 0x00, 0xFF, 0xBF,
+        0xFF, 0x3F, 0x00, 0xFF, 0xBF,
+        0x7F, 0xFF, 0x9F, 0xFF, 0xBF,
+        0xFF, 0xFF, 0x00, 0x00, 0xBF,
+        0x00, 0x00, 0x70
+    };
+    uint8_t reg = addr - APU_QUEUE_REG_BASE;
+
+    if(reg >= sizeof(apu_shadow))
+        return 0xFF;
+    if(addr == 0xFF26)
+        return (apu_shadow[reg] & 0x80) | 0x70 |
+            ((apu_status | apu_triggered) & 0x0F);
+    if(reg < sizeof(read_mask))
+        return apu_shadow[reg] | read_mask[reg];
+    if(reg < 0x20)
+        return 0xFF;
+
+    return apu_shadow[reg];
+}
+
+static void apu_write(const uint32_t cycle, const uint16_t addr, const uint8_t val)
+{
+    uint8_t reg = addr - APU_QUEUE_REG_BASE;
+
+    if(reg >= sizeof(apu_shadow))
+        return;
+
+    /* While powered off only NR52 and wave RAM take writes. */
+    if(!(apu_shadow[0x16] & 0x80) && reg < 0x16)
+        return;
+
+    apu_shadow[reg] = val;
+    if(addr == 0xFF26 && !(val & 0x80)) {
+        memset(apu_shadow, 0, 0x16);
+        apu_triggered = 0;
+    }
+    /* NR14, NR24, NR34 and NR44 trigger their channel. */
+    if((val & 0x80) && (reg == 0x04 || reg == 0x09 || reg == 0x0E || reg == 0x13))
+        apu_triggered |= 1 << (reg / 5);
+
+    /* Keep one record free for the end of frame. */
+    apu_queue_push(&apu_queue, APU_QUEUE_RECORD(cycle, addr, val), 1);
+}
+
+/* Samples of one frame at the output rate, and of one DMA period. */
+#define AUDIO_OUTPUT_SAMPLES ((uint16_t) (AUDIO_OUTPUT_RATE / VERTICAL_SYNC))
+#define AUDIO_PERIOD_SAMPLES (AUDIO_OUTPUT_SAMPLES / AUDIO_PERIODS_PER_FRAME)
+#define AUDIO_RESAMPLE (ENABLE_AUDIO_DRC || AUDIO_OUTPUT_RATE != AUDIO_SAMPLE_RATE || \
+                        AUDIO_PERIODS_PER_FRAME != 1)
+
+#if AUDIO_PERIODS_PER_FRAME * 2 > I2S_DMA_BUFFERS
+#error "AUDIO_PERIODS_PER_FRAME needs more DMA buffers than I2S_DMA_BUFFERS"
+#endif
+
+/* The SD card driver claims a TX and an RX channel for its SPI. Every
+ * claim panics once the DMA runs out of channels. */
+#define SD_DMA_CHANNELS 2
+#if ILI9225_DMA_CHANNELS + I2S_DMA_CHANNELS + SD_DMA_CHANNELS * ENABLE_SDCARD > NUM_DMA_CHANNELS
+#error "The LCD, I2S and SD card drivers need more DMA channels than there are"
+#endif
+
+#if ENABLE_DEBUG
+/**
+ * Key-to-speaker latency probe, toggled by 'l' in the debug console.
+ * Core0 stamps the frame that first sees a button press into
+ * audio_latency_key_us, core1 clears it once the frame is queued and
+ * estimates when its first sample reaches the speaker.
+ */
+static bool audio_latency_probe = false;
+static volatile uint32_t audio_latency_key_us = 0;
+static volatile uint32_t audio_latency_last_us = 0;
+static volatile uint32_t audio_latency_max_us = 0;
+static volatile uint32_t audio_latency_sum_us = 0;
+static volatile uint32_t audio_latency_count = 0;
+
+/**
+ * Completes a probe started by core0, fill is the audio queued ahead of
+ * the frame just rendered. Core1 only.
+ */
+static void audio_latency_measure(uint32_t fill)
+{
+    uint32_t key = audio_latency_key_us;
+    if(key == 0)
+        return;
+
+    uint32_t latency = time_us_32() - key +
+        (uint32_t) ((uint64_t) fill * 1000000u / AUDIO_OUTPUT_RATE);
+    audio_latency_last_us = latency;
+    if(latency > audio_latency_max_us)
+        audio_latency_max_us = latency;
+    audio_latency_sum_us += latency;
+    audio_latency_count++;
+    audio_latency_key_us = 0;
+}
+#endif
+
+#if AUDIO_RESAMPLE
+/**
+ * Resampled output, core1 only. A rendered frame is resampled into
+ * the DMA buffers, which no longer line up with frames: audio_out is the
+ * buffer being filled and audio_out_pos the samples already in it.
+ */
+static int16_t *apu_stream;
+static resampler_t resampler;
+static uint32_t resampler_nominal_step;
+static uint32_t *audio_out = NULL;
+static uint32_t audio_out_pos = 0;
+
+/**
+ * Resamples one frame of APU output into the I2S DMA periods. With rate
+ * control the step is set from the queued audio, aiming at half a frame
+ * (or one buffer, if longer) ahead of the output when a frame arrives.
+ */
+static void audio_output_frame(const int16_t *samples)
+{
+    const uint32_t *in = (const uint32_t *) samples;
+    unsigned int left = AUDIO_SAMPLES;
+    uint32_t length = i2s_config.dma_trans_count;
+    uint32_t fill = i2s_dma_fill(&i2s_config) + audio_out_pos;
+
+#if ENABLE_DEBUG
+    audio_latency_measure(fill);
+#endif
+#if ENABLE_AUDIO_DRC
+    uint32_t target = length * AUDIO_PERIODS_PER_FRAME / 2;
+    if(target < length)
+        target = length;
+    /* The output ran dry, at start or after a stall. The rate control
+     * alone would take seconds of underruns to build the level back up,
+     * so start it at the target with silence. */
+    if(fill == 0 && audio_out == NULL) {
+        for(; fill < target; fill += length) {
+            memset(i2s_dma_acquire(&i2s_config), 0, length * sizeof(uint32_t));
+            i2s_dma_submit(&i2s_config);
+        }
+    }
+    resampler.step = resampler_drc_step(&resampler, resampler_nominal_step, fill, target);
+#else
+    (void) fill;
+#endif
+
+    while(left > 0) {
+        unsigned int used;
+
+        if(audio_out == NULL)
+            audio_out = (uint32_t *) i2s_dma_acquire(&i2s_config);
+
+        audio_out_pos += resampler_run(&resampler, in, left,
+            audio_out + audio_out_pos, length - audio_out_pos, &used);
+        in += used;
+        left -= used;
+
+        if(audio_out_pos == length) {
+            i2s_dma_submit(&i2s_config);
+            audio_out = NULL;
+            audio_out_pos = 0;
+        }
+    }
+}
+#endif
+
+/**
+ * Core1 only. apu_model follows the length, envelope and sweep state of
+ * every frame, rendered or not. apu_ctx only advances on frames it renders,
+ * apu_ctx_behind tells that it has to be caught up before the next one.
+ * The cheaper quality tiers render from apu_model through apu_naive.
+ */
+static apu_catchup_t apu_model;
+static apu_naive_t apu_naive;
+static bool apu_ctx_behind = false;
+#if ENABLE_AUDIO_FILTER
+static audio_filter_t audio_filter;
+#endif
+
+/**
+ * Audio timing statistics. Only core1 writes the counters, each one a
+ * single word, so core0 can read them at any time without locking. Core0
+ * asks for a reset through reset, which core1 carries out on the next frame.
+ */
+#define AUDIO_FILL_BINS 8
+static struct {
+    volatile uint32_t frames;           // Frames rendered
+    volatile uint32_t synth_us;         // Time spent synthesising them
+    volatile uint32_t synth_max_us;     // Longest frame synthesis
+    volatile uint32_t fill_min;         // Fewest samples queued on a new frame
+    volatile uint32_t fill_hist[AUDIO_FILL_BINS];  // Queued DMA periods on a new frame
+    volatile bool reset;                // Set by core0
+} audio_stats = { .fill_min = UINT32_MAX };
+
+/**
+ * Counts a rendered frame, fill being the samples queued when it arrived.
+ * Core1 only.
+ */
+static void audio_stats_frame(uint32_t synth_us, uint32_t fill)
+{
+    if(audio_stats.reset) {
+        audio_stats.frames = 0;
+        audio_stats.synth_us = 0;
+        audio_stats.synth_max_us = 0;
+        audio_stats.fill_min = UINT32_MAX;
+        for(unsigned int i = 0; i < AUDIO_FILL_BINS; i++)
+            audio_stats.fill_hist[i] = 0;
+        audio_stats.reset = false;
+    }
+
+    uint32_t bin = fill / i2s_config.dma_trans_count;
+    if(bin >= AUDIO_FILL_BINS)
+        bin = AUDIO_FILL_BINS - 1;
+    audio_stats.fill_hist[bin]++;
+    if(fill < audio_stats.fill_min)
+        audio_stats.fill_min = fill;
+    if(synth_us > audio_stats.synth_max_us)
+        audio_stats.synth_max_us = synth_us;
+    audio_stats.synth_us += synth_us;
+    audio_stats.frames++;
+}
+
+/**
+ * Advances apu_model from *cycle to the cycle to. With out given, the
+ * samples up to that point are rendered by apu_naive, *pos counting the
+ * samples done. Core1 only.
+ */
+static void apu_model_run(uint32_t to, int16_t *out, uint32_t *cycle,
+        unsigned int *pos)
+{
+    if(out != NULL && *pos < AUDIO_SAMPLES) {
+        unsigned int n = to / APU_NAIVE_SAMPLE_CYCLES;
+        if(n > AUDIO_SAMPLES)
+            n = AUDIO_SAMPLES;
+        if(n <= *pos)
+            return;
+        apu_naive_render(&apu_naive, &apu_model, out + 2 * *pos, n - *pos);
+        *cycle = n * APU_NAIVE_SAMPLE_CYCLES;
+        *pos = n;
+        if(n < AUDIO_SAMPLES)
+            return;
+    }
+    /* A frame is a little longer than AUDIO_SAMPLES, the rest of it is
+     * only advanced. */
+    if(to > *cycle) {
+        apu_catchup_advance(&apu_model, to - *cycle);
+        *cycle = to;
+    }
+}
+
+/**
+ * Replays the queued writes of one frame into apu_ctx and apu_model,
+ * advancing the model to each write. With out given, the frame is also
+ * rendered into it by apu_naive. Core1 only.
+ */
+static void apu_replay_frame(int16_t *out)
+{
+    uint32_t record;
+    uint32_t cycle = 0;
+    unsigned int pos = 0;
+
+    while(apu_queue_pop(&apu_queue, &record) && !APU_QUEUE_IS_END_FRAME(record)) {
+        apu_model_run(APU_QUEUE_CYCLE(record), out, &cycle, &pos);
+        apu_catchup_write(&apu_model, APU_QUEUE_ADDR(record), APU_QUEUE_VALUE(record));
+        audio_write(&apu_ctx, APU_QUEUE_ADDR(record), APU_QUEUE_VALUE(record));
+    }
+    apu_model_run(APU_CATCHUP_FRAME_CYCLES, out, &cycle, &pos);
+}
+
+static void apu_ctx_write(uint16_t addr, uint8_t val)
+{
+    audio_write(&apu_ctx, addr, val);
+}
+
+/**
+ * Returns the number of samples queued ahead of the output. Core1 only.
+ */
+static uint32_t audio_queued(void)
+{
+#if AUDIO_RESAMPLE
+    return i2s_dma_fill(&i2s_config) + audio_out_pos;
+#else
+    return i2s_dma_fill(&i2s_config);
+#endif
+}
+
+/**
+ * Replays the next frame, renders it at the selected quality and queues it
+ * for output. Core1 only.
+ */
+static void audio_play_frame(void)
+{
+    uint8_t quality = audio_quality;
+    uint32_t fill = audio_queued();
+#if AUDIO_RESAMPLE
+    int16_t *samples = apu_stream;
+#else
+    int16_t *samples = i2s_dma_acquire(&i2s_config);
+#if ENABLE_DEBUG
+    audio_latency_measure(fill);
+#endif
+#endif
+    uint32_t start = time_us_32();
+
+    if(quality != AUDIO_QUALITY_FULL) {
+        apu_naive.noise_reduced = quality == AUDIO_QUALITY_LOW;
+        apu_replay_frame(samples);
+        apu_ctx_behind = true;
+        apu_status = apu_catchup_status(&apu_model);
+    } else {
+        apu_replay_frame(NULL);
+        if(apu_ctx_behind) {
+            apu_catchup_sync(&apu_model, apu_ctx_write);
+            apu_ctx_behind = false;
+        }
+        audio_callback(&apu_ctx, samples);
+        apu_status = audio_read(&apu_ctx, 0xFF26);
+    }
+    audio_stats_frame(time_us_32() - start, fill);
+
+#if AUDIO_RESAMPLE
+    /* The resampler applies the filter and the gain. */
+    audio_output_frame(samples);
+#else
+#if ENABLE_AUDIO_FILTER
+    audio_filter_run(&audio_filter, (uint32_t *) samples, (const uint32_t *) samples,
+        AUDIO_SAMPLES, i2s_gain(&i2s_config));
+#else
+    i2s_apply_gain((uint32_t *) samples, (const uint32_t *) samples,
+        AUDIO_SAMPLES, i2s_gain(&i2s_config));
+#endif
+    i2s_dma_submit(&i2s_config);
+#endif
+}
+
+#define audio_read(a)      apu_read(a)
+#define audio_write(a, v)  apu_write(APU_QUEUE_FRAME_CYCLE(gb->hram_io[IO_LY], \
+                               gb->counter.lcd_count), (a), (v));
 #include "peanut_gb.h"
 #undef audio_read
 #undef audio_write
+#if LCD_LINE_CYCLES != APU_QUEUE_LINE_CYCLES || \
+    APU_QUEUE_LINE_CYCLES * APU_QUEUE_FRAME_LINES != APU_CATCHUP_FRAME_CYCLES
+#error "APU write stamps do not match the Peanut-GB frame"
+#endif
 #else
 #include "peanut_gb.h"
 #endif
 
 /** Definition of ROM data
- * We're going to erase and reprogram a region 1Mb from the start of the flash
- * Once done, we can access this at XIP_BASE + 1Mb.
+ * ROM images are kept in slots from 1Mb to the end of the flash, see
+ * rom_slots.h, and rom points at the one being played.
  * Game Boy DMG ROM size ranges from 32768 bytes (e.g. Tetris) to 1,048,576 bytes (e.g. Pokemod Red)
  */
 #define FLASH_TARGET_OFFSET (1024 * 1024)
+#define FLASH_TARGET_END PICO_FLASH_SIZE_BYTES
 const uint8_t *rom = (const uint8_t *) (XIP_BASE + FLASH_TARGET_OFFSET);
+/* Size of the image at rom, from its slot record. The cartridge header
+ * is not trusted for it, its size code can claim more than is in flash. */
+uint32_t rom_size = FLASH_TARGET_END - FLASH_TARGET_OFFSET;
+
+/**
+ * The sector just below the slots holds their index, so choosing a game
+ * already in flash does not program it again. The firmware itself must
+ * stay below this sector, rom_index.ld fails the link otherwise.
+ */
+#define FLASH_INDEX_OFFSET (FLASH_TARGET_OFFSET - FLASH_SECTOR_SIZE)
+const rom_slots_t *rom_index = (const rom_slots_t *) (XIP_BASE + FLASH_INDEX_OFFSET);
 static unsigned char rom_bank0[65536];
+#if ENABLE_ROM_CACHE
+static rom_cache_t rom_cache;
+#endif
 
 static uint8_t ram[32768];
 static int lcd_line_busy = 0;
 static palette_t palette;   // Colour palette
+static palette_lut_t palette_lut;   // Pixel byte to RGB565, built from palette
 static uint8_t manual_palette_selected=0;
 
+/**
+ * Format of the scanlines sent to the LCD. In indexed mode the CPU only
+ * packs 4-bit colour indexes (palette select in bits 2-3, shade in bits 0-1)
+ * and the LCD driver expands them to RGB565.
+ */
+static ili9225_pixel_format_e lcd_pixel_format = ILI9225_PIXEL_INDEXED4;
+
+/* Position of the game screen on the LCD. */
+#define LCD_X_OFFSET ((ILI9225_SCREEN_WIDTH - LCD_WIDTH) / 2)
+#define LCD_Y_OFFSET ((ILI9225_SCREEN_HEIGHT - LCD_HEIGHT) / 2)
+
+/**
+ * Dirty scanline detection.
+ * Each line sent to the LCD is hashed together with lcd_generation, which
+ * changes whenever the LCD content can no longer be trusted (new game,
+ * palette or pixel format change). Lines whose hash matches the one last
+ * sent are skipped. Every queued line carries its own GRAM address, so
+ * skipping lines costs nothing on the LCD side.
+ */
+static uint32_t lcd_line_sent[LCD_HEIGHT];
+static uint32_t lcd_generation = 0;
+static uint32_t lcd_line_hits = 0;
+static uint32_t lcd_line_misses = 0;
+static uint32_t lcd_bytes_sent = 0;
+static uint32_t lcd_lines_drawn = 0;
+
+/**
+ * Speed set by SELECT+A: 1, 2, 4 or FRAME_SPEED_UNCAPPED. Any speed other
+ * than 1 is fast-forward, which skips every other frame and is silent.
+ */
+static unsigned int frame_speed = 1;
+
+#if ENABLE_FRAME_PACING
+static int frame_alarm;
+static volatile bool frame_alarm_fired;
+static uint64_t frame_slack_us = 0;
+#endif
+
+/**
+ * Per game settings, stored on the SD card next to the save files.
+ * Peanut-GB resets gb.direct.interlace in gb_init_lcd(), so it is kept here
+ * and not taken from the saved emulator state.
+ */
+#define GAME_SETTINGS_MAGIC 0x50475331u /* "PGS1" */
+struct game_settings_s {
+    uint32_t magic;
+    uint8_t scaler_mode;    /* scaler_mode_e, scaled lines are always RGB565 */
+    uint8_t interlace;      /* Send only odd or even lines each frame */
+    uint8_t audio_quality;  /* audio_quality_e */
+    uint8_t reserved[1];
+};
+#define GAME_SETTINGS_DEFAULT {             \
+    .magic = GAME_SETTINGS_MAGIC,           \
+    .scaler_mode = SCALER_MODE_NATIVE,      \
+    .interlace = 0,                         \
+    .audio_quality = AUDIO_QUALITY_FULL,    \
+}
+static const struct game_settings_s game_settings_default = GAME_SETTINGS_DEFAULT;
+static struct game_settings_s game_settings = GAME_SETTINGS_DEFAULT;
+
 static struct
 {
     unsigned a  : 1;
@@ -134,8 +657,72 @@ static struct
     unsigned down   : 1;
 } prev_joypad_bits;
 
-/* Pixel data is stored in here. */
-static uint16_t pixels_buffer[LCD_WIDTH];
+/**
+ * Forces every scanline of the next frame to be sent to the LCD.
+ */
+static void lcd_invalidate_lines(void)
+{
+    lcd_generation++;
+}
+
+/**
+ * Rebuilds the pixel lookup tables after the palette has changed.
+ */
+static void update_palette(void)
+{
+    build_palette_lut(palette, palette_lut);
+    lcd_invalidate_lines();
+#if ENABLE_LCD
+    uint16_t colors[12];
+    lcd_line_index_colors(palette_lut, colors);
+    ili9225_set_palette(colors, 12);
+#endif
+}
+
+/**
+ * Steps through the fast-forward speeds: 1, 2, 4, uncapped.
+ */
+static void next_frame_speed(struct gb_s *gb)
+{
+    if(frame_speed == FRAME_SPEED_UNCAPPED)
+        frame_speed = 1;
+    else if(frame_speed == FRAME_SPEED_MAX)
+        frame_speed = FRAME_SPEED_UNCAPPED;
+    else
+        frame_speed *= 2;
+
+    gb->direct.frame_skip = frame_speed != 1;
+    DBG_INFO("I frame_speed = %u\n", frame_speed);
+}
+
+#if ENABLE_FRAME_PACING
+static void frame_alarm_callback(uint alarm_num)
+{
+    (void) alarm_num;
+    frame_alarm_fired = true;
+    __sev();
+}
+
+/**
+ * Sleeps until target_us. Both the alarm interrupt and __sev() in its
+ * callback wake the core from __wfe().
+ */
+static void frame_wait_until(uint64_t target_us)
+{
+    uint64_t now = time_us_64();
+    if(target_us <= now)
+        return;
+
+    frame_alarm_fired = false;
+    if(hardware_alarm_set_target(frame_alarm, from_us_since_boot(target_us)))
+        return; /* Already passed. */
+
+    while(!frame_alarm_fired)
+        __wfe();
+
+    frame_slack_us += target_us - now;
+}
+#endif
 
 /**
  * Returns a byte from the ROM file at the given address.
@@ -143,10 +730,15 @@ static uint16_t pixels_buffer[LCD_WIDTH];
 uint8_t gb_rom_read(struct gb_s *gb, const uint_fast32_t addr)
 {
     (void) gb;
+#if ENABLE_ROM_CACHE
+    /* rom_bank0 is mapped in the page table too. */
+    return rom_cache_read(&rom_cache, addr);
+#else
     if(addr < sizeof(rom_bank0))
         return rom_bank0[addr];
 
     return rom[addr];
+#endif
 }
 
 /**
@@ -185,32 +777,99 @@ void gb_error(struct gb_s *gb, const enum gb_error_e gb_err, const uint16_t addr
 }
 
 #if ENABLE_LCD
+/**
+ * Sets up the LCD window, pixel format and interlacing from game_settings
+ * and forces the next frame to be sent in full.
+ * With interlacing Peanut-GB only draws odd or even lines each frame and,
+ * since every queued line carries its own GRAM address, only those lines
+ * are sent to the LCD.
+ */
+static void lcd_apply_mode(struct gb_s *gb)
+{
+    ili9225_pixel_format_e format = lcd_pixel_format;
+
+#if PEANUT_FULL_GBC_SUPPORT
+    /* CGB colours do not go through palette_lut, keep them unscaled. */
+    if (gb->cgb.cgbMode)
+        game_settings.scaler_mode = SCALER_MODE_NATIVE;
+#endif
+    gb->direct.interlace = game_settings.interlace;
+
+    ili9225_fill(0x0000);
+    if (game_settings.scaler_mode == SCALER_MODE_NATIVE) {
+        ili9225_set_window(LCD_X_OFFSET, LCD_WIDTH, LCD_Y_OFFSET, LCD_HEIGHT);
+    } else {
+        ili9225_set_window(0, SCALER_DST_WIDTH, 0, SCALER_DST_HEIGHT);
+        format = ILI9225_PIXEL_RGB565;
+    }
+#if PEANUT_FULL_GBC_SUPPORT
+    /* CGB colours do not fit the indexed palette. */
+    if (gb->cgb.cgbMode)
+        format = ILI9225_PIXEL_RGB565;
+#endif
+    ili9225_set_pixel_format(format);
+    lcd_invalidate_lines();
+}
+
 void lcd_draw_line(struct gb_s *gb, const uint8_t pixels[LCD_WIDTH],
            const uint_fast8_t line)
 {
+    /* Convert into a free buffer of the LCD DMA ring while previous lines
+     * are still being streamed out. */
+    uint16_t *pixels_buffer = ili9225_line_acquire();
+    unsigned int width = LCD_WIDTH;
+
+    lcd_lines_drawn++;
+#if ENABLE_ROM_CACHE
+    rom_cache_sample(&rom_cache, gb->selected_rom_bank);
+#endif
+    unsigned int words = LCD_WIDTH / 2;
+
     #if PEANUT_FULL_GBC_SUPPORT
     if (gb->cgb.cgbMode) {
         for (unsigned int x = 0; x < LCD_WIDTH; x++) {
             pixels_buffer[x] = gb->cgb.fixPalette[pixels[x]] << 1;
         }
-    } else {
+    } else
     #endif
-        for (unsigned int x = 0; x < LCD_WIDTH; x++) {
-            pixels_buffer[x] = palette[(pixels[x] & LCD_PALETTE_ALL) >> 4][pixels[x] & 3];
-        }
-    #if PEANUT_FULL_GBC_SUPPORT
+    if (game_settings.scaler_mode != SCALER_MODE_NATIVE) {
+        if (game_settings.scaler_mode == SCALER_MODE_BLEND)
+            scaler_line_blend(palette_lut, pixels, pixels_buffer);
+        else
+            scaler_line_nearest(palette_lut, pixels, pixels_buffer);
+        width = SCALER_DST_WIDTH;
+        words = SCALER_DST_WIDTH / 2;
+    } else if (lcd_pixel_format == ILI9225_PIXEL_INDEXED4) {
+        lcd_line_indexed4(pixels, (uint32_t *) pixels_buffer, LCD_WIDTH);
+        words = LCD_WIDTH / 8;
+    } else {
+        /* Line buffers are word aligned and LCD_WIDTH is a multiple of 4. */
+        lcd_line_rgb565(palette_lut, pixels, pixels_buffer, LCD_WIDTH);
     }
-    #endif
 
-    ili9225_write_pixels_wait();
-    if(line == 0) {
-        ili9225_write_pixels_start(30, 16);
-    } else if(line == LCD_HEIGHT) {
-        ili9225_write_pixels_end();
-    } else {
-        ili9225_write_pixels_chunk(pixels_buffer, LCD_WIDTH);
+    /* Unchanged since it was last sent: leave the buffer for the next line. */
+    uint32_t hash = lcd_line_hash(lcd_generation, (const uint32_t *) pixels_buffer, words);
+    if (!lcd_line_changed(&lcd_line_sent[line], hash)) {
+        lcd_line_hits++;
+        return;
     }
+    lcd_line_misses++;
+    lcd_bytes_sent += width * sizeof(uint16_t) * (width == LCD_WIDTH ? 1 : scaler.y_count[line]);
 
+    if (width == LCD_WIDTH) {
+        ili9225_line_submit(LCD_Y_OFFSET + line, LCD_WIDTH);
+        return;
+    }
+
+    /* Scaled: repeat the line on as many output rows as the schedule says.
+     * The submitted buffer stays untouched until the DMA has sent it. */
+    uint8_t y = scaler.y_first[line];
+    ili9225_line_submit(y, width);
+    for (unsigned int i = 1; i < scaler.y_count[line]; i++) {
+        uint16_t *repeat = ili9225_line_acquire();
+        memcpy(repeat, pixels_buffer, width * sizeof(uint16_t));
+        ili9225_line_submit(++y, width);
+    }
 }
 #endif
 
@@ -360,58 +1019,201 @@ finish:
 }
 
 /**
- * Load a .gb rom file in flash from the SD card
+ * Erase and program job of the ROM loader. With sound enabled core1 is idle
+ * in the file selector, so it runs the job while core0 reads the next chunk
+ * from the SD card. Everything runs from RAM (copy_to_ram), so neither core
+ * touches the flash while it is being written.
  */
-void load_cart_rom_file(char *filename) {
-    UINT br;
-    uint8_t buffer[FLASH_SECTOR_SIZE];
-    bool mismatch=false;
+static struct {
+    uint32_t erase_offset;
+    uint32_t erase_len;
+    uint32_t offset;
+    const uint8_t *data;
+    uint32_t length;
+} flash_job;
+
+static void flash_job_run(void)
+{
+    if(flash_job.erase_len != 0)
+        flash_range_erase(flash_job.erase_offset, flash_job.erase_len);
+    flash_range_program(flash_job.offset, flash_job.data, flash_job.length);
+}
+
+static uint32_t rom_flash_sd_read(void *ctx, uint8_t *buf, uint32_t len)
+{
+    UINT br = 0;
+    FRESULT fr = f_read((FIL *) ctx, buf, len, &br);
+    if(fr != FR_OK) {
+        DBG_INFO("E f_read error: %s (%d)\n", FRESULT_str(fr), fr);
+        return 0;
+    }
+    return br;
+}
+
+static void rom_flash_program_start(void *ctx, uint32_t erase_offset,
+        uint32_t erase_len, uint32_t offset, const uint8_t *buf, uint32_t len)
+{
+    (void) ctx;
+    flash_job.erase_offset = erase_offset;
+    flash_job.erase_len = erase_len;
+    flash_job.offset = offset;
+    flash_job.data = buf;
+    flash_job.length = len;
+#if ENABLE_SOUND
+    multicore_fifo_push_blocking_inline(AUDIO_CMD_FLASH);
+#else
+    flash_job_run();
+#endif
+}
+
+static void rom_flash_program_wait(void *ctx)
+{
+    (void) ctx;
+#if ENABLE_SOUND
+    multicore_fifo_pop_blocking_inline();
+#endif
+}
+
+static void rom_flash_progress(void *ctx, uint32_t done, uint32_t size)
+{
+    (void) ctx;
+    ili9225_fill_rect(30, 100, size ? 160 * done / size : 160, 4, 0xFFFF);
+}
+
+/**
+ * Writes slots to the index sector if they differ from it, erasing the
+ * sector only if programming alone cannot turn it into them.
+ */
+static void write_rom_index(const rom_slots_t *slots)
+{
+    if(memcmp(slots, rom_index, sizeof(*slots)) == 0)
+        return;
+    if(!rom_slots_programmable(rom_index, slots))
+        flash_range_erase(FLASH_INDEX_OFFSET, FLASH_SECTOR_SIZE);
+    flash_range_program(FLASH_INDEX_OFFSET, (const uint8_t *) slots, sizeof(*slots));
+}
+
+/**
+ * Point rom at the most recently played image, if there is one.
+ */
+void select_last_cart_rom(void) {
+    int latest = rom_slots_latest(rom_index);
+    if(latest >= 0) {
+        rom = (const uint8_t *) (XIP_BASE + rom_index->entry[latest].offset);
+        rom_size = rom_index->entry[latest].size;
+    }
+}
+
+/**
+ * Load a .gb rom file in flash from the SD card, unless it is already in
+ * one of the slots, and point rom at it. Returns true if the flash matches
+ * the file.
+ */
+bool load_cart_rom_file(char *filename) {
+    uint32_t copied = 0;
+    bool ok = false;
+    uint8_t *buffer[2] = {
+        malloc(ROM_FLASH_CHUNK),
+        malloc(ROM_FLASH_CHUNK)
+    };
+    rom_slots_t *slots = malloc(sizeof(rom_slots_t));
     sd_card_t *pSD=sd_get_by_num(0);
     FRESULT fr=f_mount(&pSD->fatfs,pSD->pcName,1);
     if (FR_OK!=fr) {
         DBG_INFO("E f_mount error: %s (%d)\n",FRESULT_str(fr),fr);
-        return;
+        goto out;
+    }
+    if(buffer[0] == NULL || buffer[1] == NULL || slots == NULL) {
+        DBG_INFO("E load_cart_rom_file: out of memory\n");
+        goto unmount;
     }
     FIL fil;
     fr=f_open(&fil,filename,FA_READ);
     if (fr==FR_OK) {
-        uint32_t flash_target_offset=FLASH_TARGET_OFFSET;
-        for(;;) {
-            f_read(&fil,buffer,sizeof buffer,&br);
-            if(br==0) break; /* end of file */
-
-            DBG_INFO("I Erasing target region...\n");
-            flash_range_erase(flash_target_offset,FLASH_SECTOR_SIZE);
-            DBG_INFO("I Programming target region...\n");
-            flash_range_program(flash_target_offset,buffer,FLASH_SECTOR_SIZE);
-
-            /* Read back target region and check programming */
-            DBG_INFO("I Done. Reading back target region...\n");
-            for(uint32_t i=0;i<FLASH_SECTOR_SIZE;i++) {
-                if(rom[flash_target_offset+i]!=buffer[i]) {
-                    mismatch=true;
-                }
+        const rom_flash_ops_t ops = {
+            .read = rom_flash_sd_read,
+            .program_start = rom_flash_program_start,
+            .program_wait = rom_flash_program_wait,
+            .progress = rom_flash_progress,
+            .ctx = &fil
+        };
+        uint32_t size = f_size(&fil);
+        uint32_t crc;
+        uint32_t offset;
+        UINT br;
+
+        /* Skip programming if this ROM is already in flash and intact. */
+        memcpy(slots, rom_index, sizeof(*slots));
+        memset(buffer[0], 0, ROM_META_HEADER_LENGTH);
+        f_read(&fil, buffer[0], ROM_META_HEADER_LENGTH, &br);
+        int slot = rom_slots_find(slots, filename, size, buffer[0]);
+        if(slot >= 0) {
+            const uint8_t *image = (const uint8_t *) (XIP_BASE + slots->entry[slot].offset);
+            if(rom_flash_crc32(0, image, size) == slots->entry[slot].crc32) {
+                DBG_INFO("I %s already in flash at %08lx\n", filename, slots->entry[slot].offset);
+                if(rom_slots_touch(slots, slot))
+                    write_rom_index(slots);
+                rom = image;
+                rom_size = size;
+                copied = size;
+                ok = true;
+                goto close;
             }
-
-            /* Next sector */
-            flash_target_offset+=FLASH_SECTOR_SIZE;
+            /* The image is damaged, free its slot for the new copy. Left
+             * valid, the record would keep the space and be found first
+             * again next time. */
+            DBG_INFO("E %s in flash is damaged, reloading\n", filename);
+            slots->entry[slot].magic = 0;
+        }
+        f_lseek(&fil, 0);
+
+        /* Records of the images about to be overwritten are dropped
+         * first, an interrupted load leaves none behind. */
+        slot = rom_slots_alloc(slots, FLASH_TARGET_OFFSET, FLASH_TARGET_END, size, &offset);
+        if(slot < 0) {
+            DBG_INFO("E %s does not fit in flash (%lu bytes)\n", filename, size);
+            goto close;
         }
-        if(mismatch) {
-            DBG_INFO("I Programming successful!\n");
+        write_rom_index(slots);
+        rom = (const uint8_t *) (XIP_BASE + offset);
+        rom_size = size;
+
+        DBG_INFO("I Programming %lu bytes at %08lx...\n", size, offset);
+        copied = rom_flash_copy(&ops, offset, size, buffer, &crc);
+
+        /* Read back target region and check programming */
+        DBG_INFO("I Done. Verifying target region...\n");
+        ok = copied == size && rom_flash_crc32(0, rom, copied) == crc;
+        if(ok) {
+            DBG_INFO("I Programming successful! CRC32 %08lx\n", crc);
+            /* The header is the start of the image now in flash. */
+            rom_meta_init(&slots->entry[slot], filename, size, rom, crc, offset);
+            rom_slots_touch(slots, slot);
+            write_rom_index(slots);
         } else {
             DBG_INFO("E Programming failed!\n");
+            /* Back to an intact image, if any is left. */
+            select_last_cart_rom();
         }
     } else {
         DBG_INFO("E f_open(%s) error: %s (%d)\n",filename,FRESULT_str(fr),fr);
+        goto unmount;
     }
 
+close:
     fr=f_close(&fil);
     if(fr!=FR_OK) {
         DBG_INFO("E f_close error: %s (%d)\n", FRESULT_str(fr), fr);
     }
+unmount:
     f_unmount(pSD->pcName);
+out:
+    free(buffer[0]);
+    free(buffer[1]);
+    free(slots);
 
-    DBG_INFO("I load_cart_rom_file(%s) COMPLETE (%lu bytes)\n",filename,br);
+    DBG_INFO("I load_cart_rom_file(%s) COMPLETE (%lu bytes)\n",filename,copied);
+    return ok;
 }
 
 /**
@@ -498,14 +1300,21 @@ void rom_file_selector() {
         start=gpio_get(GPIO_START);
         if(!start) {
             /* re-start the last game (no need to reprogram flash) */
+            select_last_cart_rom();
             break;
         }
         if(!a | !b) {
             /* copy the rom from the SD card to flash and start the game */
             ili9225_fill(0x0000);
             ili9225_text("Loading game", 55, 80, 0xFFFF, 0x0000);
-            load_cart_rom_file(filename[selected]);
-            break;
+            if(load_cart_rom_file(filename[selected]))
+                break;
+            /* Nothing usable in flash, let the user pick again. */
+            ili9225_text("Loading failed", 47, 80, 0xF800, 0x0000);
+            sleep_ms(2000);
+            num_file=rom_file_selector_display_page(filename,num_page);
+            if(selected>=num_file) selected=0;
+            ili9225_text(filename[selected],0,selected*8,0xFFFF,0xF800);
         }
         if(!down) {
             /* select the next rom */
@@ -553,24 +1362,114 @@ void rom_file_selector() {
     }
 }
 
+/**
+ * Read the per game settings from the SD card. Missing, short or foreign
+ * files reset the settings to the defaults.
+ */
+void read_game_settings(struct gb_s *gb) {
+    char filename[16];
+    char filename_settings[32];
+    UINT br = 0;
+    FIL fil;
+
+    /* A game without a settings file must not keep the previous game's. */
+    game_settings = game_settings_default;
+
+    sd_card_t *sd = sd_get_by_num(0);
+    FRESULT fr = f_mount(&sd->fatfs, sd->pcName, 1);
+
+    gb_get_rom_name(gb, filename);
+    sprintf(filename_settings, "%s_settings.bin", filename);
+    fr = f_open(&fil, filename_settings, FA_READ);
+
+    if(fr == FR_OK) {
+        struct game_settings_s loaded;
+        f_read(&fil, &loaded, sizeof(loaded), &br);
+        if(br == sizeof(loaded) && loaded.magic == GAME_SETTINGS_MAGIC
+                && loaded.scaler_mode < SCALER_MODE_COUNT
+                && loaded.audio_quality < AUDIO_QUALITY_COUNT) {
+            game_settings = loaded;
+        }
+    } else {
+        DBG_INFO("W read_game_settings(%s): SKIPPED (no settings)\n", filename_settings);
+        goto finish;
+    }
+
+    DBG_INFO("I read_game_settings(%s) COMPLETED (%lu bytes)\n", filename_settings, br);
+
+finish:
+    fr = f_close(&fil);
+    if(fr != FR_OK) {
+        DBG_INFO("W f_close error: %s (%d)\n", FRESULT_str(fr), fr);
+    }
+
+    f_unmount(sd->pcName);
+}
+
+/**
+ * Write the per game settings to the SD card.
+ */
+void write_game_settings(struct gb_s *gb) {
+    char filename[16];
+    char filename_settings[32];
+    UINT bw;
+    FIL fil;
+
+    sd_card_t *sd = sd_get_by_num(0);
+    FRESULT fr = f_mount(&sd->fatfs, sd->pcName, 1);
+
+    gb_get_rom_name(gb, filename);
+    sprintf(filename_settings, "%s_settings.bin", filename);
+    fr = f_open(&fil, filename_settings, FA_CREATE_ALWAYS | FA_WRITE);
+
+    if(fr == FR_OK) {
+        f_write(&fil, &game_settings, sizeof(game_settings), &bw);
+    } else {
+        DBG_INFO("E write_game_settings(%s) FAILED (%s)\n", filename_settings, FRESULT_str(fr));
+        goto finish;
+    }
+
+    DBG_INFO("I write_game_settings(%s) COMPLETED (%lu bytes)\n", filename_settings, bw);
+
+finish:
+    fr = f_close(&fil);
+    if(fr != FR_OK) {
+        DBG_INFO("E f_close error: %s (%d)\n", FRESULT_str(fr), fr);
+    }
+    f_unmount(sd->pcName);
+}
 #endif
 
 #if ENABLE_SOUND
 void core1_audio(void) {
-    /* Allocate memory for the stream buffer */
-    stream = malloc(AUDIO_SAMPLES_TOTAL * sizeof(int16_t));
-    assert(stream != NULL);
-    memset(stream, 0, AUDIO_SAMPLES_TOTAL * sizeof(int16_t));
-
     /* Initialize I2S sound driver (using PIO0) */
-    i2s_config_t i2s_config = i2s_get_default_config();
-    i2s_config.sample_freq = AUDIO_SAMPLE_RATE;
-    i2s_config.dma_trans_count = AUDIO_SAMPLES;
-    i2s_volume(&i2s_config, 4);
+    i2s_config = i2s_get_default_config();
+    i2s_config.sample_freq = AUDIO_OUTPUT_RATE;
+    i2s_config.dma_trans_count = AUDIO_PERIOD_SAMPLES;
+    i2s_config.dma_buf_count = 2 * AUDIO_PERIODS_PER_FRAME;
+    i2s_volume(&i2s_config, 20);    // -24 dB
     i2s_init(&i2s_config);
 
     /* Initialize audio emulation. */
     audio_init(&apu_ctx);
+    apu_catchup_init(&apu_model, apu_shadow);
+    apu_naive_init(&apu_naive, false);
+#if ENABLE_AUDIO_FILTER
+    audio_filter_init(&audio_filter, AUDIO_FILTER_HP_DMG, AUDIO_FILTER_LP_DEFAULT);
+#endif
+#if AUDIO_RESAMPLE
+    /* Allocate memory for the APU output of one frame */
+    apu_stream = malloc(AUDIO_SAMPLES_TOTAL * sizeof(int16_t));
+    assert(apu_stream != NULL);
+    /* minigb_apu renders AUDIO_SAMPLES per frame, a little short of
+     * AUDIO_SAMPLE_RATE at the frame rate. */
+    resampler_nominal_step = (uint32_t) (AUDIO_SAMPLES * DMG_CLOCK_FREQ /
+        SCREEN_REFRESH_CYCLES * RESAMPLER_ONE / AUDIO_OUTPUT_RATE);
+    resampler_init(&resampler, resampler_nominal_step, i2s_gain(&i2s_config));
+#if ENABLE_AUDIO_FILTER
+    resampler.filter = &audio_filter;
+#endif
+#endif
 
     DBG_INFO("I Audio ready on core1.\n");
 
@@ -578,16 +1477,43 @@ void core1_audio(void) {
         audio_commands_e cmd = multicore_fifo_pop_blocking_inline();
         switch(cmd) {
         case AUDIO_CMD_PLAYBACK:
-            audio_callback(&apu_ctx, stream);
-            i2s_dma_write(&i2s_config, stream);
+            audio_play_frame();
             break;
 
+        case AUDIO_CMD_SKIP:
+            /* Fast-forward: only the model advances, unless the output
+             * is running short of audio. */
+#if ENABLE_AUDIO_FAST_FORWARD
+            if(audio_queued() < i2s_config.dma_trans_count * AUDIO_PERIODS_PER_FRAME / 2) {
+                audio_play_frame();
+                break;
+            }
+#endif
+            apu_replay_frame(NULL);
+            apu_ctx_behind = true;
+            apu_status = apu_catchup_status(&apu_model);
+            break;
+
+#if ENABLE_SDCARD
+        case AUDIO_CMD_FLASH:
+            /* ROM loader: program a chunk while core0 reads the next. */
+            flash_job_run();
+            multicore_fifo_push_blocking_inline(AUDIO_CMD_FLASH);
+            break;
+#endif
+
         case AUDIO_CMD_VOLUME_UP:
             i2s_increase_volume(&i2s_config);
+#if AUDIO_RESAMPLE
+            resampler_set_gain(i2s_gain(&i2s_config));
+#endif
             break;
 
         case AUDIO_CMD_VOLUME_DOWN:
             i2s_decrease_volume(&i2s_config);
+#if AUDIO_RESAMPLE
+            resampler_set_gain(i2s_gain(&i2s_config));
+#endif
             break;
 
         default:
@@ -667,6 +1593,12 @@ int main(void)
 
 #if ENABLE_LCD
     ili9225_init();
+    scaler_init();
+#endif
+
+#if ENABLE_FRAME_PACING
+    frame_alarm = hardware_alarm_claim_unused(true);
+    hardware_alarm_set_callback(frame_alarm, frame_alarm_callback);
 #endif
 
 while(true) {
@@ -681,6 +1613,10 @@ while(true) {
 
     /* Initialise GB context. */
     memcpy(rom_bank0, rom, sizeof(rom_bank0));
+#if ENABLE_ROM_CACHE
+    rom_cache_init(&rom_cache, rom,
+        (rom_size + ROM_CACHE_BANK_SIZE - 1) / ROM_CACHE_BANK_SIZE, rom_bank0);
+#endif
     ret = gb_init(&gb, &gb_rom_read, &gb_cart_ram_read,
               &gb_cart_ram_write, &gb_error, NULL);
     DBG_INFO("GB ");
@@ -699,18 +1635,19 @@ while(true) {
     /* Automatically assign a colour palette to the game */
     char rom_title[16];
     auto_assign_palette(palette, gb_colour_hash(&gb),gb_get_rom_name(&gb,rom_title));
+    update_palette();
 
 #if ENABLE_LCD
     gb_init_lcd(&gb, &lcd_draw_line);
-    ili9225_fill(0x0000);
-    ili9225_set_window(
-        (ILI9225_SCREEN_WIDTH - LCD_WIDTH) / 2,
-        LCD_WIDTH,
-        (ILI9225_SCREEN_HEIGHT - LCD_HEIGHT) / 2,
-        LCD_HEIGHT
-    );
+#if ENABLE_SDCARD
+    read_game_settings(&gb);
+#endif
+    lcd_apply_mode(&gb);
     DBG_INFO("LCD ");
 #endif
+#if ENABLE_SOUND
+    audio_quality = game_settings.audio_quality;
+#endif
 
 #if ENABLE_SDCARD
     /* Load Save File. */
@@ -720,19 +1657,72 @@ while(true) {
     DBG_INFO("\n> ");
     uint_fast32_t frames = 0;
     uint64_t start_time = time_us_64();
+#if ENABLE_LCD && ENABLE_AUTO_FRAME_SKIP
+    frame_skip_state_t frame_skip = {0};
+    uint_fast32_t frames_skipped = 0;
+#endif
+#if ENABLE_DEBUG && ENABLE_SOUND
+    uint8_t latency_joypad = 0xFF;
+    uint32_t latency_key_us = 0;
+#endif
+#if ENABLE_FRAME_PACING
+    frame_pacer_t pacer;
+    frame_speed = 1;
+    frame_pacer_init(&pacer, (uint32_t) DMG_CLOCK_FREQ_REDUCED,
+        (uint32_t) SCREEN_REFRESH_CYCLES_REDUCED, time_us_64());
+#endif
     while(1)
     {
         int input;
 
+#if ENABLE_FRAME_PACING
+        frame_wait_until(frame_pacer_next(&pacer, time_us_64(), frame_speed));
+#endif
+#if ENABLE_DEBUG && ENABLE_SOUND
+        /* Buttons are active low, stamp the first frame to see a press. */
+        if(audio_latency_probe && (latency_joypad & ~gb.direct.joypad) &&
+                latency_key_us == 0)
+            latency_key_us = time_us_32() | 1;
+        latency_joypad = gb.direct.joypad;
+#endif
+
         /* Execute CPU cycles until the screen has to be redrawn. */
+#if ENABLE_LCD && ENABLE_AUTO_FRAME_SKIP
+        uint64_t frame_start = time_us_64();
+        uint32_t lines_drawn = lcd_lines_drawn;
+#endif
         gb_run_frame(&gb);
 
         frames++;
+#if ENABLE_ROM_CACHE
+        rom_cache_update(&rom_cache, gb.selected_rom_bank);
+#endif
+#if ENABLE_LCD && ENABLE_AUTO_FRAME_SKIP
+        /* Lines are drawn from within gb_run_frame(), so its duration
+         * includes converting and queueing them to the LCD. */
+        bool drawn = lcd_lines_drawn != lines_drawn;
+        frame_skip = frame_skip_update(frame_skip,
+            (uint32_t) (time_us_64() - frame_start), drawn, FRAME_PERIOD_US);
+        gb.direct.frame_skip = frame_speed != 1 || frame_skip.skipping;
+        if(!drawn)
+            frames_skipped++;
+#endif
 #if ENABLE_SOUND
-        if(!gb.direct.frame_skip) {
-            multicore_fifo_push_blocking_inline(AUDIO_CMD_PLAYBACK);
+        /* Frames skipped by the controller are still emulated in full and
+         * their sound is played, fast-forward frames are left to core1 to
+         * catch up with or drop. */
+        apu_queue_end_frame(&apu_queue);
+        apu_triggered = 0;
+#if ENABLE_DEBUG
+        /* Hand the stamp over with the frame that saw the press. */
+        if(latency_key_us != 0 && audio_latency_key_us == 0 && frame_speed == 1) {
+            audio_latency_key_us = latency_key_us;
+            latency_key_us = 0;
         }
 #endif
+        multicore_fifo_push_blocking_inline(frame_speed == 1 ?
+            AUDIO_CMD_PLAYBACK : AUDIO_CMD_SKIP);
+#endif
 
         /* Update buttons state */
         prev_joypad_bits.up=gb.direct.joypad_bits.up;
@@ -769,6 +1759,7 @@ while(true) {
                 if(manual_palette_selected<12) {
                     manual_palette_selected++;
                     manual_assign_palette(palette,manual_palette_selected);
+                    update_palette();
                 }
             }
             if(!gb.direct.joypad_bits.left && prev_joypad_bits.left) {
@@ -776,6 +1767,7 @@ while(true) {
                 if(manual_palette_selected>0) {
                     manual_palette_selected--;
                     manual_assign_palette(palette,manual_palette_selected);
+                    update_palette();
                 }
             }
             if(!gb.direct.joypad_bits.start && prev_joypad_bits.start) {
@@ -784,14 +1776,26 @@ while(true) {
                 write_cart_ram_file(&gb);
                 /* Try to save the emulator state for this game. */
                 write_gb_emulator_state(&gb);
+                write_game_settings(&gb);
 #endif
                 goto out;
             }
             if(!gb.direct.joypad_bits.a && prev_joypad_bits.a) {
-                /* select + A: enable/disable frame-skip => fast-forward */
-                gb.direct.frame_skip=!gb.direct.frame_skip;
-                DBG_INFO("I gb.direct.frame_skip = %d\n",gb.direct.frame_skip);
+                /* select + A: fast-forward 2x, 4x, uncapped and back to normal speed */
+                next_frame_speed(&gb);
+            }
+#if ENABLE_LCD
+            if(!gb.direct.joypad_bits.b && prev_joypad_bits.b) {
+                /* select + B: next display mode, each scaler mode first
+                 * progressive and then interlaced */
+                game_settings.interlace = !game_settings.interlace;
+                if(!game_settings.interlace)
+                    game_settings.scaler_mode = (game_settings.scaler_mode + 1) % SCALER_MODE_COUNT;
+                lcd_apply_mode(&gb);
+                DBG_INFO("I scaler_mode = %d, interlace = %d\n",
+                    game_settings.scaler_mode, game_settings.interlace);
             }
+#endif
         }
 
 #if ENABLE_DEBUG
@@ -821,13 +1825,42 @@ while(true) {
             break;
 #endif
         case 'i':
-            gb.direct.interlace = !gb.direct.interlace;
+            game_settings.interlace = !game_settings.interlace;
+            gb.direct.interlace = game_settings.interlace;
             break;
 
         case 'f':
-            gb.direct.frame_skip = !gb.direct.frame_skip;
+            next_frame_speed(&gb);
+            break;
+
+        case 'p':
+            lcd_pixel_format = (lcd_pixel_format == ILI9225_PIXEL_RGB565) ?
+                ILI9225_PIXEL_INDEXED4 : ILI9225_PIXEL_RGB565;
+            lcd_apply_mode(&gb);
+            break;
+
+        case 's':
+            game_settings.scaler_mode = (game_settings.scaler_mode + 1) % SCALER_MODE_COUNT;
+            lcd_apply_mode(&gb);
+            DBG_INFO("Scaler mode %d\n", game_settings.scaler_mode);
             break;
 
+#if ENABLE_SOUND
+        case 'l':
+            audio_latency_probe = !audio_latency_probe;
+            audio_latency_max_us = 0;
+            audio_latency_sum_us = 0;
+            audio_latency_count = 0;
+            DBG_INFO("Latency probe %s\n", audio_latency_probe ? "on" : "off");
+            break;
+
+        case 'a':
+            game_settings.audio_quality = (game_settings.audio_quality + 1) % AUDIO_QUALITY_COUNT;
+            audio_quality = game_settings.audio_quality;
+            DBG_INFO("Audio quality %d\n", game_settings.audio_quality);
+            break;
+#endif
+
         case 'b':
         {
             uint64_t end_time;
@@ -841,6 +1874,80 @@ while(true) {
                 "Time: %lu us\n"
                 "FPS: %lu\n",
                 frames, diff, fps);
+#if ENABLE_LCD
+            uint32_t lcd_stalls, lcd_stall_us;
+            ili9225_line_stats(&lcd_stalls, &lcd_stall_us);
+            DBG_INFO("LCD stalls: %lu (%lu us)\n",
+                lcd_stalls, lcd_stall_us);
+            DBG_INFO("LCD lines sent: %lu, skipped: %lu, %lu bytes/frame\n",
+                lcd_line_misses, lcd_line_hits,
+                frames ? lcd_bytes_sent / frames : 0);
+            lcd_line_hits = 0;
+            lcd_line_misses = 0;
+            lcd_bytes_sent = 0;
+#endif
+#if ENABLE_SOUND
+            DBG_INFO("Audio underruns: %lu, queued: %lu samples\n",
+                i2s_config.underruns, i2s_dma_fill(&i2s_config));
+            {
+                uint32_t audio_frames = audio_stats.frames;
+                uint32_t fill_min = audio_stats.fill_min;
+                DBG_INFO("Audio synth: %lu us/frame, max %lu us, blocked waits: %lu\n",
+                    audio_frames ? audio_stats.synth_us / audio_frames : 0,
+                    audio_stats.synth_max_us, i2s_config.waits);
+                DBG_INFO("Audio slack: min %lu us, periods queued:",
+                    fill_min == UINT32_MAX ? 0 :
+                        (uint32_t) ((uint64_t) fill_min * 1000000u / AUDIO_OUTPUT_RATE));
+                for(unsigned int i = 0; i < AUDIO_FILL_BINS; i++)
+                    DBG_INFO(" %lu", audio_stats.fill_hist[i]);
+                DBG_INFO("\n");
+                audio_stats.reset = true;
+            }
+#if ENABLE_AUDIO_DRC
+            DBG_INFO("Audio rate: %ld ppm\n",
+                (int32_t) ((int64_t) ((int32_t) resampler.step - (int32_t) resampler_nominal_step)
+                    * 1000000 / resampler_nominal_step));
+#endif
+            DBG_INFO("APU writes queued: %lu, dropped: %lu, frame ends delayed: %lu\n",
+                apu_queue_level(&apu_queue), apu_queue.overflows, apu_queue.end_waits);
+            if(audio_latency_probe) {
+                uint32_t count = audio_latency_count;
+                DBG_INFO("Key to speaker: %lu us, avg %lu us, max %lu us (%lu presses)\n",
+                    audio_latency_last_us,
+                    count ? audio_latency_sum_us / count : 0,
+                    audio_latency_max_us, count);
+            }
+#endif
+#if ENABLE_ROM_CACHE
+            {
+                uint32_t samples = rom_cache.hits + rom_cache.misses;
+                DBG_INFO("ROM cache: bank in SRAM %lu%% of %lu samples, %lu promotions, banks:",
+                    samples ? (uint32_t) ((uint64_t) rom_cache.hits * 100 / samples) : 0,
+                    samples, rom_cache.promotions);
+                for(unsigned int f = 0; f < ROM_CACHE_FRAMES; f++)
+                    DBG_INFO(" %u", rom_cache.frame_bank[f]);
+                DBG_INFO("\n");
+                rom_cache.hits = 0;
+                rom_cache.misses = 0;
+                rom_cache.promotions = 0;
+            }
+#endif
+#if ENABLE_FRAME_PACING
+            DBG_INFO("Speed: %u, slack: %lu us/frame, resyncs: %lu\n",
+                frame_speed, frames ? (uint32_t) (frame_slack_us / frames) : 0,
+                pacer.resyncs);
+            frame_slack_us = 0;
+            pacer.resyncs = 0;
+#endif
+#if ENABLE_LCD && ENABLE_AUTO_FRAME_SKIP
+            DBG_INFO("Frame skip: %s, skipped %lu, drawn %lu us, "
+                "skipped %lu us, budget %lu us\n",
+                frame_skip.skipping ? "on" : "off", frames_skipped,
+                frame_skip.drawn_avg >> FRAME_SKIP_AVG_SHIFT,
+                frame_skip.skipped_avg >> FRAME_SKIP_AVG_SHIFT,
+                FRAME_PERIOD_US);
+            frames_skipped = 0;
+#endif
             stdio_flush();
             frames = 0;
             start_time = time_us_64();
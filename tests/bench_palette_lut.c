@@ -0,0 +1,101 @@
+/**
+ * Copyright (C) 2024 by Vlastimil Slintak <slintak@uart.cz>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+ * THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/**
+ * Times the flat palette LUT kernel against the per-pixel 3x4 palette
+ * lookup it replaced, on the same frames, and checks both give the same
+ * RGB565 pixels. The frames are synthetic: bytes as Peanut-GB writes them,
+ * with the palette selector in bits 4-5 and the shade in bits 0-1.
+ */
+
+#include <string.h>
+
+#include "test.h"
+#include "gbcolors.h"
+#include "lcd_line.h"
+
+#define WIDTH   160
+#define HEIGHT  144
+#define FRAMES  64
+#define ROUNDS  20
+
+static uint8_t frames[FRAMES][HEIGHT][WIDTH];
+static uint16_t __attribute__((aligned(4))) out_ref[WIDTH];
+static uint16_t __attribute__((aligned(4))) out_lut[WIDTH];
+
+/* The loop lcd_draw_line() used before the LUT. */
+static void line_palette(const palette_t palette, const uint8_t *pixels,
+        uint16_t *out)
+{
+    for(unsigned int x = 0; x < WIDTH; x++)
+        out[x] = palette[(pixels[x] & 0x30) >> 4][pixels[x] & 3];
+}
+
+int main(void)
+{
+    palette_t palette;
+    palette_lut_t lut;
+    uint32_t seed = 2;
+    volatile uint16_t sink = 0;
+
+    get_colour_palette(palette, 0x1C, 0x03);
+    build_palette_lut(palette, lut);
+
+    /* Runs of background with sprites of the other two palettes. */
+    for(int f = 0; f < FRAMES; f++)
+        for(int y = 0; y < HEIGHT; y++)
+            for(int x = 0; x < WIDTH; x++)
+            {
+                uint32_t r = test_rand(&seed);
+                uint8_t selector = (r & 0x700) ? 0x20 : (r & 0x10);
+                frames[f][y][x] = selector | (r & 3);
+            }
+
+    for(int f = 0; f < FRAMES; f++)
+        for(int y = 0; y < HEIGHT; y++)
+        {
+            line_palette(palette, frames[f][y], out_ref);
+            lcd_line_rgb565(lut, frames[f][y], out_lut, WIDTH);
+            CHECK(memcmp(out_ref, out_lut, sizeof(out_ref)) == 0);
+        }
+
+    uint64_t start = test_now_ns();
+    for(int r = 0; r < ROUNDS; r++)
+        for(int f = 0; f < FRAMES; f++)
+            for(int y = 0; y < HEIGHT; y++)
+            {
+                line_palette(palette, frames[f][y], out_ref);
+                sink += out_ref[y];
+            }
+    uint64_t palette_ns = test_now_ns() - start;
+
+    start = test_now_ns();
+    for(int r = 0; r < ROUNDS; r++)
+        for(int f = 0; f < FRAMES; f++)
+            for(int y = 0; y < HEIGHT; y++)
+            {
+                lcd_line_rgb565(lut, frames[f][y], out_lut, WIDTH);
+                sink += out_lut[y];
+            }
+    uint64_t lut_ns = test_now_ns() - start;
+
+    unsigned int lines = ROUNDS * FRAMES * HEIGHT;
+    printf("palette[3][4]: %.1f ns/line\n", (double) palette_ns / lines);
+    printf("flat LUT:      %.1f ns/line\n", (double) lut_ns / lines);
+    (void) sink;
+
+    return TEST_EXIT();
+}
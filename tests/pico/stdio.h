@@ -0,0 +1,2 @@
+/* Host stand-in for the Pico SDK header included by debug.h. */
+#pragma once
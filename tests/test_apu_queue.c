@@ -0,0 +1,164 @@
+/**
+ * Copyright (C) 2024 by Vlastimil Slintak <slintak@uart.cz>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+ * THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/**
+ * The APU write queue between two threads, standing in for the two cores.
+ *
+ * The producer pushes frames of register writes stamped as the emulation
+ * core stamps them, the consumer pops and sometimes stalls, so the queue
+ * runs both empty and full. Every record must arrive once and in order,
+ * except writes refused on a full queue, which must be counted. No end of
+ * frame record may be lost, even when the queue is full for several frames
+ * in a row. The stamps of each frame must also only go forward.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+
+#define APU_QUEUE_LENGTH 64u
+#include "test.h"
+#include "apu_queue.h"
+
+#define FRAMES  20000u
+#define RECORDS (FRAMES * 40u)
+
+static apu_queue_t queue;
+static uint32_t pushed[RECORDS];
+static uint32_t popped[RECORDS];
+static uint32_t pushed_count, popped_count, refused;
+static volatile bool producer_done;
+
+/* Writes at random lines of a frame, in the order gb_run_frame() runs
+ * them: VBlank lines 144-153 first, then 0-143. */
+static void *producer(void *arg)
+{
+    uint32_t seed = 12;
+    uint32_t seq = 0;
+    (void) arg;
+
+    for(uint32_t f = 0; f < FRAMES; f++)
+    {
+        uint32_t writes = test_rand(&seed) % 30;
+        uint32_t line = 144 + test_rand(&seed) % 10;
+        uint32_t lcd_count = 0;
+        for(uint32_t w = 0; w < writes; w++)
+        {
+            lcd_count += test_rand(&seed) % (456 - lcd_count);
+            uint32_t cycle = APU_QUEUE_FRAME_CYCLE(line % 154, lcd_count);
+            /* The register carries a sequence number to spot losses. */
+            uint32_t record = APU_QUEUE_RECORD(cycle,
+                    APU_QUEUE_REG_BASE + seq++ % 0x30, w);
+            if(apu_queue_push(&queue, record, 1))
+                pushed[pushed_count++] = record;
+            else
+                refused++;
+            uint32_t next = line + test_rand(&seed) % 8;
+            if(next >= 144 + 154)
+                next = 144 + 153;
+            if(next != line)
+                lcd_count = 0;
+            line = next;
+        }
+        apu_queue_end_frame(&queue);
+        pushed[pushed_count++] = APU_QUEUE_END_FRAME;
+        /* Paced like the emulation loop most of the time, bursts of
+         * unpaced frames like fast-forward now and then. */
+        if(f % 256 < 224)
+            while(apu_queue_level(&queue) > APU_QUEUE_LENGTH / 2)
+                sched_yield();
+    }
+    __atomic_store_n(&producer_done, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static void *consumer(void *arg)
+{
+    uint32_t seed = 13;
+    uint32_t record;
+    (void) arg;
+
+    for(;;)
+    {
+        if(apu_queue_pop(&queue, &record))
+        {
+            popped[popped_count++] = record;
+            continue;
+        }
+        if(__atomic_load_n(&producer_done, __ATOMIC_ACQUIRE) &&
+                apu_queue_level(&queue) == 0)
+            break;
+        if(test_rand(&seed) % 4 == 0)
+            sched_yield();
+    }
+    return NULL;
+}
+
+int main(void)
+{
+    /* Stamps follow the order lines are run in and fit the frame. */
+    uint32_t prev = 0;
+    for(uint32_t i = 0; i < 154; i++)
+    {
+        uint32_t ly = (144 + i) % 154;
+        for(uint32_t c = 0; c < 456; c += 5)
+        {
+            uint32_t cycle = APU_QUEUE_FRAME_CYCLE(ly, c);
+            if(i || c)
+                CHECK(cycle > prev);
+            prev = cycle;
+        }
+    }
+    CHECK_EQ(APU_QUEUE_FRAME_CYCLE(144, 0), 0);
+    CHECK_EQ(APU_QUEUE_FRAME_CYCLE(143, 455), 154 * 456 - 1);
+    CHECK_EQ(APU_QUEUE_CYCLE(APU_QUEUE_RECORD(APU_QUEUE_FRAME_CYCLE(143, 455), 0xFF26, 0x80)),
+            154 * 456 - 1);
+
+    pthread_t p, c;
+    pthread_create(&c, NULL, consumer, NULL);
+    pthread_create(&p, NULL, producer, NULL);
+    pthread_join(p, NULL);
+    pthread_join(c, NULL);
+
+    CHECK_EQ(popped_count, pushed_count);
+    CHECK_EQ(queue.overflows, refused);
+    /* The bursts keep the queue full for frames in a row, which is when
+     * an end record has to wait. */
+    CHECK(queue.end_waits > 0);
+    uint32_t frames = 0;
+    prev = 0;
+    for(uint32_t i = 0; i < popped_count && i < pushed_count; i++)
+    {
+        if(popped[i] != pushed[i])
+        {
+            CHECK_EQ(popped[i], pushed[i]);
+            break;
+        }
+        if(APU_QUEUE_IS_END_FRAME(popped[i]))
+        {
+            frames++;
+            prev = 0;
+            continue;
+        }
+        CHECK(APU_QUEUE_CYCLE(popped[i]) >= prev);
+        prev = APU_QUEUE_CYCLE(popped[i]);
+    }
+    CHECK_EQ(frames, FRAMES);
+    printf("%u records in %u frames, %u writes refused on a full queue, "
+            "%u frame ends waited\n", popped_count, frames, refused, queue.end_waits);
+
+    return TEST_EXIT();
+}
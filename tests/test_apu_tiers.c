@@ -0,0 +1,342 @@
+/**
+ * Copyright (C) 2024 by Vlastimil Slintak <slintak@uart.cz>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+ * THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/**
+ * Error and cost of the audio quality tiers. A square note is rendered by
+ * each tier and compared with what FULL renders for it: NAIVE and LOW are
+ * aligned to FULL over a few milliseconds of lag and scaled and offset by
+ * least squares, so what remains is the difference in waveform, reported
+ * as an SNR against FULL. The noise channel has no such reference; LOW is
+ * checked to sound like NAIVE up to the rate it updates the noise at, and
+ * to toggle at that rate above it.
+ *
+ * FULL is minigb_apu, which is a submodule. When it is not checked out
+ * the comparison is skipped. Either way each tier is also fitted with the
+ * harmonics of the exact note frequency that fit below half the sample
+ * rate, which is what an ideal band-limited synthesiser would output, as
+ * extra information on how much of the error is aliasing.
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include "test.h"
+#include "apu_naive.h"
+#if HAVE_MINIGB_APU
+#include "minigb_apu.h"
+#endif
+
+#define RATE        32768u
+#define SAMPLES     8192u
+/* Skip the start, where FULL's filters settle. */
+#define SKIP        1024u
+#define MAX_TERMS   (2 * 64 + 1)
+/* Largest lag searched when aligning a tier to FULL, 2 ms. */
+#define MAX_LAG     64
+/* Loose bound, the tiers have to follow FULL within half its amplitude. */
+#define MIN_FULL_SNR 6.0
+
+static int16_t out[2 * SAMPLES];
+/* FULL's output for each note, the reference for the other tiers. */
+static int16_t full[4][2 * SAMPLES];
+static double m[MAX_TERMS][MAX_TERMS + 1];
+
+enum { TIER_FULL, TIER_NAIVE, TIER_LOW, TIERS };
+static const char *const tier_name[TIERS] = { "FULL", "NAIVE", "LOW" };
+
+/* NR52 on, full volume to both sides, then the channel setup. */
+static const uint8_t setup[][2] = {
+    { 0x26, 0x80 }, { 0x24, 0x77 }, { 0x25, 0xFF },
+};
+
+static void write_all(unsigned int tier, void *apu, const uint8_t (*w)[2], unsigned int count)
+{
+    for(unsigned int i = 0; i < count; i++)
+    {
+        uint16_t addr = 0xFF00 | w[i][0];
+#if HAVE_MINIGB_APU
+        if(tier == TIER_FULL)
+        {
+            audio_write(apu, addr, w[i][1]);
+            continue;
+        }
+#endif
+        (void) tier;
+        apu_catchup_write(apu, addr, w[i][1]);
+    }
+}
+
+/**
+ * Renders SAMPLES stereo samples of the register writes w with a tier.
+ * Returns false if the tier is not built in.
+ */
+static bool render(unsigned int tier, const uint8_t (*w)[2], unsigned int count)
+{
+    static const uint8_t zero[APU_CATCHUP_REGS];
+
+    if(tier == TIER_FULL)
+    {
+#if HAVE_MINIGB_APU
+        static struct minigb_apu_ctx ctx;
+        /* AUDIO_SAMPLES_TOTAL is not a constant expression. */
+        static int16_t *frame = NULL;
+        if(frame == NULL)
+            frame = malloc(AUDIO_SAMPLES_TOTAL * sizeof(int16_t));
+
+        audio_init(&ctx);
+        write_all(tier, &ctx, setup, sizeof(setup) / sizeof(setup[0]));
+        write_all(tier, &ctx, w, count);
+        for(unsigned int pos = 0; pos < SAMPLES; pos += AUDIO_SAMPLES)
+        {
+            unsigned int n = SAMPLES - pos < AUDIO_SAMPLES ? SAMPLES - pos : AUDIO_SAMPLES;
+            audio_callback(&ctx, frame);
+            memcpy(out + 2 * pos, frame, 2 * n * sizeof(int16_t));
+        }
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    apu_catchup_t model;
+    apu_naive_t naive;
+    apu_catchup_init(&model, zero);
+    apu_naive_init(&naive, tier == TIER_LOW);
+    write_all(tier, &model, setup, sizeof(setup) / sizeof(setup[0]));
+    write_all(tier, &model, w, count);
+    apu_naive_render(&naive, &model, out, SAMPLES);
+    return true;
+}
+
+/* Channel 1 at 50% duty, no envelope, at an 11-bit period. */
+static bool render_note(unsigned int tier, uint16_t period)
+{
+    uint8_t w[][2] = {
+        { 0x11, 0x80 }, { 0x12, 0xF0 }, { 0x13, period & 0xFF },
+        { 0x14, 0x80 | (period >> 8) },
+    };
+    return render(tier, w, 4);
+}
+
+/**
+ * SNR in dB of the left channel against DC plus the harmonics of hz below
+ * RATE / 2.
+ */
+static double square_snr(double hz)
+{
+    unsigned int harmonics = (unsigned int) ((RATE / 2 - 1) / hz);
+    if(harmonics > (MAX_TERMS - 1) / 2)
+        harmonics = (MAX_TERMS - 1) / 2;
+    unsigned int terms = 2 * harmonics + 1;
+    double v[MAX_TERMS];
+
+    memset(m, 0, sizeof(m));
+    for(unsigned int i = SKIP; i < SAMPLES; i++)
+    {
+        double w = 2 * M_PI * hz * i / RATE;
+        double y = out[2 * i];
+        v[0] = 1;
+        for(unsigned int h = 1; h <= harmonics; h++)
+        {
+            v[2 * h - 1] = sin(h * w);
+            v[2 * h] = cos(h * w);
+        }
+        for(unsigned int r = 0; r < terms; r++)
+        {
+            for(unsigned int c = 0; c < terms; c++)
+                m[r][c] += v[r] * v[c];
+            m[r][terms] += v[r] * y;
+        }
+    }
+    /* Gauss-Jordan, the matrix is well conditioned, no pivoting needed. */
+    for(unsigned int p = 0; p < terms; p++)
+        for(unsigned int r = 0; r < terms; r++)
+        {
+            if(r == p)
+                continue;
+            double f = m[r][p] / m[p][p];
+            for(unsigned int c = p; c <= terms; c++)
+                m[r][c] -= f * m[p][c];
+        }
+
+    double signal = 0, noise = 0;
+    for(unsigned int i = SKIP; i < SAMPLES; i++)
+    {
+        double w = 2 * M_PI * hz * i / RATE;
+        double fit = 0;
+        for(unsigned int h = 1; h <= harmonics; h++)
+            fit += m[2 * h - 1][terms] / m[2 * h - 1][2 * h - 1] * sin(h * w) +
+                   m[2 * h][terms] / m[2 * h][2 * h] * cos(h * w);
+        double e = out[2 * i] - m[0][terms] / m[0][0] - fit;
+        signal += fit * fit;
+        noise += e * e;
+    }
+    return 10 * log10(signal / noise);
+}
+
+/**
+ * SNR in dB of the left channel of ref against the difference between it
+ * and out, after out is shifted by the best lag within MAX_LAG samples and
+ * matched in level and DC by least squares.
+ */
+static double full_snr(const int16_t *ref)
+{
+    double best_signal = 0, best_noise = -1;
+
+    for(int lag = -MAX_LAG; lag <= MAX_LAG; lag++)
+    {
+        double n = 0, sx = 0, sr = 0, sxx = 0, srr = 0, sxr = 0;
+        for(unsigned int i = SKIP; i < SAMPLES - MAX_LAG; i++)
+        {
+            double x = out[2 * (i + lag)];
+            double r = ref[2 * i];
+            n++;
+            sx += x;
+            sr += r;
+            sxx += x * x;
+            srr += r * r;
+            sxr += x * r;
+        }
+        double var_x = sxx - sx * sx / n;
+        double var_r = srr - sr * sr / n;
+        double cov = sxr - sx * sr / n;
+        /* What is left of ref after the best gain and DC offset of out. */
+        double noise = var_x > 0 ? var_r - cov * cov / var_x : var_r;
+        if(best_noise < 0 || noise < best_noise)
+        {
+            best_signal = var_r;
+            best_noise = noise;
+        }
+    }
+    if(best_noise <= 0)
+        return INFINITY;
+    return 10 * log10(best_signal / best_noise);
+}
+
+/* Sign changes per second of the left channel. */
+static double toggle_rate(void)
+{
+    unsigned int toggles = 0;
+    for(unsigned int i = SKIP + 1; i < SAMPLES; i++)
+        toggles += (out[2 * i] > 0) != (out[2 * i - 2] > 0);
+    return (double) toggles * RATE / (SAMPLES - SKIP - 1);
+}
+
+int main(void)
+{
+    /* A few notes from the middle to the top of channel 1's range. */
+    static const uint16_t periods[4] = { 1750, 1899, 1985, 2017 };
+    /* Measured NAIVE (and LOW, which only differs in noise): 19.2, 15.8,
+     * 13.0 and 9.8 dB, the aliases of a point sampled square. */
+    static const double min_snr[4] = { 18, 14.5, 12, 8.5 };
+
+    bool have_full = true;
+    for(int p = 0; p < 4 && have_full; p++)
+    {
+        have_full = render_note(TIER_FULL, periods[p]);
+        memcpy(full[p], out, sizeof(out));
+    }
+
+    printf("SNR against FULL in dB ");
+    for(int p = 0; p < 4; p++)
+        printf("%9.0f Hz", 131072.0 / (2048 - periods[p]));
+    printf("\n");
+    if(!have_full)
+        printf("skipped, ext/minigb_apu is not checked out\n");
+    for(unsigned int t = TIER_NAIVE; t < TIERS && have_full; t++)
+    {
+        printf("%-23s", tier_name[t]);
+        for(int p = 0; p < 4; p++)
+        {
+            render_note(t, periods[p]);
+            double snr = full_snr(full[p]);
+            printf("%12.1f", snr);
+            CHECK(snr > MIN_FULL_SNR);
+        }
+        printf("\n");
+    }
+
+    printf("SNR against ideal in dB");
+    for(int p = 0; p < 4; p++)
+        printf("%9.0f Hz", 131072.0 / (2048 - periods[p]));
+    printf("\n");
+    for(unsigned int t = 0; t < TIERS; t++)
+    {
+        if(t == TIER_FULL && !have_full)
+            continue;
+        printf("%-23s", tier_name[t]);
+        for(int p = 0; p < 4; p++)
+        {
+            render_note(t, periods[p]);
+            double ideal = square_snr(131072.0 / (2048 - periods[p]));
+            printf("%12.1f", ideal);
+            if(t != TIER_FULL)
+                CHECK(ideal > min_snr[p]);
+        }
+        printf("\n");
+    }
+
+    /* Noise toggles at most every other sample. NR43 = s << 4 | r clocks
+     * the LFSR at 262144 / r' >> s Hz, r' = 0.5 for r = 0. LOW clocks it at
+     * most RATE / APU_NAIVE_NOISE_STRIDE times a second, below that it has
+     * to sound the same as NAIVE. */
+    static const uint8_t nr43[3] = { 0x57, 0x34, 0x10 };
+    for(int n = 0; n < 3; n++)
+    {
+        uint8_t w[][2] = { { 0x21, 0xF0 }, { 0x22, nr43[n] }, { 0x23, 0x80 } };
+        double clock = 524288.0 / ((nr43[n] & 7) ? 2 * (nr43[n] & 7) : 1) / (1 << (nr43[n] >> 4));
+        double rate[TIERS];
+        for(unsigned int t = TIER_NAIVE; t < TIERS; t++)
+        {
+            render(t, w, 3);
+            rate[t] = toggle_rate();
+        }
+        printf("noise %6.0f Hz clock, toggles/s: NAIVE %.0f LOW %.0f\n",
+                clock, rate[TIER_NAIVE], rate[TIER_LOW]);
+        if(clock <= RATE / APU_NAIVE_NOISE_STRIDE)
+            CHECK(rate[TIER_LOW] == rate[TIER_NAIVE]);
+        else
+        {
+            CHECK(rate[TIER_LOW] <= RATE / APU_NAIVE_NOISE_STRIDE / 2);
+            CHECK(rate[TIER_LOW] > RATE / APU_NAIVE_NOISE_STRIDE / 3);
+            CHECK(rate[TIER_NAIVE] > RATE / 3);
+        }
+    }
+
+    /* Cost with all four channels playing and the noise at its fastest. */
+    static const uint8_t all[][2] = {
+        { 0x11, 0x80 }, { 0x12, 0xF0 }, { 0x13, 0x00 }, { 0x14, 0x87 },
+        { 0x16, 0x40 }, { 0x17, 0xF0 }, { 0x18, 0x80 }, { 0x19, 0x86 },
+        { 0x1A, 0x80 }, { 0x1C, 0x20 }, { 0x1D, 0x00 }, { 0x1E, 0x87 },
+        { 0x21, 0xF0 }, { 0x22, 0x00 }, { 0x23, 0x80 },
+    };
+    for(unsigned int t = 0; t < TIERS; t++)
+    {
+        uint64_t start = test_now_ns();
+        unsigned int runs = 0;
+        bool built = true;
+        while(built && (runs < 20 || test_now_ns() - start < 200000000u))
+        {
+            built = render(t, all, sizeof(all) / sizeof(all[0]));
+            runs++;
+        }
+        if(built)
+            printf("%-6s %.1f Msamples/s\n", tier_name[t],
+                    (double) runs * SAMPLES * 1000 / (test_now_ns() - start));
+    }
+
+    return TEST_EXIT();
+}
@@ -0,0 +1,215 @@
+/**
+ * Copyright (C) 2024 by Vlastimil Slintak <slintak@uart.cz>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+ * THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/**
+ * Response and cost of the output filter. Sines at the APU rate are passed
+ * through audio_filter_run() and the gain at each frequency is measured
+ * once the filter has settled. The filter folded into the resampler has to
+ * give exactly what a separate filter pass in front of it gave, and the
+ * benchmark compares the two. On the direct path it also compares the
+ * fused pass with the gain-only pass it replaces.
+ */
+
+#include <math.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "test.h"
+#include "audio_filter.h"
+#include "resampler.h"
+
+#define RATE        32768u
+/* Q15 unity gain, as I2S_GAIN_UNITY. */
+#define UNITY       32768
+#define FRAME       548u
+#define SAMPLES     (FRAME * 60)
+
+static uint32_t in[SAMPLES];
+static uint32_t filtered[SAMPLES];
+static uint32_t out[2][SAMPLES * 2];
+
+static void make_sine(double hz, double amplitude)
+{
+    for(unsigned int i = 0; i < SAMPLES; i++)
+    {
+        int16_t v = (int16_t) lrint(amplitude * sin(2 * M_PI * hz * i / RATE));
+        in[i] = (uint16_t) v | ((uint32_t) (uint16_t) -v << 16);
+    }
+}
+
+/* Gain in dB of the filter at hz, from the RMS of the second half. */
+static double response(double hz)
+{
+    audio_filter_t f;
+    double rms_in = 0, rms_out = 0;
+
+    make_sine(hz, 8000);
+    audio_filter_init(&f, AUDIO_FILTER_HP_DMG, AUDIO_FILTER_LP_DEFAULT);
+    audio_filter_run(&f, filtered, in, SAMPLES, UNITY);
+    for(unsigned int i = SAMPLES / 2; i < SAMPLES; i++)
+    {
+        rms_in += (double) (int16_t) in[i] * (int16_t) in[i];
+        rms_out += (double) (int16_t) filtered[i] * (int16_t) filtered[i];
+    }
+    return 10 * log10(rms_out / rms_in);
+}
+
+/* The loop of i2s_apply_gain(), which the fused pass replaces. */
+static void gain_pass(uint32_t *dst, const uint32_t *src, unsigned int count, int32_t gain)
+{
+    for(unsigned int i = 0; i < count; i++)
+    {
+        int32_t left = audio_filter_clamp(((int16_t) src[i] * gain) >> 15);
+        int32_t right = audio_filter_clamp(((int16_t) (src[i] >> 16) * gain) >> 15);
+        dst[i] = (uint16_t) left | ((uint32_t) (uint16_t) right << 16);
+    }
+}
+
+/**
+ * Resamples in[] frame by frame into out[k], with the filter either in its
+ * own pass over each frame first or folded into the resampler. Returns the
+ * output count.
+ */
+static unsigned int resample(unsigned int k, uint32_t step, int32_t gain, bool fused)
+{
+    static uint32_t frame[FRAME];
+    audio_filter_t f;
+    resampler_t r;
+    unsigned int n = 0;
+
+    audio_filter_init(&f, AUDIO_FILTER_HP_DMG, AUDIO_FILTER_LP_DEFAULT);
+    resampler_init(&r, step, gain);
+    if(fused)
+        r.filter = &f;
+    for(unsigned int pos = 0; pos < SAMPLES; pos += FRAME)
+    {
+        const uint32_t *p = in + pos;
+        unsigned int used, left = FRAME;
+        if(!fused)
+        {
+            audio_filter_run(&f, frame, p, FRAME, UNITY);
+            p = frame;
+        }
+        while(left > 0)
+        {
+            /* Odd sized blocks, as the DMA periods cut the output. */
+            unsigned int space = 137 < SAMPLES * 2 - n ? 137 : SAMPLES * 2 - n;
+            n += resampler_run(&r, p, left, out[k] + n, space, &used);
+            p += used;
+            left -= used;
+        }
+    }
+    return n;
+}
+
+int main(void)
+{
+    /* Capacitor high-pass near 28 Hz, low-pass near 7 kHz. */
+    static const struct {
+        double hz, min_db, max_db;
+    } points[] = {
+        { 10, -12, -6 },
+        { 28, -4, -2 },
+        { 100, -0.5, 0 },
+        { 1000, -0.3, 0.1 },
+        { 4000, -1.2, -0.6 },
+        { 10000, -4, -3 },
+    };
+    for(unsigned int p = 0; p < sizeof(points) / sizeof(points[0]); p++)
+    {
+        double db = response(points[p].hz);
+        printf("%6.0f Hz: %6.2f dB\n", points[p].hz, db);
+        CHECK(db > points[p].min_db && db < points[p].max_db);
+    }
+
+    /* A DC step decays to about 5% within a frame, and to nothing. */
+    {
+        audio_filter_t f;
+        for(unsigned int i = 0; i < SAMPLES; i++)
+            in[i] = 10000u | (10000u << 16);
+        audio_filter_init(&f, AUDIO_FILTER_HP_DMG, AUDIO_FILTER_LP_DEFAULT);
+        audio_filter_run(&f, filtered, in, SAMPLES, UNITY);
+        CHECK(abs((int16_t) filtered[FRAME]) < 600);
+        CHECK_EQ((int16_t) filtered[4 * FRAME], 0);
+        CHECK_EQ((int16_t) filtered[SAMPLES - 1], 0);
+    }
+
+    /* Folded into the resampler it is the same filter, bit for bit. */
+    static const uint32_t rates[3] = { RATE - 37, 44100, 48000 };
+    static const int32_t gains[2] = { UNITY, 11627 };
+    uint32_t seed = 1;
+    for(unsigned int i = 0; i < SAMPLES; i++)
+    {
+        /* Square-ish APU output with a DC offset, plus some noise. */
+        int16_t v = ((i / 37) & 1 ? 12000 : -4000) + (int16_t) (test_rand(&seed) % 2001) - 1000;
+        in[i] = (uint16_t) v | ((uint32_t) (uint16_t) (v / 2) << 16);
+    }
+    for(unsigned int r = 0; r < 3; r++)
+        for(unsigned int g = 0; g < 2; g++)
+        {
+            uint32_t step = resampler_step(RATE, rates[r]);
+            unsigned int n0 = resample(0, step, gains[g], false);
+            unsigned int n1 = resample(1, step, gains[g], true);
+            CHECK_EQ(n0, n1);
+            CHECK(memcmp(out[0], out[1], n0 * sizeof(uint32_t)) == 0);
+        }
+
+    /* Cost of the direct path per sample: the gain pass alone, the filter
+     * in its own pass in front of it, and the fused pass. */
+    {
+        audio_filter_t f;
+        double ns[3];
+        audio_filter_init(&f, AUDIO_FILTER_HP_DMG, AUDIO_FILTER_LP_DEFAULT);
+        for(unsigned int k = 0; k < 3; k++)
+        {
+            uint64_t start = test_now_ns();
+            for(int i = 0; i < 20; i++)
+                for(unsigned int pos = 0; pos < SAMPLES; pos += FRAME)
+                {
+                    if(k == 0)
+                        gain_pass(filtered + pos, in + pos, FRAME, gains[1]);
+                    else if(k == 1)
+                    {
+                        audio_filter_run(&f, filtered + pos, in + pos, FRAME, UNITY);
+                        gain_pass(filtered + pos, filtered + pos, FRAME, gains[1]);
+                    }
+                    else
+                        audio_filter_run(&f, filtered + pos, in + pos, FRAME, gains[1]);
+                }
+            ns[k] = (double) (test_now_ns() - start) / (20.0 * SAMPLES);
+        }
+        printf("direct output: gain pass %.2f ns/sample, filter and gain passes %.2f, "
+                "fused %.2f\n", ns[0], ns[1], ns[2]);
+    }
+
+    /* Cost of the two passes and of the folded one, per input sample. */
+    for(unsigned int r = 0; r < 3; r++)
+    {
+        uint32_t step = resampler_step(RATE, rates[r]);
+        double ns[2];
+        for(unsigned int fused = 0; fused < 2; fused++)
+        {
+            uint64_t start = test_now_ns();
+            for(int i = 0; i < 20; i++)
+                resample(fused, step, gains[1], fused);
+            ns[fused] = (double) (test_now_ns() - start) / (20.0 * SAMPLES);
+        }
+        printf("%5u Hz output: filter pass and resampler %.2f ns/sample, folded %.2f ns/sample\n",
+                rates[r], ns[0], ns[1]);
+    }
+
+    return TEST_EXIT();
+}
@@ -0,0 +1,148 @@
+/**
+ * Copyright (C) 2024 by Vlastimil Slintak <slintak@uart.cz>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+ * THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/**
+ * Replays frames through the dirty line detection of lcd_draw_line() and
+ * checks that the LCD, which only receives the changed lines, always shows
+ * the current frame. Each scenario also checks how many lines were sent,
+ * and the bytes saved are printed. The frames are synthetic: a random
+ * background that may scroll, a status bar and a moving sprite.
+ */
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "test.h"
+#include "lcd_line.h"
+
+#define WIDTH   160
+#define HEIGHT  144
+#define WORDS   (WIDTH / 8)
+
+typedef struct {
+    uint32_t sent_hash[HEIGHT];
+    uint32_t generation;
+    uint8_t shown[HEIGHT][WIDTH];   /* What the LCD holds */
+    uint32_t lines_sent;
+    uint32_t lines_total;
+} replay_t;
+
+static uint8_t background[2 * HEIGHT][2 * WIDTH];
+static uint8_t frame[HEIGHT][WIDTH];
+
+/* One frame as lcd_draw_line() sees it, in INDEXED4 format. */
+static uint32_t replay_frame(replay_t *r)
+{
+    uint32_t __attribute__((aligned(4))) words[WORDS];
+    uint32_t sent = 0;
+
+    for(int y = 0; y < HEIGHT; y++)
+    {
+        lcd_line_indexed4(frame[y], words, WIDTH);
+        uint32_t hash = lcd_line_hash(r->generation, words, WORDS);
+        r->lines_total++;
+        if(!lcd_line_changed(&r->sent_hash[y], hash))
+            continue;
+        memcpy(r->shown[y], frame[y], WIDTH);
+        r->lines_sent++;
+        sent++;
+    }
+    CHECK(memcmp(r->shown, frame, sizeof(frame)) == 0);
+    return sent;
+}
+
+static void draw(int scroll_x, int scroll_y, int status_rows,
+        int sprite_x, int sprite_y)
+{
+    for(int y = 0; y < HEIGHT; y++)
+        for(int x = 0; x < WIDTH; x++)
+        {
+            if(y < status_rows)
+                frame[y][x] = 0x20 | ((x / 8) & 3);
+            else
+                frame[y][x] = background[y + scroll_y][x + scroll_x];
+        }
+    for(int y = 0; y < 8; y++)
+        for(int x = 0; x < 8; x++)
+            if(sprite_y + y < HEIGHT && sprite_x + x < WIDTH)
+                frame[sprite_y + y][sprite_x + x] = 0x10 | ((x ^ y) & 3);
+}
+
+static void report(const char *name, const replay_t *r)
+{
+    printf("%-10s %5u of %5u lines sent, %3.0f%% of the bytes saved\n",
+            name, r->lines_sent, r->lines_total,
+            100.0 * (r->lines_total - r->lines_sent) / r->lines_total);
+}
+
+int main(void)
+{
+    replay_t r;
+    uint32_t seed = 4;
+
+    for(int y = 0; y < 2 * HEIGHT; y++)
+        for(int x = 0; x < 2 * WIDTH; x++)
+            background[y][x] = test_rand(&seed) & 3;
+
+    /* Still screen: sent once. */
+    memset(&r, 0, sizeof(r));
+    for(int f = 0; f < 60; f++)
+    {
+        draw(0, 0, 0, 200, 200);
+        CHECK_EQ(replay_frame(&r), f == 0 ? HEIGHT : 0);
+    }
+    report("still", &r);
+
+    /* A sprite moving diagonally: its old and new rows, 9 lines. */
+    memset(&r, 0, sizeof(r));
+    draw(0, 0, 0, 0, 0);
+    replay_frame(&r);
+    for(int f = 1; f < 100; f++)
+    {
+        draw(0, 0, 0, f, f);
+        CHECK_EQ(replay_frame(&r), 9);
+    }
+    report("sprite", &r);
+
+    /* Palette change: same pixels, all lines sent again. */
+    r.generation++;
+    CHECK_EQ(replay_frame(&r), HEIGHT);
+    CHECK_EQ(replay_frame(&r), 0);
+
+    /* Vertical scrolling: every line changes. */
+    memset(&r, 0, sizeof(r));
+    for(int f = 0; f < 60; f++)
+    {
+        draw(0, f, 0, 200, 200);
+        CHECK_EQ(replay_frame(&r), HEIGHT);
+    }
+    report("scroll", &r);
+
+    /* Status bar over a playfield scrolling every fourth frame. */
+    memset(&r, 0, sizeof(r));
+    for(int f = 0; f < 240; f++)
+    {
+        draw(f / 4, 0, 16, 40 + (f % 32), 100);
+        uint32_t sent = replay_frame(&r);
+        if(f > 0 && f % 4 == 0)
+            CHECK_EQ(sent, HEIGHT - 16);
+        else if(f > 0)
+            CHECK_EQ(sent, 8);
+    }
+    report("platformer", &r);
+
+    return TEST_EXIT();
+}
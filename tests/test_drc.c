@@ -0,0 +1,252 @@
+/**
+ * Copyright (C) 2024 by Vlastimil Slintak <slintak@uart.cz>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+ * THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/**
+ * Convergence of the audio rate control, simulated at the output sample
+ * clock. Emulated frames of AUDIO_SAMPLES samples arrive at the frame rate
+ * of the frame pacer, with its clock off by a few hundred ppm and jitter
+ * on top. Each one is resampled into DMA periods the way
+ * audio_output_frame() does it, with the step set by resampler_drc_step()
+ * from the queued audio. The DMA plays the periods back continuously, and
+ * when it has run dry the output is started at the target with silence.
+ *
+ * The fill level seen at every frame is the trace being checked. Once
+ * settled, it has to stay within a band around its mean, that mean has to
+ * be the target, and the output must never run dry. The trace is printed
+ * every second.
+ */
+
+#include <math.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "test.h"
+#include "resampler.h"
+
+/* As configured in main.c, with minigb_apu rendering AUDIO_SAMPLES per
+ * frame. */
+#define OUTPUT_RATE     32768u
+#define FRAME_HZ        (4194304.0 / 70224.0)
+#define FRAME_SAMPLES   548u
+#define PERIODS         4u
+#define PERIOD          (FRAME_SAMPLES / PERIODS)
+#define BUFFERS         (2 * PERIODS)
+#define TARGET          (PERIOD * PERIODS / 2)
+
+typedef struct {
+    /* Output side: the buffer playing and those queued behind it. */
+    uint64_t now;           /* Output samples played so far */
+    uint32_t playing_left;  /* Samples left in the playing buffer, 0 idle */
+    uint32_t queued;        /* Full buffers queued behind it */
+    uint32_t filling;       /* Samples in the buffer being filled */
+    uint32_t underruns;
+    uint32_t waits;
+    uint32_t primed;
+    /* Producer side */
+    resampler_t resampler;
+    uint32_t nominal;
+} sim_t;
+
+static void sim_play(sim_t *s, uint64_t until)
+{
+    while(s->now < until)
+    {
+        if(s->playing_left == 0)
+        {
+            s->now = until;
+            break;
+        }
+        uint64_t n = until - s->now;
+        if(n > s->playing_left)
+            n = s->playing_left;
+        s->playing_left -= n;
+        s->now += n;
+        if(s->playing_left == 0 && s->queued > 0)
+        {
+            s->queued--;
+            s->playing_left = PERIOD;
+        }
+        else if(s->playing_left == 0)
+            s->underruns++;
+    }
+}
+
+/* i2s_dma_submit() */
+static void sim_submit(sim_t *s)
+{
+    if(s->playing_left == 0)
+        s->playing_left = PERIOD;
+    else
+        s->queued++;
+}
+
+/* audio_output_frame(): returns the fill level the rate control saw. */
+static uint32_t sim_frame(sim_t *s)
+{
+    static const uint32_t in[FRAME_SAMPLES];
+    static uint32_t out[PERIOD];
+    unsigned int left = FRAME_SAMPLES;
+    const uint32_t *p = in;
+    uint32_t fill = s->playing_left + s->queued * PERIOD + s->filling;
+
+    /* Silence up to the target once the output ran dry. */
+    if(fill == 0)
+    {
+        for(; fill < TARGET; fill += PERIOD)
+            sim_submit(s);
+        s->primed++;
+    }
+    s->resampler.step = resampler_drc_step(&s->resampler, s->nominal, fill, TARGET);
+    while(left > 0)
+    {
+        unsigned int used;
+
+        /* i2s_dma_acquire() waits if every buffer is queued. */
+        if(s->filling == 0 && s->queued + 1 >= BUFFERS)
+        {
+            s->waits++;
+            sim_play(s, s->now + s->playing_left);
+        }
+        s->filling += resampler_run(&s->resampler, p, left, out,
+                PERIOD - s->filling, &used);
+        p += used;
+        left -= used;
+        if(s->filling == PERIOD)
+        {
+            sim_submit(s);
+            s->filling = 0;
+        }
+    }
+    return fill;
+}
+
+typedef struct {
+    double clock_ppm;       /* Frame pacer clock against the I2S clock */
+    double jitter_ms;       /* Random lateness of a frame, up to */
+    uint32_t stall_frame;   /* A frame held up by stall_ms, 0 for none */
+    double stall_ms;
+} scenario_t;
+
+typedef struct {
+    double mean;            /* Fill over the second half */
+    uint32_t min, max;      /* Fill over the second half */
+    uint32_t end;           /* Fill at the last frame */
+    uint32_t settle;        /* Frames until it stays within SETTLE_BAND */
+    uint32_t underruns;     /* Once settled */
+} result_t;
+
+#define SECONDS     600u
+#define STALL_SPAN  600u    /* Frames after a stall left out of the band */
+#define SETTLE_BAND (TARGET / 10)
+
+static uint32_t trace[(uint32_t) (SECONDS * 60)];
+static uint32_t underruns[(uint32_t) (SECONDS * 60)];
+
+static bool in_stall(const scenario_t *sc, uint32_t f)
+{
+    return sc->stall_frame && f >= sc->stall_frame && f < sc->stall_frame + STALL_SPAN;
+}
+
+static result_t run(const char *name, scenario_t sc)
+{
+    const uint32_t frames = (uint32_t) (SECONDS * FRAME_HZ);
+    double period = OUTPUT_RATE / FRAME_HZ * (1.0 - sc.clock_ppm * 1e-6);
+    uint32_t seed = 13;
+    sim_t s;
+    result_t r = { 0, UINT32_MAX, 0, 0, 0, 0 };
+
+    memset(&s, 0, sizeof(s));
+    s.nominal = (uint32_t) (FRAME_SAMPLES * FRAME_HZ * RESAMPLER_ONE / OUTPUT_RATE);
+    resampler_init(&s.resampler, s.nominal, 32768);
+
+    for(uint32_t f = 0; f < frames; f++)
+    {
+        double t = f * period + (test_rand(&seed) % 1000) * sc.jitter_ms * 1e-3 *
+                OUTPUT_RATE / 1000.0;
+        if(f == sc.stall_frame && sc.stall_frame)
+            t += sc.stall_ms * OUTPUT_RATE / 1000.0;
+        if((uint64_t) t > s.now)
+            sim_play(&s, (uint64_t) t);
+        trace[f] = sim_frame(&s);
+        underruns[f] = s.underruns;
+    }
+
+    double sum = 0;
+    for(uint32_t f = frames / 2; f < frames; f++)
+        sum += trace[f];
+    r.mean = sum / (frames - frames / 2);
+    r.end = trace[frames - 1];
+    for(uint32_t f = 0; f < frames; f++)
+        if(fabs(trace[f] - r.mean) > SETTLE_BAND && !in_stall(&sc, f))
+            r.settle = f + 1;
+    for(uint32_t f = frames / 2; f < frames; f++)
+    {
+        if(in_stall(&sc, f))
+            continue;
+        r.min = trace[f] < r.min ? trace[f] : r.min;
+        r.max = trace[f] > r.max ? trace[f] : r.max;
+    }
+    if(r.settle > 0)
+        r.underruns = s.underruns - underruns[r.settle - 1];
+
+    printf("%-12s fill mean %5.1f, %3u-%3u, end %3u, settled after %4u frames, %u underruns "
+            "(%u in all, %u primed), step %+ld ppm\n",
+            name, r.mean, r.min, r.max, r.end, r.settle, r.underruns, s.underruns, s.primed,
+            (long) (((int64_t) s.resampler.step - (int64_t) s.nominal) * 1000000 /
+                (int64_t) s.nominal));
+    printf("  fill every second:");
+    for(uint32_t f = 0; f < frames && f < 60 * 20; f += 60)
+        printf(" %u", trace[f]);
+    printf("\n");
+    return r;
+}
+
+int main(void)
+{
+    result_t r;
+
+    /* The nominal step already accounts for minigb_apu rendering 548
+     * samples per frame, 32731 Hz at the frame rate. */
+    r = run("nominal", (scenario_t) { 0, 0, 0, 0 });
+    CHECK_EQ(r.underruns, 0);
+    CHECK(r.settle < 60 * 5);
+    CHECK(r.max - r.min <= 4);
+    CHECK(abs((int) r.end - (int) TARGET) <= 2);
+
+    /* Frame pacer clock off by +-300 ppm: the integral term takes the
+     * offset over and the level comes back to the target. */
+    r = run("clock +300", (scenario_t) { 300, 0, 0, 0 });
+    CHECK_EQ(r.underruns, 0);
+    CHECK(r.settle < 60 * 5);
+    CHECK(abs((int) r.end - (int) TARGET) <= 2);
+    r = run("clock -300", (scenario_t) { -300, 0, 0, 0 });
+    CHECK_EQ(r.underruns, 0);
+    CHECK(r.settle < 60 * 5);
+    CHECK(abs((int) r.end - (int) TARGET) <= 2);
+
+    /* Frames late by up to 2 ms, as with a busy emulation core. */
+    r = run("jitter 2ms", (scenario_t) { 150, 2, 0, 0 });
+    CHECK_EQ(r.underruns, 0);
+    CHECK(fabs(r.mean - TARGET) < 2);
+
+    /* A 40 ms hiccup, e.g. a save to SD: the output may run dry once, and
+     * then the level has to come back. */
+    r = run("stall 40ms", (scenario_t) { 0, 1, 6000, 40 });
+    CHECK(r.underruns <= 1);
+    CHECK(fabs(r.mean - TARGET) < 2);
+
+    return TEST_EXIT();
+}
@@ -0,0 +1,144 @@
+/**
+ * Copyright (C) 2024 by Vlastimil Slintak <slintak@uart.cz>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+ * THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/**
+ * Runs the frame pacer against a simulated clock. The loop sleeps until
+ * each deadline and then spends the frame's cost, as the main loop does
+ * with frame_wait_until() and gb_run_frame(). Checks that an hour of
+ * frames keeps exactly to the emulated clock, that frame starts only
+ * jitter by the microsecond rounding, and how late frames and speed
+ * changes are handled.
+ */
+
+#include "test.h"
+#include "framepacer.h"
+
+/* DMG_CLOCK_FREQ_REDUCED and SCREEN_REFRESH_CYCLES_REDUCED */
+#define TICK_HZ         262144u
+#define FRAME_TICKS     4389u
+#define PERIOD_NUM      ((uint64_t) FRAME_TICKS * 1000000u)
+
+typedef struct {
+    frame_pacer_t pacer;
+    uint64_t now;
+    uint64_t start;         /* Start of the last frame */
+} sim_t;
+
+static void sim_init(sim_t *s, uint64_t now)
+{
+    s->now = now;
+    s->start = now;
+    frame_pacer_init(&s->pacer, TICK_HZ, FRAME_TICKS, now);
+}
+
+/* Waits for the next deadline and runs a frame of cost_us. */
+static void sim_frame(sim_t *s, unsigned int speed, uint32_t cost_us)
+{
+    uint64_t deadline = frame_pacer_next(&s->pacer, s->now, speed);
+    if(deadline > s->now)
+        s->now = deadline;
+    s->start = s->now;
+    s->now += cost_us;
+}
+
+int main(void)
+{
+    sim_t s;
+    uint32_t seed = 10;
+
+    /* An hour of frames: each starts exactly at its ideal time, rounded
+     * down to the microsecond, whatever the frame costs. */
+    const uint64_t origin = 1ull << 40;
+    const uint32_t frames = 3600u * TICK_HZ / FRAME_TICKS;
+    uint64_t prev = origin;
+    uint32_t min_gap = UINT32_MAX, max_gap = 0;
+    sim_init(&s, origin);
+    for(uint32_t n = 1; n <= frames; n++)
+    {
+        sim_frame(&s, 1, 4000 + test_rand(&seed) % 12000);
+        uint64_t ideal = origin + n * PERIOD_NUM / TICK_HZ;
+        if(s.start != ideal)
+        {
+            CHECK_EQ(s.start, ideal);
+            break;
+        }
+        uint32_t gap = (uint32_t) (s.start - prev);
+        min_gap = gap < min_gap ? gap : min_gap;
+        max_gap = gap > max_gap ? gap : max_gap;
+        prev = s.start;
+    }
+    CHECK_EQ(s.pacer.resyncs, 0);
+    CHECK(max_gap - min_gap <= 1);
+    printf("%u frames in %.6f s, gaps %u-%u us\n", frames,
+            (prev - origin) / 1e6, min_gap, max_gap);
+
+    /* Late by less than a period: started at once, and the following
+     * frames catch up with the original schedule. */
+    sim_init(&s, 0);
+    sim_frame(&s, 1, 1000);
+    sim_frame(&s, 1, 25000);
+    sim_frame(&s, 1, 1000);
+    CHECK_EQ(s.start, 2 * PERIOD_NUM / TICK_HZ + 25000);
+    sim_frame(&s, 1, 1000);
+    CHECK_EQ(s.start, 4 * PERIOD_NUM / TICK_HZ);
+    CHECK_EQ(s.pacer.resyncs, 0);
+
+    /* Late by more than a period: the missed deadlines are given up and
+     * the schedule restarts from the late frame, with no burst. */
+    sim_init(&s, 0);
+    sim_frame(&s, 1, 1000);
+    sim_frame(&s, 1, 60000);
+    uint64_t late = s.now;
+    sim_frame(&s, 1, 1000);
+    CHECK_EQ(s.start, late);
+    CHECK_EQ(s.pacer.resyncs, 1);
+    sim_frame(&s, 1, 1000);
+    CHECK_EQ(s.start, late + PERIOD_NUM / TICK_HZ);
+
+    /* Fast-forward: 2 and 4 times as many frames in the same time. */
+    for(unsigned int speed = 1; speed <= FRAME_SPEED_MAX; speed *= 2)
+    {
+        sim_init(&s, 0);
+        for(unsigned int n = 0; n < 60 * speed; n++)
+            sim_frame(&s, speed, 1000);
+        CHECK_EQ(s.start, 60 * PERIOD_NUM / TICK_HZ);
+    }
+
+    /* Changing speed keeps the frames in order and on the clock. */
+    sim_init(&s, 0);
+    prev = 0;
+    for(unsigned int n = 0; n < 240; n++)
+    {
+        sim_frame(&s, 1u << (n / 20 % 3), 1000);
+        CHECK(s.start >= prev);
+        prev = s.start;
+    }
+    CHECK_EQ(s.pacer.resyncs, 0);
+
+    /* Uncapped: every frame starts at once. */
+    sim_init(&s, 0);
+    for(unsigned int n = 0; n < 10; n++)
+    {
+        uint64_t before = s.now;
+        sim_frame(&s, FRAME_SPEED_UNCAPPED, 3000);
+        CHECK_EQ(s.start, before);
+    }
+    /* Back to normal speed, one period after the last frame started. */
+    sim_frame(&s, 1, 1000);
+    CHECK_EQ(s.start, 27000 + PERIOD_NUM / TICK_HZ);
+
+    return TEST_EXIT();
+}
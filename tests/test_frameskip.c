@@ -0,0 +1,123 @@
+/**
+ * Copyright (C) 2024 by Vlastimil Slintak <slintak@uart.cz>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+ * THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/**
+ * Feeds the frame skip controller a trace of frame times, with Peanut-GB
+ * drawing every other frame while skipping, and checks when it starts and
+ * stops skipping. A frame costs the emulation time plus, when drawn, the
+ * conversion and queueing of its lines. The trace is synthetic: phases of
+ * light and heavy scenes, a short spike, a scene right at the budget and
+ * one jittering around it.
+ */
+
+#include <stdbool.h>
+
+#include "test.h"
+#include "frameskip.h"
+
+/* 59.73 Hz */
+#define BUDGET_US   16742u
+#define DRAW_US     5000u
+
+typedef struct {
+    uint32_t frames;
+    uint32_t emulate_us;    /* Cost of a frame without drawing */
+    uint32_t jitter_us;     /* Random extra of up to this much */
+} phase_t;
+
+typedef struct {
+    frame_skip_state_t state;
+    uint32_t frame;
+    uint32_t toggles;
+    uint32_t last_toggle;   /* Frame of the last change */
+    uint32_t skipped;
+    uint32_t over_budget;   /* Frames that took longer than the budget */
+    uint32_t seed;
+} trace_t;
+
+static void run_phase(trace_t *t, phase_t phase)
+{
+    for(uint32_t i = 0; i < phase.frames; i++, t->frame++)
+    {
+        /* Peanut-GB skips every other frame with gb.direct.frame_skip. */
+        bool drawn = !t->state.skipping || (t->frame & 1);
+        uint32_t us = phase.emulate_us + (drawn ? DRAW_US : 0);
+        if(phase.jitter_us)
+            us += test_rand(&t->seed) % phase.jitter_us;
+
+        bool was = t->state.skipping;
+        t->state = frame_skip_update(t->state, us, drawn, BUDGET_US);
+        if(t->state.skipping != was)
+        {
+            t->toggles++;
+            t->last_toggle = t->frame;
+        }
+        t->skipped += !drawn;
+        t->over_budget += us > BUDGET_US;
+    }
+}
+
+int main(void)
+{
+    trace_t t = { .seed = 9 };
+
+    /* Light scene: drawn frames well within budget. */
+    run_phase(&t, (phase_t) { 300, 8000, 0 });
+    CHECK_EQ(t.toggles, 0);
+    CHECK_EQ(t.skipped, 0);
+
+    /* A spike shorter than FRAME_SKIP_ENTER_FRAMES is ridden out. */
+    run_phase(&t, (phase_t) { 2, 20000, 0 });
+    run_phase(&t, (phase_t) { 60, 8000, 0 });
+    CHECK_EQ(t.toggles, 0);
+
+    /* Heavy scene: skipping starts within a few frames, then every other
+     * frame fits in the budget again and it stays on. */
+    uint32_t heavy = t.frame;
+    run_phase(&t, (phase_t) { 600, 14000, 0 });
+    CHECK_EQ(t.toggles, 1);
+    CHECK(t.state.skipping);
+    CHECK(t.last_toggle - heavy < 4 * FRAME_SKIP_ENTER_FRAMES);
+    printf("skipping after %u heavy frames\n", t.last_toggle - heavy + 1);
+
+    /* Back to light: skipping stops only after FRAME_SKIP_LEAVE_FRAMES
+     * drawn frames, i.e. twice as many frames. */
+    uint32_t light = t.frame;
+    run_phase(&t, (phase_t) { 600, 8000, 0 });
+    CHECK_EQ(t.toggles, 2);
+    CHECK(!t.state.skipping);
+    CHECK(t.last_toggle - light >= 2 * FRAME_SKIP_LEAVE_FRAMES - 1);
+    CHECK(t.last_toggle - light < 3 * FRAME_SKIP_LEAVE_FRAMES);
+    printf("drawing all frames after %u light frames\n", t.last_toggle - light + 1);
+
+    /* Drawn frames just over budget, inside the enter margin: no change.
+     * The same cost while skipping is inside the leave margin. */
+    run_phase(&t, (phase_t) { 600, BUDGET_US - DRAW_US + FRAME_SKIP_ENTER_MARGIN_US / 2, 0 });
+    CHECK_EQ(t.toggles, 2);
+    t.state.skipping = true;
+    run_phase(&t, (phase_t) { 600, BUDGET_US - DRAW_US - FRAME_SKIP_LEAVE_MARGIN_US / 2, 0 });
+    CHECK_EQ(t.toggles, 2);
+    t.state.skipping = false;
+    t.state.streak = 0;
+
+    /* Jitter around the budget must not make it flap. */
+    uint32_t toggles = t.toggles;
+    run_phase(&t, (phase_t) { 3600, BUDGET_US - DRAW_US - 1000, 2000 });
+    printf("jitter: %u changes in 3600 frames\n", t.toggles - toggles);
+    CHECK(t.toggles - toggles <= 2);
+
+    return TEST_EXIT();
+}
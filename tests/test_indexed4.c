@@ -0,0 +1,202 @@
+/**
+ * Copyright (C) 2024 by Vlastimil Slintak <slintak@uart.cz>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+ * THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/**
+ * Bit-exact host reference of the INDEXED4 path: lcd_line_indexed4() packs
+ * the line, feed DMA pushes it through the ili9225_palette program, addr
+ * and pixel DMA copy palette entries into the ili9225_lcd FIFO, which then
+ * writes GRAM. The same frames are also sent as RGB565 lines, and both
+ * resulting GRAM images must equal the palette LUT applied to the frame.
+ *
+ * The PIO programs are modelled instruction by instruction, with the
+ * palette table at a made-up 32-byte aligned RP2040 address so that the
+ * address arithmetic is the one done on the target. Frames are synthetic.
+ */
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "test.h"
+#include "gbcolors.h"
+#include "ili9225_line.h"
+#include "lcd_line.h"
+
+#define WIDTH   160
+#define HEIGHT  144
+#define X0      ((ILI9225_SCREEN_WIDTH - WIDTH) / 2)
+#define Y0      ((ILI9225_SCREEN_HEIGHT - HEIGHT) / 2)
+
+/* Where palette_table would be in SRAM. */
+#define TABLE_ADDR  0x20041FE0u
+
+typedef struct {
+    uint16_t gram[ILI9225_SCREEN_HEIGHT][ILI9225_SCREEN_WIDTH];
+    unsigned int row, col;
+    /* ili9225_lcd program state */
+    uint16_t reg;
+    uint32_t pixels_left;
+    bool have_reg;
+    uint32_t halfwords;
+} lcd_t;
+
+static void lcd_reset(lcd_t *lcd)
+{
+    memset(lcd, 0, sizeof(*lcd));
+    lcd->row = Y0;
+    lcd->col = X0;
+}
+
+/* One halfword from the LCD FIFO, as ili9225_lcd interprets it, with the
+ * window set to the game screen. */
+static void lcd_put(lcd_t *lcd, uint16_t v)
+{
+    lcd->halfwords++;
+    if(lcd->pixels_left > 0)
+    {
+        CHECK(lcd->row < ILI9225_SCREEN_HEIGHT);
+        if(lcd->row < ILI9225_SCREEN_HEIGHT)
+            lcd->gram[lcd->row][lcd->col] = v;
+        if(++lcd->col == X0 + WIDTH)
+        {
+            lcd->col = X0;
+            lcd->row++;
+        }
+        lcd->pixels_left--;
+        return;
+    }
+    if(!lcd->have_reg)
+    {
+        lcd->reg = v;
+        lcd->have_reg = true;
+        return;
+    }
+    lcd->have_reg = false;
+    if(lcd->reg == ILI9225_REG_GRAM_RW)
+        lcd->pixels_left = v;
+    else if(lcd->reg == ILI9225_REG_RAM_ADDR_SET1)
+        lcd->row = v;
+    else
+        CHECK(!"unexpected register");
+}
+
+/* ili9225_palette: out x, 4 / in y, 27 / in x, 4 / in null, 1, autopull
+ * and autopush at 32 bits, OSR shifting right and ISR shifting left. Each
+ * address is then read by pixel_chan as one halfword. */
+static void expander_feed(lcd_t *lcd, const uint16_t table[16], uint32_t word)
+{
+    const uint32_t y = TABLE_ADDR >> 5;
+    uint32_t osr = word;
+
+    for(int n = 0; n < 8; n++)
+    {
+        uint32_t x = osr & 0xF;
+        osr >>= 4;
+        uint32_t isr = 0;
+        isr = (isr << 27) | (y & 0x7FFFFFFu);
+        isr = (isr << 4) | x;
+        isr = isr << 1;
+
+        CHECK(isr >= TABLE_ADDR && isr < TABLE_ADDR + 32 && (isr & 1) == 0);
+        lcd_put(lcd, table[(isr - TABLE_ADDR) / 2]);
+    }
+}
+
+static void send_indexed4(lcd_t *lcd, uint16_t table[16], uint16_t *buf,
+        const uint8_t *pixels, uint8_t y)
+{
+    lcd_line_indexed4(pixels, (uint32_t *) &buf[LINE_HEADER_LENGTH], WIDTH);
+    ili9225_line_header_indexed4(buf);
+
+    /* ili9225_line_start() */
+    ili9225_palette_header(table, y, WIDTH);
+    const uint32_t *feed = ili9225_line_feed(buf);
+    for(uint32_t i = 0; i < ili9225_line_feed_words(WIDTH); i++)
+        expander_feed(lcd, table, feed[i]);
+}
+
+static void send_rgb565(lcd_t *lcd, const uint16_t *lut, uint16_t *buf,
+        const uint8_t *pixels, uint8_t y)
+{
+    lcd_line_rgb565(lut, pixels, &buf[LINE_HEADER_LENGTH], WIDTH);
+    ili9225_line_header_rgb565(buf, y, WIDTH);
+    for(unsigned int i = 0; i < LINE_HEADER_LENGTH + WIDTH; i++)
+        lcd_put(lcd, buf[i]);
+}
+
+static uint8_t frame[HEIGHT][WIDTH];
+static lcd_t lcd_indexed, lcd_rgb;
+static uint16_t __attribute__((aligned(4))) buf[LINE_HEADER_LENGTH + ILI9225_SCREEN_WIDTH];
+
+int main(void)
+{
+    palette_t palette;
+    palette_lut_t lut;
+    uint16_t table[16];
+    uint32_t seed = 3;
+
+    /* Header word and index mapping. */
+    for(unsigned int p = 0; p < 256; p++)
+        if((p & 0x30) != 0x30)
+            CHECK(LCD_LINE_INDEX(p) < PALETTE_HEADER_REG);
+
+    for(unsigned int entry = 0; entry < 0x20; entry++)
+    {
+        get_colour_palette(palette, entry, 0x05);
+        build_palette_lut(palette, lut);
+        lcd_line_index_colors(lut, table);
+
+        for(int y = 0; y < HEIGHT; y++)
+            for(int x = 0; x < WIDTH; x++)
+            {
+                uint32_t r = test_rand(&seed);
+                frame[y][x] = ((r % 3) << 4) | ((r >> 4) & 3);
+            }
+        /* A full span of every colour, so no index is left untested. */
+        for(int x = 0; x < WIDTH; x++)
+            frame[entry % HEIGHT][x] = ((x % 12) / 4) << 4 | (x & 3);
+
+        lcd_reset(&lcd_indexed);
+        lcd_reset(&lcd_rgb);
+        for(int y = 0; y < HEIGHT; y++)
+        {
+            send_indexed4(&lcd_indexed, table, buf, frame[y], Y0 + y);
+            send_rgb565(&lcd_rgb, lut, buf, frame[y], Y0 + y);
+        }
+
+        /* The indexed header repeats the address write twice more. */
+        CHECK_EQ(lcd_indexed.halfwords, lcd_rgb.halfwords + 4 * HEIGHT);
+        CHECK_EQ(lcd_indexed.pixels_left, 0);
+        CHECK(!lcd_indexed.have_reg);
+        CHECK(memcmp(lcd_indexed.gram, lcd_rgb.gram, sizeof(lcd_rgb.gram)) == 0);
+        for(int y = 0; y < HEIGHT; y++)
+            for(int x = 0; x < WIDTH; x++)
+                CHECK_EQ(lcd_indexed.gram[Y0 + y][X0 + x], lut[frame[y][x]]);
+    }
+
+    /* Lines skipped or out of order still land on their own rows. */
+    lcd_reset(&lcd_indexed);
+    lcd_reset(&lcd_rgb);
+    for(int y = HEIGHT - 1; y >= 0; y -= 3)
+    {
+        send_indexed4(&lcd_indexed, table, buf, frame[y], Y0 + y);
+        send_rgb565(&lcd_rgb, lut, buf, frame[y], Y0 + y);
+    }
+    CHECK(memcmp(lcd_indexed.gram, lcd_rgb.gram, sizeof(lcd_rgb.gram)) == 0);
+    CHECK_EQ(lcd_indexed.gram[Y0 + HEIGHT - 1][X0 + 5], lut[frame[HEIGHT - 1][5]]);
+    CHECK_EQ(lcd_indexed.gram[Y0 + HEIGHT - 2][X0 + 5], 0);
+
+    return TEST_EXIT();
+}
@@ -0,0 +1,141 @@
+/**
+ * Copyright (C) 2024 by Vlastimil Slintak <slintak@uart.cz>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+ * THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/**
+ * Bytes per frame sent to the panel, progressive against interlaced, in
+ * every scaler mode.
+ *
+ * Lines go through the same steps as in lcd_draw_line(): conversion,
+ * dirty line skipping and, when scaled, repeating on their output rows.
+ * With interlacing Peanut-GB only draws the odd lines one frame and the
+ * even ones the next. Panel bytes are the line headers and the RGB565
+ * pixels clocked out, whatever the format the CPU queued them in.
+ */
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "test.h"
+#include "gbcolors.h"
+#include "scaler.h"
+#include "ili9225_line.h"
+#include "lcd_line.h"
+
+#define WIDTH   160
+#define HEIGHT  144
+#define FRAMES  60
+
+static uint8_t background[2 * HEIGHT][WIDTH];
+static uint8_t frame[HEIGHT][WIDTH];
+static uint16_t __attribute__((aligned(4))) buf[ILI9225_SCREEN_WIDTH];
+static uint32_t sent_hash[HEIGHT];
+static palette_lut_t lut;
+
+static uint32_t draw_line(scaler_mode_e mode, int line)
+{
+    unsigned int words, width, rows = 1, header = LINE_HEADER_LENGTH;
+
+    if(mode == SCALER_MODE_NATIVE)
+    {
+        /* Native lines are queued as INDEXED4, with the longer header. */
+        lcd_line_indexed4(frame[line], (uint32_t *) buf, WIDTH);
+        words = WIDTH / 8;
+        width = WIDTH;
+        header = 8;
+    }
+    else
+    {
+        if(mode == SCALER_MODE_BLEND)
+            scaler_line_blend(lut, frame[line], buf);
+        else
+            scaler_line_nearest(lut, frame[line], buf);
+        words = SCALER_DST_WIDTH / 2;
+        width = SCALER_DST_WIDTH;
+        rows = scaler.y_count[line];
+    }
+
+    if(!lcd_line_changed(&sent_hash[line], lcd_line_hash(1, (const uint32_t *) buf, words)))
+        return 0;
+    return rows * (header + width) * sizeof(uint16_t);
+}
+
+/* Bytes sent for frame f, drawing only odd or even lines if interlaced. */
+static uint32_t draw_frame(scaler_mode_e mode, bool interlace, int f)
+{
+    uint32_t bytes = 0;
+    for(int line = 0; line < HEIGHT; line++)
+    {
+        if(interlace && (line & 1) == (f & 1))
+            continue;
+        bytes += draw_line(mode, line);
+    }
+    return bytes;
+}
+
+int main(void)
+{
+    static const char *names[] = { "native", "nearest", "blend" };
+    palette_t palette;
+    uint32_t seed = 8;
+
+    scaler_init();
+    get_colour_palette(palette, 0x1C, 0x03);
+    build_palette_lut(palette, lut);
+    for(int y = 0; y < 2 * HEIGHT; y++)
+        for(int x = 0; x < WIDTH; x++)
+            background[y][x] = ((test_rand(&seed) % 3) << 4) | (test_rand(&seed) & 3);
+
+    for(int mode = 0; mode < SCALER_MODE_COUNT; mode++)
+    {
+        uint32_t total[2] = { 0, 0 };
+        uint32_t pair = 0;
+
+        for(int interlace = 0; interlace < 2; interlace++)
+        {
+            memset(sent_hash, 0, sizeof(sent_hash));
+            for(int f = 0; f < FRAMES; f++)
+            {
+                /* Scrolling every frame, so no line is ever unchanged. */
+                for(int y = 0; y < HEIGHT; y++)
+                    memcpy(frame[y], background[y + f], WIDTH);
+                uint32_t bytes = draw_frame(mode, interlace, f);
+                total[interlace] += bytes;
+                if(interlace && f < 2)
+                    pair += bytes;
+            }
+        }
+
+        /* Two interlaced frames send exactly one progressive frame. */
+        CHECK_EQ(pair, total[0] / FRAMES);
+        CHECK_EQ(2 * total[1], total[0]);
+        printf("%-8s progressive %6u, interlaced %6u bytes/frame\n",
+                names[mode], total[0] / FRAMES, total[1] / FRAMES);
+
+        /* A still screen costs nothing once both fields are sent. */
+        for(int interlace = 0; interlace < 2; interlace++)
+        {
+            memset(sent_hash, 0, sizeof(sent_hash));
+            for(int f = 0; f < 4; f++)
+            {
+                uint32_t bytes = draw_frame(mode, interlace, f);
+                if(f >= 2)
+                    CHECK_EQ(bytes, 0);
+            }
+        }
+    }
+
+    return TEST_EXIT();
+}
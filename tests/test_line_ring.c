@@ -0,0 +1,155 @@
+/**
+ * Copyright (C) 2024 by Vlastimil Slintak <slintak@uart.cz>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+ * THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/**
+ * Runs the scanline ring bookkeeping against a simulated DMA.
+ * Each line takes a given number of ticks to convert and a fixed number of
+ * ticks to send. The simulation checks that lines reach the LCD once and in
+ * order, that a buffer is never refilled while it is queued or being sent,
+ * and that the DMA never idles while a line is queued.
+ */
+
+#include <stdbool.h>
+
+#include "test.h"
+#include "ili9225_line.h"
+
+#define DEPTH ILI9225_LINE_RING_DEPTH
+
+typedef struct {
+    uint32_t ticks;         /* Until the last line was sent */
+    uint32_t stalls;        /* Times the producer found the ring full */
+    uint32_t idle;          /* Ticks the DMA idled with lines still to come */
+} sim_result_t;
+
+static sim_result_t sim_run(const uint32_t *produce, int lines, uint32_t transfer)
+{
+    ili9225_line_ring_t ring = { 0 };
+    int slot[DEPTH];
+    int sending = -1, sent = 0, converting = -1, next = 0;
+    uint32_t done_at = 0, ready_at = 0;
+    bool stalled = false;
+    sim_result_t r = { 0 };
+
+    for(uint32_t now = 0; sent < lines; now++)
+    {
+        if(now > 1000000u)
+        {
+            CHECK(!"simulation did not finish");
+            break;
+        }
+
+        /* DMA completion IRQ. */
+        if(sending >= 0 && now == done_at)
+        {
+            CHECK_EQ(slot[ring.tail], sending);
+            CHECK_EQ(sending, sent);
+            sent++;
+            sending = -1;
+            if(ili9225_line_ring_pop(&ring))
+            {
+                sending = slot[ring.tail];
+                done_at = now + transfer;
+            }
+        }
+
+        /* Producer: ili9225_line_acquire(), convert, ili9225_line_submit(). */
+        if(converting >= 0 && now == ready_at)
+        {
+            if(ili9225_line_ring_push(&ring))
+            {
+                CHECK_EQ(sending, -1);
+                sending = slot[ring.tail];
+                done_at = now + transfer;
+            }
+            converting = -1;
+        }
+        if(converting < 0 && next < lines)
+        {
+            if(ili9225_line_ring_full(&ring))
+            {
+                if(!stalled)
+                    r.stalls++;
+                stalled = true;
+            }
+            else
+            {
+                stalled = false;
+                /* The buffer at head is neither queued nor being sent. */
+                CHECK(ring.queued < DEPTH);
+                CHECK(sending < 0 || slot[ring.tail] == sending);
+                slot[ring.head] = next;
+                converting = next++;
+                ready_at = now + produce[converting];
+            }
+        }
+
+        CHECK_EQ(ring.queued > 0, sending >= 0);
+        if(sending < 0 && sent < lines)
+            r.idle++;
+        r.ticks = now;
+    }
+
+    CHECK_EQ(sent, lines);
+    CHECK_EQ(ring.queued, 0);
+    CHECK_EQ(ring.head, ring.tail);
+    return r;
+}
+
+#define LINES (144 * 60)
+
+static uint32_t produce[LINES];
+
+int main(void)
+{
+    sim_result_t r;
+    uint32_t seed = 1;
+
+    /* Converting is faster than sending: the DMA never waits after the
+     * first line and the producer is held back by the ring. */
+    for(int i = 0; i < LINES; i++)
+        produce[i] = 3;
+    r = sim_run(produce, LINES, 5);
+    CHECK_EQ(r.idle, 3);
+    CHECK_EQ(r.ticks, 3 + LINES * 5);
+    CHECK(r.stalls > 0);
+
+    /* Converting is slower: the producer never waits. */
+    for(int i = 0; i < LINES; i++)
+        produce[i] = 7;
+    r = sim_run(produce, LINES, 5);
+    CHECK_EQ(r.stalls, 0);
+    CHECK_EQ(r.ticks, LINES * 7 + 5);
+
+    /* An expensive line followed by a burst of cheap ones: up to DEPTH - 1
+     * lines wait in the ring while the next one is converted. */
+    for(int i = 0; i < LINES; i++)
+        produce[i] = (i % (DEPTH - 1) == 0) ? 5 * DEPTH : 1;
+    r = sim_run(produce, LINES, 5);
+    CHECK_EQ(r.stalls, 0);
+    for(int i = 0; i < LINES; i++)
+        produce[i] = (i % DEPTH == 0) ? 5 * DEPTH : 1;
+    r = sim_run(produce, LINES, 5);
+    CHECK(r.stalls > 0);
+
+    /* Random conversion times around the transfer time. */
+    for(int i = 0; i < LINES; i++)
+        produce[i] = 1 + test_rand(&seed) % 10;
+    r = sim_run(produce, LINES, 5);
+    printf("random: %u ticks, %u stalls, %u idle\n", r.ticks, r.stalls, r.idle);
+
+    return TEST_EXIT();
+}
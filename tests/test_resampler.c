@@ -0,0 +1,179 @@
+/**
+ * Copyright (C) 2024 by Vlastimil Slintak <slintak@uart.cz>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+ * THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/**
+ * Quality and cost of the resampler. Sines are resampled from the APU rate
+ * to the output rates in use, and a sine of the known frequency is fitted
+ * to each output channel by least squares; what it does not explain is
+ * counted as noise. The input is fed in frame sized blocks as in
+ * audio_output_frame(). The benchmark times resampler_run() per output
+ * sample.
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include "test.h"
+#include "resampler.h"
+
+#define IN_RATE     32768u
+#define BLOCK       548u
+#define IN_SAMPLES  (BLOCK * 60)
+#define OUT_MAX     (IN_SAMPLES * 2)
+
+static uint32_t in[IN_SAMPLES];
+static uint32_t out[OUT_MAX];
+
+static unsigned int resample(uint32_t step, int32_t gain)
+{
+    resampler_t r;
+    unsigned int n = 0;
+
+    resampler_init(&r, step, gain);
+    for(unsigned int pos = 0; pos < IN_SAMPLES; )
+    {
+        unsigned int used, count = IN_SAMPLES - pos < BLOCK ? IN_SAMPLES - pos : BLOCK;
+        const uint32_t *p = in + pos;
+        pos += count;
+        while(count > 0)
+        {
+            n += resampler_run(&r, p, count, out + n, OUT_MAX - n, &used);
+            p += used;
+            count -= used;
+        }
+    }
+    return n;
+}
+
+/* SNR in dB of one channel of out[] against the best fitting sine of
+ * frequency hz at rate, skipping the start. */
+static double snr(unsigned int count, unsigned int shift, double hz, double rate)
+{
+    /* Normal equations for a*sin + b*cos + c. */
+    double m[3][4] = { { 0 } };
+    const unsigned int skip = 64;
+    for(unsigned int i = skip; i < count; i++)
+    {
+        double w = 2 * M_PI * hz * i / rate;
+        double v[3] = { sin(w), cos(w), 1 };
+        double y = (int16_t) (out[i] >> shift);
+        for(int r = 0; r < 3; r++)
+        {
+            for(int c = 0; c < 3; c++)
+                m[r][c] += v[r] * v[c];
+            m[r][3] += v[r] * y;
+        }
+    }
+    for(int p = 0; p < 3; p++)
+        for(int r = 0; r < 3; r++)
+        {
+            if(r == p)
+                continue;
+            double f = m[r][p] / m[p][p];
+            for(int c = 0; c < 4; c++)
+                m[r][c] -= f * m[p][c];
+        }
+    double a = m[0][3] / m[0][0], b = m[1][3] / m[1][1], c = m[2][3] / m[2][2];
+
+    double signal = 0, noise = 0;
+    for(unsigned int i = skip; i < count; i++)
+    {
+        double w = 2 * M_PI * hz * i / rate;
+        double fit = a * sin(w) + b * cos(w) + c;
+        double e = (int16_t) (out[i] >> shift) - fit;
+        signal += fit * fit;
+        noise += e * e;
+    }
+    return 10 * log10(signal / noise);
+}
+
+static void make_sine(double hz, double amplitude)
+{
+    for(unsigned int i = 0; i < IN_SAMPLES; i++)
+    {
+        double w = 2 * M_PI * hz * i / IN_RATE;
+        int16_t l = (int16_t) lrint(amplitude * sin(w));
+        int16_t r = (int16_t) lrint(-amplitude * sin(w));
+        in[i] = (uint16_t) l | ((uint32_t) (uint16_t) r << 16);
+    }
+}
+
+int main(void)
+{
+    /* The rate control keeps the step within 5000 ppm of 1, the others
+     * are the usual DAC rates. */
+    static const uint32_t rates[3] = { 32768u - 37u, 44100u, 48000u };
+    static const double freqs[4] = { 110, 1000, 4000, 10000 };
+    /* The error is mostly the position rounded down to one of 64 phases,
+     * which grows with the frequency whatever the output rate, and at the
+     * top the cubic itself. Measured 79.9, 61.2, 43.2 and 17.3 dB. */
+    static const double min_snr[4] = { 78, 60, 42, 16 };
+
+    printf("SNR in dB       ");
+    for(int f = 0; f < 4; f++)
+        printf("%8.0f Hz", freqs[f]);
+    printf("\n");
+    for(unsigned int r = 0; r < 3; r++)
+    {
+        uint32_t step = resampler_step(IN_RATE, rates[r]);
+        printf("%5u Hz output ", rates[r]);
+        for(int f = 0; f < 4; f++)
+        {
+            make_sine(freqs[f], 16000);
+            unsigned int n = resample(step, 32768);
+            CHECK(fabs(n - (double) IN_SAMPLES * rates[r] / IN_RATE) < 4);
+            double left = snr(n, 0, freqs[f], (double) IN_RATE * RESAMPLER_ONE / step);
+            double right = snr(n, 16, freqs[f], (double) IN_RATE * RESAMPLER_ONE / step);
+            printf("%11.1f", left);
+            CHECK(left > min_snr[f]);
+            CHECK(fabs(left - right) < 3);
+        }
+        printf("\n");
+    }
+
+    /* Gain folded into the taps: half gain halves the output, full scale
+     * input at gain 2 saturates instead of wrapping around. */
+    make_sine(1000, 16000);
+    unsigned int n = resample(RESAMPLER_ONE, 16384);
+    int16_t peak = 0;
+    for(unsigned int i = 64; i < n; i++)
+        peak = (int16_t) out[i] > peak ? (int16_t) out[i] : peak;
+    CHECK(peak >= 7900 && peak <= 8100);
+    make_sine(1000, 32767);
+    n = resample(resampler_step(IN_RATE, 48000), 65535);
+    for(unsigned int i = 64; i < n; i++)
+    {
+        int16_t v = (int16_t) out[i];
+        int16_t prev = (int16_t) out[i - 1];
+        /* A wrapped sample would jump across the whole range. */
+        CHECK(abs(v - prev) < 20000);
+    }
+
+    /* Cost per output sample. */
+    make_sine(1000, 16000);
+    for(unsigned int r = 0; r < 3; r++)
+    {
+        uint32_t step = resampler_step(IN_RATE, rates[r]);
+        uint64_t start = test_now_ns();
+        unsigned int total = 0;
+        for(int i = 0; i < 20; i++)
+            total += resample(step, 32768);
+        printf("%5u Hz output: %.2f ns/sample\n", rates[r],
+                (double) (test_now_ns() - start) / total);
+    }
+
+    return TEST_EXIT();
+}
@@ -0,0 +1,134 @@
+/**
+ * Copyright (C) 2024 by Vlastimil Slintak <slintak@uart.cz>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+ * THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/**
+ * Checks that reads through the rom_cache page table return the image's
+ * bytes, also after banks have been promoted and for addresses past the
+ * image or past 4 MB, and that a fetch trace reads the same bytes through
+ * the table as through the compare on rom_bank0 that gb_rom_read() used
+ * before it.
+ *
+ * This is a correctness test, not a performance benchmark. The trace is
+ * synthetic, mostly sequential fetches, 60% of them from banks 0-3 and the
+ * rest from a switched bank, not recorded from a real ROM. The two reads
+ * are timed on it only to show they are of the same order on the host;
+ * what the table saves on the target needs an RP2040 build.
+ */
+
+#include <string.h>
+
+#define ROM_CACHE_FIRST_BANK 4u
+#include "test.h"
+#include "rom_cache.h"
+
+#define BANKS       64u
+#define FETCHES     (1u << 22)
+#define ROUNDS      8
+
+static uint8_t image[BANKS * ROM_CACHE_BANK_SIZE];
+static uint8_t rom_bank0[ROM_CACHE_FIRST_BANK * ROM_CACHE_BANK_SIZE];
+static rom_cache_t cache;
+static const uint8_t *rom = image;
+
+/* The read gb_rom_read() did before the page table. */
+static __attribute__((noinline)) uint8_t read_compare(uint32_t addr)
+{
+    if(addr < sizeof(rom_bank0))
+        return rom_bank0[addr];
+    return rom[addr];
+}
+
+static __attribute__((noinline)) uint8_t read_table(uint32_t addr)
+{
+    return rom_cache_read(&cache, addr);
+}
+
+int main(void)
+{
+    uint32_t seed = 3;
+    volatile unsigned int sink = 0;
+
+    for(uint32_t i = 0; i < sizeof(image); i++)
+        image[i] = (i * 2654435761u) >> 13;
+    memcpy(rom_bank0, image, sizeof(rom_bank0));
+    rom_cache_init(&cache, image, BANKS, rom_bank0);
+
+    for(unsigned int r = 0; r < 40; r++)
+    {
+        unsigned int bank = ROM_CACHE_FIRST_BANK + r * 7 % (BANKS - ROM_CACHE_FIRST_BANK);
+        for(int k = 0; k < 200; k++)
+            rom_cache_sample(&cache, bank);
+        rom_cache_update(&cache, bank);
+
+        unsigned int wrong = 0;
+        for(uint32_t a = 0; a < sizeof(image); a++)
+            wrong += read_table(a) != image[a];
+        CHECK_EQ(wrong, 0);
+    }
+    CHECK(cache.promotions > 0);
+
+    /* Banks past the image repeat it, addresses past the table wrap. */
+    for(uint32_t a = sizeof(image); a < 2 * sizeof(image); a += 4093)
+        CHECK_EQ(read_table(a), image[a % sizeof(image)]);
+    for(uint32_t a = ROM_CACHE_PAGES * ROM_CACHE_PAGE_SIZE; a < 0x1000000u; a += 65521)
+        CHECK_EQ(read_table(a), read_table(a % (ROM_CACHE_PAGES * ROM_CACHE_PAGE_SIZE)));
+
+    uint32_t *trace = malloc(FETCHES * sizeof(*trace));
+    CHECK(trace != NULL);
+    if(trace == NULL)
+        return TEST_EXIT();
+
+    uint32_t pc = 0x150;
+    unsigned int bank = 5;
+    for(uint32_t i = 0; i < FETCHES; i++)
+    {
+        uint32_t r = test_rand(&seed) % 100;
+        if(r < 2)
+            pc = test_rand(&seed) % 0x8000;
+        else if(r < 3)
+            bank = ROM_CACHE_FIRST_BANK + test_rand(&seed) % (BANKS - ROM_CACHE_FIRST_BANK);
+        else
+            pc = (pc + 1) & 0x7FFF;
+        trace[i] = pc < 0x4000 ? pc : pc - 0x4000 + bank * ROM_CACHE_BANK_SIZE;
+    }
+
+    unsigned int sum_compare = 0;
+    uint64_t start = test_now_ns();
+    for(int r = 0; r < ROUNDS; r++)
+        for(uint32_t i = 0; i < FETCHES; i++)
+            sum_compare += read_compare(trace[i]);
+    uint64_t compare_ns = test_now_ns() - start;
+
+    unsigned int sum_table = 0;
+    start = test_now_ns();
+    for(int r = 0; r < ROUNDS; r++)
+        for(uint32_t i = 0; i < FETCHES; i++)
+            sum_table += read_table(trace[i]);
+    uint64_t table_ns = test_now_ns() - start;
+
+    CHECK_EQ(sum_compare, sum_table);
+    sink += sum_compare + sum_table;
+    free(trace);
+
+    double reads = (double) ROUNDS * FETCHES;
+    printf("%u promotions\n", cache.promotions);
+    printf("host, synthetic trace, not a benchmark:\n");
+    printf("rom_bank0 compare: %.2f ns/read\n", compare_ns / reads);
+    printf("page table:        %.2f ns/read\n", table_ns / reads);
+    (void) sink;
+
+    return TEST_EXIT();
+}
@@ -0,0 +1,296 @@
+/**
+ * Copyright (C) 2024 by Vlastimil Slintak <slintak@uart.cz>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+ * THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/**
+ * Replays a trace of the bank mapped at 0x4000 through rom_cache, sampled
+ * as the emulator does: on every drawn line, then rom_cache_update() once
+ * per frame with the bank mapped at its end. Reports the share of samples
+ * served from SRAM and the banks copied, next to a cache that copies a
+ * bank in on every switch to it.
+ *
+ * The committed trace, data/rom_cache_trace.txt, is synthetic: no traces
+ * of real games were recorded. It is made by this program:
+ *   test_rom_cache_replay --synthesize > data/rom_cache_trace.txt
+ * A trace is a list of scenarios, each line of one repeated for a number of
+ * frames and giving the bank and line count of each run of lines:
+ *   scenario <name>
+ *   <frames> <bank>:<lines> ...
+ * ROM_CACHE_MIN_GAIN, ROM_CACHE_SWITCH_BONUS and ROM_CACHE_FRAMES can be
+ * overridden with -D to compare other tunings on the same trace.
+ */
+
+#include <string.h>
+
+#define ROM_CACHE_FIRST_BANK 4u
+#include "test.h"
+#include "rom_cache.h"
+
+#define BANKS       64u
+#define LINES       144u
+#define MAX_RUNS    16u
+#define MAX_SCENARIOS 8u
+
+static uint8_t image[BANKS * ROM_CACHE_BANK_SIZE];
+static uint8_t fixed[ROM_CACHE_FIRST_BANK * ROM_CACHE_BANK_SIZE];
+static rom_cache_t cache;
+
+typedef struct {
+    char name[32];
+    unsigned long samples, hits, promotions;
+    unsigned long switch_hits, switch_copies;
+    unsigned int frames;
+} result_t;
+
+static void emit(unsigned int frames, const unsigned int *bank,
+        const unsigned int *lines, unsigned int runs)
+{
+    printf("%u", frames);
+    for(unsigned int r = 0; r < runs; r++)
+        printf(" %u:%u", bank[r], lines[r]);
+    printf("\n");
+}
+
+/**
+ * Writes the synthetic trace: a minute of each kind of access the cache
+ * is meant to catch, and some of one it cannot.
+ */
+static void synthesize(void)
+{
+    unsigned int bank[MAX_RUNS], lines[MAX_RUNS];
+    uint32_t seed = 1;
+
+    printf("# Synthetic bank trace, not recorded from a game. See test_rom_cache_replay.c.\n");
+
+    /* A level bank for most of the frame and a music bank in the middle,
+     * the level changing every ten seconds. */
+    printf("scenario levels\n");
+    for(unsigned int level = 0; level < 6; level++)
+    {
+        bank[0] = 8 + level;
+        lines[0] = 60;
+        bank[1] = 5;
+        lines[1] = 20;
+        bank[2] = 8 + level;
+        lines[2] = 64;
+        emit(600, bank, lines, 3);
+    }
+
+    /* Three banks in turn every frame, more than there are frames. */
+    printf("scenario rotation\n");
+    for(unsigned int r = 0; r < 3; r++)
+    {
+        bank[r] = 10 + r;
+        lines[r] = 48;
+    }
+    emit(3600, bank, lines, 3);
+
+    /* A menu bank, with a burst of another bank for 10 frames every 100. */
+    printf("scenario bursts\n");
+    for(unsigned int i = 0; i < 36; i++)
+    {
+        bank[0] = 20;
+        lines[0] = LINES;
+        emit(90, bank, lines, 1);
+        bank[0] = 21 + i % 4;
+        emit(10, bank, lines, 1);
+    }
+
+    /* Six banks at random every frame, for 10 s. */
+    printf("scenario scatter\n");
+    for(unsigned int f = 0; f < 600; f++)
+    {
+        for(unsigned int r = 0; r < 6; r++)
+        {
+            bank[r] = 4 + test_rand(&seed) % (BANKS - 4);
+            lines[r] = LINES / 6;
+        }
+        emit(1, bank, lines, 6);
+    }
+}
+
+/* Baseline: the last ROM_CACHE_FRAMES banks switched to are in SRAM. */
+static uint16_t lru[ROM_CACHE_FRAMES];
+static unsigned long lru_age[ROM_CACHE_FRAMES];
+static unsigned long lru_clock;
+
+static void switch_sample(result_t *res, unsigned int b)
+{
+    unsigned int f, oldest = 0;
+
+    if(b < ROM_CACHE_FIRST_BANK)
+        return;
+    for(f = 0; f < ROM_CACHE_FRAMES; f++)
+    {
+        if(lru[f] == b)
+            break;
+        if(lru_age[f] < lru_age[oldest])
+            oldest = f;
+    }
+    if(f == ROM_CACHE_FRAMES)
+    {
+        f = oldest;
+        lru[f] = b;
+        res->switch_copies++;
+    }
+    else
+        res->switch_hits++;
+    lru_age[f] = ++lru_clock;
+}
+
+static void start(result_t *res, const char *name)
+{
+    memset(res, 0, sizeof(*res));
+    snprintf(res->name, sizeof(res->name), "%s", name);
+    rom_cache_init(&cache, image, BANKS, fixed);
+    for(unsigned int f = 0; f < ROM_CACHE_FRAMES; f++)
+    {
+        lru[f] = ROM_CACHE_NO_BANK;
+        lru_age[f] = 0;
+    }
+}
+
+static void finish(result_t *res)
+{
+    res->samples = cache.hits + cache.misses;
+    res->hits = cache.hits;
+    res->promotions = cache.promotions;
+}
+
+/**
+ * Replays the trace file, returns the number of scenarios read.
+ */
+static unsigned int replay(const char *path, result_t *results)
+{
+    char line[512];
+    unsigned int count = 0;
+    FILE *f = fopen(path, "r");
+
+    if(f == NULL)
+    {
+        perror(path);
+        return 0;
+    }
+    while(fgets(line, sizeof(line), f) != NULL)
+    {
+        char name[32];
+        char *p = line;
+        unsigned int frames, bank[MAX_RUNS], lines[MAX_RUNS], runs = 0;
+        int used;
+
+        if(line[0] == '#' || line[0] == '\n')
+            continue;
+        if(sscanf(line, "scenario %31s", name) == 1)
+        {
+            if(count > 0)
+                finish(&results[count - 1]);
+            if(count == MAX_SCENARIOS)
+                break;
+            start(&results[count++], name);
+            continue;
+        }
+        if(count == 0 || sscanf(p, "%u%n", &frames, &used) != 1)
+        {
+            fprintf(stderr, "%s: bad line: %s", path, line);
+            continue;
+        }
+        p += used;
+        while(runs < MAX_RUNS && sscanf(p, " %u:%u%n", &bank[runs], &lines[runs], &used) == 2)
+        {
+            p += used;
+            runs++;
+        }
+        if(runs == 0)
+            continue;
+
+        result_t *res = &results[count - 1];
+        for(unsigned int i = 0; i < frames; i++)
+        {
+            for(unsigned int r = 0; r < runs; r++)
+                for(unsigned int l = 0; l < lines[r]; l++)
+                {
+                    rom_cache_sample(&cache, bank[r]);
+                    switch_sample(res, bank[r]);
+                }
+            rom_cache_update(&cache, bank[runs - 1]);
+            res->frames++;
+        }
+    }
+    if(count > 0)
+        finish(&results[count - 1]);
+    fclose(f);
+    return count;
+}
+
+static const result_t *find(const result_t *results, unsigned int count, const char *name)
+{
+    for(unsigned int i = 0; i < count && i < MAX_SCENARIOS; i++)
+        if(strcmp(results[i].name, name) == 0)
+            return &results[i];
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    static result_t results[MAX_SCENARIOS];
+    const char *path = "data/rom_cache_trace.txt";
+
+    if(argc > 1 && strcmp(argv[1], "--synthesize") == 0)
+    {
+        synthesize();
+        return 0;
+    }
+    if(argc > 1)
+        path = argv[1];
+
+    printf("MIN_GAIN %u, SWITCH_BONUS %u, %u frames\n",
+            ROM_CACHE_MIN_GAIN, ROM_CACHE_SWITCH_BONUS, ROM_CACHE_FRAMES);
+    unsigned int count = replay(path, results);
+    CHECK(count > 0);
+    for(unsigned int i = 0; i < count; i++)
+    {
+        const result_t *r = &results[i];
+        unsigned long all = r->switch_hits + r->switch_copies;
+        printf("%-10s %5u frames: %5.1f%% in SRAM, %4lu copies | copy on switch: %5.1f%%, %6lu copies\n",
+                r->name, r->frames,
+                r->samples ? 100.0 * r->hits / r->samples : 0.0, r->promotions,
+                all ? 100.0 * r->switch_hits / all : 0.0, r->switch_copies);
+    }
+
+    /* Only the committed trace with the default tuning has known results. */
+    if(argc > 1 || ROM_CACHE_MIN_GAIN != 128u || ROM_CACHE_SWITCH_BONUS != 256u ||
+            ROM_CACHE_FRAMES != 2u)
+        return TEST_EXIT();
+
+    const result_t *levels = find(results, count, "levels");
+    const result_t *rotation = find(results, count, "rotation");
+    const result_t *bursts = find(results, count, "bursts");
+    const result_t *scatter = find(results, count, "scatter");
+    CHECK(levels && rotation && bursts && scatter);
+    if(!(levels && rotation && bursts && scatter))
+        return TEST_EXIT();
+    CHECK(levels->hits * 100 > levels->samples * 98);
+    CHECK(levels->promotions < 20);
+    /* Two frames can hold two of the three banks at best. */
+    CHECK(rotation->hits * 100 > rotation->samples * 65);
+    CHECK(rotation->promotions < 10);
+    CHECK(rotation->switch_copies > rotation->frames);
+    CHECK(bursts->hits * 100 > bursts->samples * 85);
+    /* Scattered banks cannot be cached, copying them must stay rare. */
+    CHECK(scatter->promotions < scatter->frames / 2);
+    CHECK(scatter->promotions * 4 < scatter->switch_copies);
+
+    return TEST_EXIT();
+}
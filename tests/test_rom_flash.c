@@ -0,0 +1,186 @@
+/**
+ * Copyright (C) 2024 by Vlastimil Slintak <slintak@uart.cz>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+ * THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/**
+ * Copies files through rom_flash_copy() from a simulated SD card into a
+ * simulated flash. The card returns short reads at random, as FatFs does
+ * across cluster boundaries, and can fail part way. The flash behaves like
+ * the real one: erase sets whole sectors to 0xFF, programming takes whole
+ * pages and can only clear bits, and a program is started only once the
+ * previous one is done. The copy has to match the file, with its CRC32,
+ * erase no more than the sectors the image covers and read the next chunk
+ * while the previous one is programmed.
+ */
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "test.h"
+#include "rom_flash.h"
+
+#define FLASH_SIZE  (2u * 1024 * 1024)
+#define FILE_MAX    (1024u * 1024)
+
+static uint8_t flash[FLASH_SIZE];
+static uint8_t file[FILE_MAX];
+
+typedef struct {
+    uint32_t size;
+    uint32_t pos;
+    uint32_t fail_at;       /* Reads fail from here on */
+    uint32_t seed;
+    bool short_reads;
+    bool busy;              /* A program was started and not waited for */
+    unsigned int overlapped;    /* Reads while a program was running */
+    unsigned int erased;
+} sim_t;
+
+static uint32_t sim_read(void *ctx, uint8_t *buf, uint32_t len)
+{
+    sim_t *s = ctx;
+    uint32_t n = s->size - s->pos < len ? s->size - s->pos : len;
+
+    if(s->short_reads && n > 1)
+        n = 1 + test_rand(&s->seed) % n;
+    if(s->pos + n > s->fail_at)
+        return 0;
+    memcpy(buf, file + s->pos, n);
+    s->pos += n;
+    s->overlapped += s->busy;
+    return n;
+}
+
+static void sim_program_start(void *ctx, uint32_t erase_offset, uint32_t erase_len,
+        uint32_t offset, const uint8_t *buf, uint32_t len)
+{
+    sim_t *s = ctx;
+
+    CHECK(!s->busy);
+    if(erase_len != 0)
+    {
+        CHECK_EQ(erase_offset % ROM_FLASH_SECTOR, 0);
+        CHECK_EQ(erase_len % ROM_FLASH_SECTOR, 0);
+        CHECK(erase_offset + erase_len <= FLASH_SIZE);
+        memset(flash + erase_offset, 0xFF, erase_len);
+        s->erased += erase_len;
+    }
+    CHECK_EQ(offset % ROM_FLASH_PAGE, 0);
+    CHECK_EQ(len % ROM_FLASH_PAGE, 0);
+    CHECK(offset + len <= FLASH_SIZE);
+    for(uint32_t i = 0; i < len; i++)
+    {
+        /* Programming an unerased byte would merge the bits. */
+        CHECK(flash[offset + i] == 0xFF);
+        flash[offset + i] &= buf[i];
+    }
+    s->busy = true;
+}
+
+static void sim_program_wait(void *ctx)
+{
+    sim_t *s = ctx;
+    CHECK(s->busy);
+    s->busy = false;
+}
+
+/* Copies a file of size bytes to offset, returns the bytes copied. */
+static uint32_t copy(uint32_t offset, uint32_t size, bool short_reads, uint32_t fail_at,
+        sim_t *s, uint32_t *crc)
+{
+    static uint8_t chunk[2][ROM_FLASH_CHUNK];
+    uint8_t *buf[2] = { chunk[0], chunk[1] };
+    const rom_flash_ops_t ops = {
+        .read = sim_read,
+        .program_start = sim_program_start,
+        .program_wait = sim_program_wait,
+        .progress = NULL,
+        .ctx = s,
+    };
+
+    *s = (sim_t) { .size = size, .fail_at = fail_at, .seed = size, .short_reads = short_reads };
+    /* Old contents, which must be erased before programming. */
+    memset(flash, 0x5A, FLASH_SIZE);
+    for(uint32_t i = 0; i < size; i++)
+        file[i] = (uint8_t) (i * 7 + (i >> 8) * 13);
+
+    uint32_t copied = rom_flash_copy(&ops, offset, size, buf, crc);
+    CHECK(!s->busy);
+    return copied;
+}
+
+int main(void)
+{
+    /* The table gives the standard check value. */
+    CHECK_EQ(rom_flash_crc32(0, (const uint8_t *) "123456789", 9), 0xCBF43926u);
+    for(uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t c = i;
+        for(unsigned int k = 0; k < 8; k++)
+            c = (c & 1) ? (c >> 1) ^ 0xEDB88320u : c >> 1;
+        CHECK_EQ(rom_flash_crc_table[i], c);
+    }
+    /* Running over pieces is the same as over the whole. */
+    CHECK_EQ(rom_flash_crc32(rom_flash_crc32(0, (const uint8_t *) "1234", 4),
+                (const uint8_t *) "56789", 5), 0xCBF43926u);
+
+    static const uint32_t sizes[] = {
+        1, 255, 256, 4097, 32768, 65536, 65536 + 100, 3 * ROM_FLASH_CHUNK + 1, FILE_MAX,
+    };
+    static const uint32_t offsets[] = { 0x10000, 0x13000 };
+    for(unsigned int z = 0; z < sizeof(sizes) / sizeof(sizes[0]); z++)
+        for(unsigned int o = 0; o < 2; o++)
+            for(int short_reads = 0; short_reads < 2; short_reads++)
+            {
+                uint32_t size = sizes[z], offset = offsets[o], crc;
+                uint32_t end = offset + (size + ROM_FLASH_SECTOR - 1) / ROM_FLASH_SECTOR * ROM_FLASH_SECTOR;
+                sim_t s;
+
+                CHECK_EQ(copy(offset, size, short_reads, UINT32_MAX, &s, &crc), size);
+                CHECK(memcmp(flash + offset, file, size) == 0);
+                CHECK_EQ(crc, rom_flash_crc32(0, file, size));
+                /* Exactly the sectors of the image are erased, the rest of
+                 * the last one is left erased. */
+                CHECK_EQ(s.erased, end - offset);
+                CHECK(flash[offset - 1] == 0x5A && flash[end] == 0x5A);
+                for(uint32_t i = offset + size; i < end; i++)
+                    CHECK(flash[i] == 0xFF);
+                /* Every chunk after the first is read while the one before
+                 * it is programmed. */
+                if(size > ROM_FLASH_CHUNK)
+                    CHECK(s.overlapped > 0);
+            }
+
+    /* A read error ends the copy short, with the CRC of what was copied. */
+    {
+        uint32_t crc;
+        sim_t s;
+        uint32_t copied = copy(0x10000, FILE_MAX, true, 100000, &s, &crc);
+        CHECK(copied < 100000);
+        CHECK_EQ(crc, rom_flash_crc32(0, file, copied));
+        CHECK(memcmp(flash + 0x10000, file, copied) == 0);
+    }
+
+    /* An empty file copies nothing and erases nothing. */
+    {
+        uint32_t crc;
+        sim_t s;
+        CHECK_EQ(copy(0x10000, 0, false, UINT32_MAX, &s, &crc), 0);
+        CHECK_EQ(crc, 0);
+        CHECK_EQ(s.erased, 0);
+    }
+
+    return TEST_EXIT();
+}
@@ -0,0 +1,113 @@
+/**
+ * Copyright (C) 2024 by Vlastimil Slintak <slintak@uart.cz>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+ * THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/**
+ * ROM records: a record is only valid once completely written, erased or
+ * torn flash is not, and a file is only taken for a resident image when
+ * its name, size and header checksums all match. The layout is checked
+ * too, records written by one build are read by the next.
+ */
+
+#include <string.h>
+
+#include "test.h"
+#include "rom_meta.h"
+
+static uint8_t header[ROM_META_HEADER_LENGTH];
+
+int main(void)
+{
+    rom_meta_t meta, copy;
+
+    CHECK_EQ(offsetof(rom_meta_t, size), 4);
+    CHECK_EQ(offsetof(rom_meta_t, crc32), 8);
+    CHECK_EQ(offsetof(rom_meta_t, header_checksum), 12);
+    CHECK_EQ(offsetof(rom_meta_t, global_checksum), 14);
+    CHECK_EQ(offsetof(rom_meta_t, offset), 16);
+    CHECK_EQ(offsetof(rom_meta_t, last_used), 20);
+    CHECK_EQ(offsetof(rom_meta_t, filename), 24);
+    CHECK_EQ(offsetof(rom_meta_t, record_crc), ROM_META_SIZE - 4);
+
+    header[0x14D] = 0x9A;
+    header[0x14E] = 0x12;
+    header[0x14F] = 0x34;
+    rom_meta_init(&meta, "tetris.gb", 32768, header, 0xDEADBEEF, 0x20000);
+    CHECK(rom_meta_valid(&meta));
+    CHECK_EQ(meta.header_checksum, 0x9A);
+    CHECK_EQ(meta.global_checksum, 0x1234);
+    CHECK_EQ(meta.last_used, 0);
+    CHECK(rom_meta_matches(&meta, "tetris.gb", 32768, header));
+
+    /* Anything that differs is another file. */
+    CHECK(!rom_meta_matches(&meta, "tetris2.gb", 32768, header));
+    CHECK(!rom_meta_matches(&meta, "tetris.g", 32768, header));
+    CHECK(!rom_meta_matches(&meta, "tetris.gb", 65536, header));
+    header[0x14D] ^= 1;
+    CHECK(!rom_meta_matches(&meta, "tetris.gb", 32768, header));
+    header[0x14D] ^= 1;
+    header[0x14F] ^= 0x80;
+    CHECK(!rom_meta_matches(&meta, "tetris.gb", 32768, header));
+    header[0x14F] ^= 0x80;
+    CHECK(rom_meta_matches(&meta, "tetris.gb", 32768, header));
+
+    /* Erased flash and a record cut short or damaged in any byte. */
+    memset(&copy, 0xFF, sizeof(copy));
+    CHECK(!rom_meta_valid(&copy));
+    memset(&copy, 0, sizeof(copy));
+    CHECK(!rom_meta_valid(&copy));
+    for(unsigned int i = 0; i < sizeof(meta); i++)
+    {
+        copy = meta;
+        ((uint8_t *) &copy)[i] ^= 0x01;
+        CHECK(!rom_meta_valid(&copy));
+        CHECK(!rom_meta_matches(&copy, "tetris.gb", 32768, header));
+    }
+    for(unsigned int cut = 0; cut < sizeof(meta); cut += 16)
+    {
+        memset(&copy, 0xFF, sizeof(copy));
+        memcpy(&copy, &meta, cut);
+        CHECK(!rom_meta_valid(&copy));
+    }
+
+    /* Changed fields are only valid again once resealed. */
+    copy = meta;
+    copy.last_used = 7;
+    CHECK(!rom_meta_valid(&copy));
+    rom_meta_seal(&copy);
+    CHECK(rom_meta_valid(&copy));
+    CHECK(rom_meta_matches(&copy, "tetris.gb", 32768, header));
+
+    /* Long names are cut to fit and keep their terminator, so they match
+     * by the part that was kept. */
+    char name[300];
+    memset(name, 'a', sizeof(name) - 1);
+    name[sizeof(name) - 1] = '\0';
+    rom_meta_init(&meta, name, 32768, header, 0, 0);
+    CHECK(rom_meta_valid(&meta));
+    CHECK_EQ(meta.filename[ROM_META_NAME_LENGTH - 1], '\0');
+    CHECK_EQ(strlen(meta.filename), ROM_META_NAME_LENGTH - 1);
+    CHECK(rom_meta_matches(&meta, name, 32768, header));
+    name[ROM_META_NAME_LENGTH - 2] = 'b';
+    CHECK(!rom_meta_matches(&meta, name, 32768, header));
+
+    /* The rest of the name field is zeroed, so equal records seal equal. */
+    rom_meta_init(&meta, "a.gb", 1, header, 0, 0);
+    memset(&copy, 0x55, sizeof(copy));
+    rom_meta_init(&copy, "a.gb", 1, header, 0, 0);
+    CHECK(memcmp(&meta, &copy, sizeof(meta)) == 0);
+
+    return TEST_EXIT();
+}
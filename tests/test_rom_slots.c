@@ -0,0 +1,254 @@
+/**
+ * Copyright (C) 2024 by Vlastimil Slintak <slintak@uart.cz>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+ * THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/**
+ * Slot allocation over a simulated index, as load_cart_rom_file() drives
+ * it: first fit, least recently used eviction, fragmentation of the
+ * region, running out of records, and a damaged image being reloaded into
+ * its own slot. A random workload of games played at different rates then
+ * checks after every load that images are aligned, inside the region and
+ * do not overlap, and reports how often the index sector is erased and
+ * programmed and how often each 64 KB block of the region is erased.
+ */
+
+#include <string.h>
+
+#include "test.h"
+#include "rom_slots.h"
+
+#define KB          1024u
+#define START       (1024u * KB)
+#define END         (2048u * KB)
+#define BLOCKS      ((END - START) / ROM_SLOTS_ALIGN)
+
+/* The index sector in flash, and the copy in RAM loads work on. */
+static rom_slots_t flash, slots;
+static unsigned int index_erases, index_programs, programs;
+static unsigned int block_erases[BLOCKS];
+static uint8_t header[ROM_META_HEADER_LENGTH];
+
+static void reset(void)
+{
+    /* Erased flash, no valid records. */
+    memset(&flash, 0xFF, sizeof(flash));
+    memset(&slots, 0xFF, sizeof(slots));
+}
+
+/**
+ * Writes the index as write_rom_index() does. Programming can only clear
+ * bits, so the flash has to end up equal to slots either way.
+ */
+static void write_index(void)
+{
+    if(memcmp(&slots, &flash, sizeof(slots)) == 0)
+        return;
+    if(!rom_slots_programmable(&flash, &slots))
+    {
+        memset(&flash, 0xFF, sizeof(flash));
+        index_erases++;
+    }
+    for(unsigned int i = 0; i < sizeof(flash); i++)
+        ((uint8_t *) &flash)[i] &= ((const uint8_t *) &slots)[i];
+    index_programs++;
+    CHECK(memcmp(&slots, &flash, sizeof(slots)) == 0);
+}
+
+/* Header of game number g, so each game has its own checksums. */
+static const uint8_t *game_header(unsigned int g)
+{
+    header[0x14D] = (uint8_t) g;
+    header[0x14E] = (uint8_t) (g * 31);
+    return header;
+}
+
+static const char *game_name(unsigned int g)
+{
+    static char name[16];
+    snprintf(name, sizeof(name), "game%02u.gb", g);
+    return name;
+}
+
+static void check_layout(void)
+{
+    unsigned int valid = 0;
+    for(unsigned int i = 0; i < ROM_SLOTS_ENTRIES; i++)
+    {
+        const rom_meta_t *a = &slots.entry[i];
+        if(!rom_meta_valid(a))
+            continue;
+        valid++;
+        CHECK_EQ(a->offset % ROM_SLOTS_ALIGN, 0);
+        CHECK(a->offset >= START && a->offset + rom_slots_length(a->size) <= END);
+        for(unsigned int j = i + 1; j < ROM_SLOTS_ENTRIES; j++)
+        {
+            const rom_meta_t *b = &slots.entry[j];
+            if(rom_meta_valid(b))
+                CHECK(a->offset + rom_slots_length(a->size) <= b->offset ||
+                      b->offset + rom_slots_length(b->size) <= a->offset);
+        }
+    }
+    CHECK(valid <= ROM_SLOTS_ENTRIES);
+}
+
+/**
+ * Loads game g of size bytes the way load_cart_rom_file() does and returns
+ * its offset. damaged makes a resident copy fail its CRC check. Counts the
+ * images programmed and the blocks erased for them.
+ */
+static int load(unsigned int g, uint32_t size, bool damaged, uint32_t *offset)
+{
+    unsigned int erases = index_erases;
+    memcpy(&slots, &flash, sizeof(slots));
+    int slot = rom_slots_find(&slots, game_name(g), size, game_header(g));
+    if(slot >= 0)
+    {
+        if(!damaged)
+        {
+            if(rom_slots_touch(&slots, slot))
+                write_index();
+            *offset = slots.entry[slot].offset;
+            return slot;
+        }
+        slots.entry[slot].magic = 0;
+    }
+    slot = rom_slots_alloc(&slots, START, END, size, offset);
+    if(slot < 0)
+        return -1;
+    write_index();
+    programs++;
+    for(uint32_t pos = 0; pos < size; pos += ROM_SLOTS_ALIGN)
+        block_erases[(*offset + pos - START) / ROM_SLOTS_ALIGN]++;
+    rom_meta_init(&slots.entry[slot], game_name(g), size, game_header(g), 0, *offset);
+    rom_slots_touch(&slots, slot);
+    write_index();
+    /* The records dropped for the image are cleared by programming alone,
+     * the index is erased once at most. */
+    CHECK(index_erases - erases <= 1);
+    check_layout();
+    return slot;
+}
+
+static bool resident(unsigned int g, uint32_t size)
+{
+    return rom_slots_find(&slots, game_name(g), size, game_header(g)) >= 0;
+}
+
+int main(void)
+{
+    uint32_t offset;
+
+    /* First fit from the start of the region, in whole blocks. */
+    reset();
+    CHECK(load(0, 32 * KB, false, &offset) >= 0);
+    CHECK_EQ(offset, START);
+    CHECK(load(1, 100 * KB, false, &offset) >= 0);
+    CHECK_EQ(offset, START + 64 * KB);
+    CHECK(load(2, 256 * KB, false, &offset) >= 0);
+    CHECK_EQ(offset, START + 192 * KB);
+    CHECK_EQ(rom_slots_latest(&slots), 2);
+    /* Playing a resident game moves nothing. */
+    CHECK(load(0, 32 * KB, false, &offset) >= 0);
+    CHECK_EQ(offset, START);
+    CHECK_EQ(programs, 3);
+
+    /* Too large for the region: refused, nothing dropped. */
+    CHECK_EQ(rom_slots_alloc(&slots, START, END, END - START + 1, &offset), -1);
+    CHECK(resident(0, 32 * KB) && resident(1, 100 * KB) && resident(2, 256 * KB));
+
+    /* Full: the least recently used go first, until a gap fits. Game 1
+     * is the oldest now, then 2. */
+    CHECK(load(3, 512 * KB, false, &offset) >= 0);
+    CHECK_EQ(offset, START + 448 * KB);
+    CHECK(load(4, 128 * KB, false, &offset) >= 0);
+    CHECK_EQ(offset, START + 64 * KB);
+    CHECK(!resident(1, 100 * KB));
+    CHECK(resident(0, 32 * KB) && resident(2, 256 * KB) && resident(3, 512 * KB));
+
+    /* Fragmentation: dropping games 2 and 0, the oldest, frees 384 KB but
+     * in three pieces, so game 3 goes too before the 320 KB image fits,
+     * although the block of game 0 never became part of its gap. */
+    CHECK(load(5, 320 * KB, false, &offset) >= 0);
+    CHECK(!resident(2, 256 * KB));
+    CHECK(!resident(0, 32 * KB));
+    CHECK(!resident(3, 512 * KB));
+    CHECK_EQ(offset, START + 192 * KB);
+    CHECK(resident(4, 128 * KB));
+
+    /* A damaged copy is dropped and the game reloaded into the space it
+     * held, and only the new record is found afterwards. */
+    reset();
+    CHECK(load(0, 256 * KB, false, &offset) >= 0);
+    CHECK(load(1, 256 * KB, false, &offset) >= 0);
+    uint32_t first = offset;
+    CHECK(load(2, 512 * KB, false, &offset) >= 0);
+    int slot = load(1, 256 * KB, true, &offset);
+    CHECK(slot >= 0);
+    CHECK_EQ(offset, first);
+    CHECK(resident(0, 256 * KB) && resident(2, 512 * KB));
+    unsigned int copies = 0;
+    for(unsigned int i = 0; i < ROM_SLOTS_ENTRIES; i++)
+        copies += rom_meta_matches(&slots.entry[i], game_name(1), 256 * KB, game_header(1));
+    CHECK_EQ(copies, 1);
+
+    /* Out of records before out of space: the 17th image takes the
+     * record of the least recently used one. */
+    reset();
+    for(unsigned int g = 0; g < ROM_SLOTS_ENTRIES; g++)
+        CHECK(load(g, 32 * KB, false, &offset) >= 0);
+    CHECK(load(ROM_SLOTS_ENTRIES, 32 * KB, false, &offset) >= 0);
+    CHECK(!resident(0, 32 * KB));
+    for(unsigned int g = 1; g <= ROM_SLOTS_ENTRIES; g++)
+        CHECK(resident(g, 32 * KB));
+
+    /* Random play: three favourites that fit together 70% of the time,
+     * among 12 games of 32 KB to 1 MB. */
+    static const uint32_t sizes[12] = {
+        32 * KB, 256 * KB, 512 * KB, 64 * KB, 1024 * KB, 256 * KB,
+        512 * KB, 960 * KB, 128 * KB, 32 * KB, 384 * KB, 64 * KB,
+    };
+    uint32_t seed = 1;
+    unsigned int hits = 0, loads = 0;
+    reset();
+    index_erases = index_programs = programs = 0;
+    memset(block_erases, 0, sizeof(block_erases));
+    for(unsigned int i = 0; i < 10000; i++)
+    {
+        unsigned int g = test_rand(&seed) % 10 < 7 ? test_rand(&seed) % 3 : test_rand(&seed) % 12;
+        bool was = resident(g, sizes[g]);
+        CHECK(load(g, sizes[g], false, &offset) >= 0);
+        CHECK(resident(g, sizes[g]));
+        CHECK_EQ(rom_slots_latest(&slots), rom_slots_find(&slots, game_name(g), sizes[g], game_header(g)));
+        hits += was;
+        loads++;
+    }
+    printf("%u loads: %u already in flash, %u programmed\n", loads, hits, programs);
+    printf("index sector: %u erases, %u programs\n", index_erases, index_programs);
+    CHECK(hits > loads / 2);
+
+    unsigned int least = block_erases[0], most = block_erases[0], total = 0;
+    printf("block erases:");
+    for(unsigned int b = 0; b < BLOCKS; b++)
+    {
+        printf(" %u", block_erases[b]);
+        least = block_erases[b] < least ? block_erases[b] : least;
+        most = block_erases[b] > most ? block_erases[b] : most;
+        total += block_erases[b];
+    }
+    printf("\nblock erases per 64 KB block: %u to %u, mean %.1f\n",
+            least, most, (double) total / BLOCKS);
+
+    return TEST_EXIT();
+}
@@ -0,0 +1,220 @@
+/**
+ * Copyright (C) 2024 by Vlastimil Slintak <slintak@uart.cz>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+ * THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/**
+ * Golden image test of the full screen scalers, and their cost per line.
+ *
+ * A test card is scaled to 220x176 with both modes and compared with a
+ * straightforward floating point reference: nearest takes the source pixel
+ * under the output pixel centre, blend mixes the two source pixels around
+ * it with the weight truncated to 1/32 and each RGB565 channel truncated.
+ * The images are also pinned by hash, so any change of the output is
+ * noticed. Run with an output directory to write them as PPM files.
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include "test.h"
+#include "gbcolors.h"
+#include "scaler.h"
+#include "lcd_line.h"
+
+#define SRC_W   SCALER_SRC_WIDTH
+#define SRC_H   SCALER_SRC_HEIGHT
+#define DST_W   SCALER_DST_WIDTH
+#define DST_H   SCALER_DST_HEIGHT
+
+/* Hashes of the test card scaled with palette 0x1C/0x03. */
+#define GOLDEN_NEAREST  0xCD441BEAu
+#define GOLDEN_BLEND    0x6597CDBEu
+
+static uint8_t card[SRC_H][SRC_W];
+static uint16_t __attribute__((aligned(4))) image[DST_H][DST_W];
+static uint16_t reference[DST_H][DST_W];
+
+/* Stripes, single pixels and a ramp of every colour, in all palettes. */
+static void make_card(void)
+{
+    for(int y = 0; y < SRC_H; y++)
+        for(int x = 0; x < SRC_W; x++)
+        {
+            uint8_t shade;
+            if(y < 16)
+                shade = x & 1 ? 3 : 0;
+            else if(y < 32)
+                shade = (x / 2) & 1 ? 3 : 0;
+            else if(y < 48)
+                shade = (x % 7 == 0) ? 3 : 1;
+            else if(y < 96)
+                shade = (x * 4 / SRC_W + y / 4) & 3;
+            else
+                shade = ((x ^ y) >> 1) & 3;
+            card[y][x] = (uint8_t) (((x / 12 + y / 12) % 3) << 4) | shade;
+        }
+}
+
+static uint16_t blend_reference(uint16_t a, uint16_t b, unsigned int w)
+{
+    unsigned int r = (((a >> 11) & 31) * (32 - w) + ((b >> 11) & 31) * w) / 32;
+    unsigned int g = (((a >> 5) & 63) * (32 - w) + ((b >> 5) & 63) * w) / 32;
+    unsigned int bl = ((a & 31) * (32 - w) + (b & 31) * w) / 32;
+    return (uint16_t) (r << 11 | g << 5 | bl);
+}
+
+static void scale_reference(const uint16_t *lut, scaler_mode_e mode)
+{
+    for(int y = 0; y < DST_H; y++)
+    {
+        int sy = (int) floor((y + 0.5) * SRC_H / DST_H);
+        for(int x = 0; x < DST_W; x++)
+        {
+            double centre = (x + 0.5) * SRC_W / DST_W;
+            if(mode == SCALER_MODE_NEAREST)
+            {
+                reference[y][x] = lut[card[sy][(int) floor(centre)]];
+                continue;
+            }
+            /* Left neighbour and weight of the right one, both edges
+             * clamped to the outermost pair. */
+            double s = centre - 0.5;
+            if(s < 0)
+                s = 0;
+            int left = (int) floor(s);
+            unsigned int w = (unsigned int) floor((s - left) * 32);
+            if(left >= SRC_W - 1)
+            {
+                left = SRC_W - 2;
+                w = 32;
+            }
+            reference[y][x] = blend_reference(lut[card[sy][left]],
+                    lut[card[sy][left + 1]], w);
+        }
+    }
+}
+
+/* As lcd_draw_line() sends it: each line repeated on its output rows. */
+static void scale(const uint16_t *lut, scaler_mode_e mode)
+{
+    memset(image, 0, sizeof(image));
+    for(int y = 0; y < SRC_H; y++)
+    {
+        if(scaler.y_count[y] == 0)
+            continue;
+        uint16_t *row = image[scaler.y_first[y]];
+        if(mode == SCALER_MODE_BLEND)
+            scaler_line_blend(lut, card[y], row);
+        else
+            scaler_line_nearest(lut, card[y], row);
+        for(int i = 1; i < scaler.y_count[y]; i++)
+            memcpy(image[scaler.y_first[y] + i], row, sizeof(image[0]));
+    }
+}
+
+static uint32_t image_hash(void)
+{
+    uint32_t hash = 2166136261u;
+    const uint8_t *bytes = (const uint8_t *) image;
+    for(size_t i = 0; i < sizeof(image); i++)
+        hash = (hash ^ bytes[i]) * 16777619u;
+    return hash;
+}
+
+static void write_ppm(const char *dir, const char *name)
+{
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s.ppm", dir, name);
+    FILE *f = fopen(path, "wb");
+    if(f == NULL)
+        return;
+    fprintf(f, "P6\n%d %d\n255\n", DST_W, DST_H);
+    for(int y = 0; y < DST_H; y++)
+        for(int x = 0; x < DST_W; x++)
+        {
+            uint16_t c = image[y][x];
+            uint8_t rgb[3] = { (c >> 11) << 3, ((c >> 5) & 63) << 2, (c & 31) << 3 };
+            fwrite(rgb, 1, 3, f);
+        }
+    fclose(f);
+}
+
+static double bench_ns(const uint16_t *lut, scaler_mode_e mode)
+{
+    volatile uint16_t sink = 0;
+    const int rounds = 200;
+    uint64_t start = test_now_ns();
+    for(int r = 0; r < rounds; r++)
+        for(int y = 0; y < SRC_H; y++)
+        {
+            if(mode == SCALER_MODE_BLEND)
+                scaler_line_blend(lut, card[y], image[0]);
+            else if(mode == SCALER_MODE_NEAREST)
+                scaler_line_nearest(lut, card[y], image[0]);
+            else
+                lcd_line_rgb565(lut, card[y], image[0], SRC_W);
+            sink += image[0][y];
+        }
+    (void) sink;
+    return (double) (test_now_ns() - start) / (rounds * SRC_H);
+}
+
+int main(int argc, char **argv)
+{
+    palette_t palette;
+    palette_lut_t lut;
+
+    scaler_init();
+    get_colour_palette(palette, 0x1C, 0x03);
+    build_palette_lut(palette, lut);
+    make_card();
+
+    /* Every output row comes from exactly one source line, in order. */
+    int rows = 0;
+    for(int y = 0; y < SRC_H; y++)
+    {
+        CHECK(scaler.y_count[y] <= 2);
+        if(scaler.y_count[y] > 0)
+            CHECK_EQ(scaler.y_first[y], rows);
+        rows += scaler.y_count[y];
+    }
+    CHECK_EQ(rows, DST_H);
+
+    static const struct {
+        scaler_mode_e mode;
+        const char *name;
+        uint32_t golden;
+    } modes[] = {
+        { SCALER_MODE_NEAREST, "nearest", GOLDEN_NEAREST },
+        { SCALER_MODE_BLEND, "blend", GOLDEN_BLEND },
+    };
+    for(unsigned int m = 0; m < 2; m++)
+    {
+        scale(lut, modes[m].mode);
+        scale_reference(lut, modes[m].mode);
+        CHECK(memcmp(image, reference, sizeof(image)) == 0);
+        uint32_t hash = image_hash();
+        printf("%-8s image hash 0x%08X\n", modes[m].name, hash);
+        CHECK_EQ(hash, modes[m].golden);
+        if(argc > 1)
+            write_ppm(argv[1], modes[m].name);
+    }
+
+    printf("native:  %.1f ns/line\n", bench_ns(lut, SCALER_MODE_NATIVE));
+    printf("nearest: %.1f ns/line\n", bench_ns(lut, SCALER_MODE_NEAREST));
+    printf("blend:   %.1f ns/line\n", bench_ns(lut, SCALER_MODE_BLEND));
+
+    return TEST_EXIT();
+}